@@ -0,0 +1,650 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numbers>
+
+#include "apu.h"
+
+// duty patterns of the pulse channels, bit n is the output of duty step n
+constexpr std::array<u8, 4> DUTY_PATTERNS = { 0x80, 0x81, 0xE1, 0x7E };
+
+// register values left behind by the DMG boot ROM, 0xFF10-0xFF26
+constexpr std::array<u8, 0x17> POST_BOOT_REGISTERS = {
+    0x80, 0xBF, 0xF3, 0xFF, 0xBF, // NR10-NR14
+    0x00, 0x3F, 0x00, 0xFF, 0xBF, // NR21-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR30-NR34
+    0x00, 0xFF, 0x00, 0x00, 0xBF, // NR41-NR44
+    0x77, 0xF3, 0xF1, // NR50-NR52
+};
+
+// pulse steps shorter than this put the whole waveform above 32 kHz, only its average is audible
+constexpr u32 PULSE_ALIAS_PERIOD = 16;
+
+// 4 channels x 15 levels x 8 volume steps stay within the i16 output range
+constexpr i32 AMPLITUDE_SCALE = 64;
+
+using BlipKernel = std::array<std::array<i32, BLIP_TAPS>, BLIP_PHASES>;
+
+// windowed sinc impulses, one per sub-sample phase, each summing to exactly 1 << BLIP_UNIT_BITS
+static const BlipKernel& blip_kernel()
+{
+    static const BlipKernel kernel = [] {
+        BlipKernel result {};
+        constexpr double cutoff = 0.9; // slightly below Nyquist to keep the transition band short
+        constexpr double half = BLIP_TAPS / 2;
+        constexpr i32 unit = 1 << BLIP_UNIT_BITS;
+
+        for (int phase = 0; phase < BLIP_PHASES; ++phase) {
+            std::array<double, BLIP_TAPS> taps {};
+            double sum = 0.0;
+            for (int i = 0; i < BLIP_TAPS; ++i) {
+                const double x = (i - half) + 0.5 - static_cast<double>(phase) / BLIP_PHASES;
+                const double sinc = x == 0.0 ? 1.0 : std::sin(std::numbers::pi * cutoff * x) / (std::numbers::pi * cutoff * x);
+                const double window = 0.42 + 0.5 * std::cos(std::numbers::pi * x / half) + 0.08 * std::cos(2.0 * std::numbers::pi * x / half);
+                taps[i] = sinc * std::max(window, 0.0);
+                sum += taps[i];
+            }
+
+            i32 total = 0;
+            for (int i = 0; i < BLIP_TAPS; ++i) {
+                result[phase][i] = static_cast<i32>(std::lround(taps[i] / sum * unit));
+                total += result[phase][i];
+            }
+            result[phase][BLIP_TAPS / 2] += unit - total; // rounding error goes to the center tap
+        }
+        return result;
+    }();
+    return kernel;
+}
+
+void BlipBuffer::set_rates(double clock_rate, double sample_rate)
+{
+    factor = static_cast<u64>(std::ldexp(sample_rate / clock_rate, 32));
+}
+
+// a muted APU never synthesizes, so instances without audio output skip the 64KB of both buffers
+void BlipBuffer::allocate()
+{
+    buffer.resize(BLIP_CAPACITY + BLIP_TAPS, 0);
+}
+
+void BlipBuffer::clear()
+{
+    offset = 0;
+    integrator = 0;
+    available = 0;
+    std::fill(buffer.begin(), buffer.end(), 0);
+}
+
+void BlipBuffer::add_delta(u32 clock_time, i32 delta)
+{
+    const u64 position = offset + clock_time * factor;
+    const size_t index = static_cast<size_t>(position >> 32);
+    if (index + BLIP_TAPS > buffer.size()) {
+        return; // frame far longer than the buffer, nothing sensible to keep
+    }
+
+    const auto& taps = blip_kernel()[(position >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    i32* out = buffer.data() + index;
+    for (int i = 0; i < BLIP_TAPS; ++i) {
+        out[i] += taps[i] * delta;
+    }
+}
+
+void BlipBuffer::end_frame(u32 clock_duration)
+{
+    offset += clock_duration * factor;
+    available = std::min(static_cast<size_t>(offset >> 32), BLIP_CAPACITY);
+}
+
+size_t BlipBuffer::read_samples(i16* out, size_t count, size_t stride)
+{
+    count = std::min(count, available);
+
+    i32 sum = integrator;
+    for (size_t i = 0; i < count; ++i) {
+        if (out) {
+            const i32 sample = sum >> BLIP_UNIT_BITS;
+            out[i * stride] = static_cast<i16>(std::clamp<i32>(sample, std::numeric_limits<i16>::min(), std::numeric_limits<i16>::max()));
+        }
+        sum += buffer[i];
+        sum -= sum >> BLIP_BASS_SHIFT;
+    }
+    integrator = sum;
+
+    // move the unread samples and the pending kernel tails to the front
+    const size_t remaining = std::min(static_cast<size_t>(offset >> 32) + BLIP_TAPS, buffer.size()) - count;
+    std::memmove(buffer.data(), buffer.data() + count, remaining * sizeof(i32));
+    std::fill(buffer.begin() + remaining, buffer.begin() + remaining + count, 0);
+    offset -= static_cast<u64>(count) << 32;
+    available -= count;
+    return count;
+}
+
+size_t BlipBuffer::live_size() const
+{
+    return std::min(static_cast<size_t>(offset >> 32) + BLIP_TAPS, buffer.size());
+}
+
+// only the live part of the buffer is stored, a state is then a few KB instead of 32
+void BlipBuffer::save_state(SaveState& state) const
+{
+    state.put(offset);
+    state.put(integrator);
+    state.put(available);
+    const u32 live = static_cast<u32>(live_size());
+    state.put(live);
+    state.put_bytes(buffer.data(), live * sizeof(i32));
+}
+
+void BlipBuffer::load_state(SaveStateReader& reader)
+{
+    const size_t old_size = live_size();
+    reader.get(offset);
+    reader.get(integrator);
+    reader.get(available);
+    u32 new_size = 0;
+    reader.get(new_size);
+    if (new_size > BLIP_CAPACITY + BLIP_TAPS) {
+        reader.ok = false;
+        return;
+    }
+    if (new_size) {
+        allocate();
+    }
+    reader.get_bytes(buffer.data(), new_size * sizeof(i32));
+    if (old_size > new_size) {
+        std::fill(buffer.begin() + new_size, buffer.begin() + old_size, 0);
+    }
+}
+
+void Apu::reset(u64 now)
+{
+    registers.fill(0);
+    std::copy(POST_BOOT_REGISTERS.begin(), POST_BOOT_REGISTERS.end(), registers.begin());
+    channels = {};
+    powered = true;
+    sequencer_step = 0;
+    next_sequencer_step = now + FRAME_SEQUENCER_PERIOD;
+    current_cycle = now;
+    frame_start_cycle = now;
+    sweep_enabled = false;
+    sweep_shadow_frequency = 0;
+    sweep_timer = 8;
+
+    // channel 1 is still enabled after the boot chime, its envelope has decayed to silence
+    ApuChannel& ch1 = channels[0];
+    ch1.enabled = true;
+    ch1.dac_enabled = true;
+    ch1.duty = 2;
+    ch1.frequency = 0x7FF;
+    ch1.envelope_period = 3;
+    ch1.envelope_timer = 3;
+    ch1.next_step = now + channel_period(0);
+
+    set_sample_rate(AUDIO_SAMPLE_RATE);
+    left.clear();
+    right.clear();
+}
+
+void Apu::set_muted(bool mute, u64 now)
+{
+    run_until(now);
+    if (mute == muted) {
+        return;
+    }
+
+    muted = mute;
+    if (!muted) {
+        left.allocate();
+        right.allocate();
+        // waveform positions were not tracked while muted, restart them from here
+        for (ApuChannel& ch : channels) {
+            ch.next_step = std::max(ch.next_step, now);
+            ch.amplitude_left = 0;
+            ch.amplitude_right = 0;
+        }
+        left.clear();
+        right.clear();
+        frame_start_cycle = now;
+        update_mix(now);
+    }
+}
+
+void Apu::set_sample_rate(double sample_rate)
+{
+    left.set_rates(APU_CLOCK_RATE, sample_rate);
+    right.set_rates(APU_CLOCK_RATE, sample_rate);
+}
+
+u8 Apu::read(u16 addr, u64 now)
+{
+    if (addr == 0xFF26) {
+        // channel status is the only register state that changes on its own
+        run_until(now);
+        u8 status = powered ? 0x80 : 0x00;
+        for (int i = 0; i < 4; ++i) {
+            if (channels[i].enabled) {
+                status |= static_cast<u8>(1 << i);
+            }
+        }
+        return status;
+    }
+    return registers[addr - 0xFF10];
+}
+
+void Apu::write(u16 addr, u8 value, u64 now)
+{
+    run_until(now);
+
+    const size_t reg = addr - 0xFF10;
+    if (reg >= 0x20) {
+        registers[reg] = value; // wave RAM
+        return;
+    }
+
+    if (addr == 0xFF26) {
+        const bool power = value & 0x80;
+        if (powered && !power) {
+            // powering off clears every sound register and silences all channels
+            std::fill(registers.begin(), registers.begin() + 0x16, 0);
+            for (ApuChannel& ch : channels) {
+                ch.enabled = false;
+                ch.dac_enabled = false;
+                ch.length_enabled = false;
+                ch.length_counter = 0;
+            }
+            update_mix(now);
+        } else if (!powered && power) {
+            sequencer_step = 0;
+            next_sequencer_step = now + FRAME_SEQUENCER_PERIOD;
+        }
+        powered = power;
+        registers[reg] = value & 0x80;
+        return;
+    }
+
+    if (!powered) {
+        return;
+    }
+
+    registers[reg] = value;
+    if (reg >= 0x14) {
+        update_mix(now); // NR50/NR51 change every channel's contribution
+        return;
+    }
+
+    const int index = static_cast<int>(reg / 5);
+    ApuChannel& ch = channels[index];
+    switch (reg % 5) {
+    case 0:
+        if (index == 2) {
+            ch.dac_enabled = value & 0x80;
+            ch.enabled = ch.enabled && ch.dac_enabled;
+        }
+        break;
+    case 1:
+        if (index == 2) {
+            ch.length_counter = static_cast<u16>(256 - value);
+        } else {
+            ch.length_counter = static_cast<u16>(64 - (value & 0x3F));
+        }
+        if (index < 2) {
+            ch.duty = value >> 6;
+        }
+        break;
+    case 2:
+        if (index != 2) {
+            ch.dac_enabled = value & 0xF8;
+            ch.enabled = ch.enabled && ch.dac_enabled;
+        }
+        break;
+    case 3:
+        if (index < 3) {
+            ch.frequency = static_cast<u16>((ch.frequency & 0x700) | value);
+        }
+        break;
+    case 4:
+        if (index < 3) {
+            ch.frequency = static_cast<u16>((ch.frequency & 0xFF) | ((value & 0x07) << 8));
+        }
+        ch.length_enabled = value & 0x40;
+        if (value & 0x80) {
+            trigger(index);
+        }
+        break;
+    }
+
+    update_level(index, now);
+}
+
+void Apu::end_frame(u64 now)
+{
+    run_until(now);
+    if (muted) {
+        return;
+    }
+
+    const u32 duration = static_cast<u32>(now - frame_start_cycle);
+    left.end_frame(duration);
+    right.end_frame(duration);
+    frame_start_cycle = now;
+
+    // nobody is draining the output, keep only the most recent samples
+    if (left.available > BLIP_CAPACITY / 2) {
+        const size_t excess = left.available - BLIP_CAPACITY / 2;
+        left.read_samples(nullptr, excess, 1);
+        right.read_samples(nullptr, excess, 1);
+    }
+}
+
+size_t Apu::samples_available() const
+{
+    return muted ? 0 : left.available;
+}
+
+size_t Apu::read_samples(i16* out, size_t frames)
+{
+    if (muted) {
+        return 0;
+    }
+    const size_t count = left.read_samples(out, frames, 2);
+    right.read_samples(out + 1, count, 2);
+    return count;
+}
+
+// the sample rate (factor) is left alone, it belongs to the output and not to the emulated state
+void Apu::save_state(SaveState& state) const
+{
+    state.put(registers);
+    state.put(channels);
+    state.put(powered);
+    state.put(muted);
+    state.put(sequencer_step);
+    state.put(next_sequencer_step);
+    state.put(current_cycle);
+    state.put(frame_start_cycle);
+    state.put(sweep_enabled);
+    state.put(sweep_shadow_frequency);
+    state.put(sweep_timer);
+    left.save_state(state);
+    right.save_state(state);
+}
+
+void Apu::load_state(SaveStateReader& reader)
+{
+    reader.get(registers);
+    reader.get(channels);
+    reader.get(powered);
+    reader.get(muted);
+    if (!muted) {
+        left.allocate();
+        right.allocate();
+    }
+    reader.get(sequencer_step);
+    reader.get(next_sequencer_step);
+    reader.get(current_cycle);
+    reader.get(frame_start_cycle);
+    reader.get(sweep_enabled);
+    reader.get(sweep_shadow_frequency);
+    reader.get(sweep_timer);
+    left.load_state(reader);
+    right.load_state(reader);
+}
+
+void Apu::run_until(u64 now)
+{
+    if (now <= current_cycle) {
+        return;
+    }
+
+    while (next_sequencer_step <= now) {
+        const bool any_enabled = std::any_of(channels.begin(), channels.end(), [](const ApuChannel& ch) { return ch.enabled; });
+        if (!any_enabled) {
+            // nothing audible or visible changes until the next register write, skip ahead
+            const u64 steps = (now - next_sequencer_step) / FRAME_SEQUENCER_PERIOD + 1;
+            sequencer_step = static_cast<u8>((sequencer_step + steps) & 7);
+            next_sequencer_step += steps * FRAME_SEQUENCER_PERIOD;
+            break;
+        }
+        if (!muted) {
+            run_channels(next_sequencer_step);
+        }
+        clock_sequencer();
+    }
+
+    if (!muted) {
+        run_channels(now);
+    }
+    current_cycle = now;
+}
+
+void Apu::run_channels(u64 until)
+{
+    for (int i = 0; i < 4; ++i) {
+        ApuChannel& ch = channels[i];
+        if (!ch.enabled) {
+            continue;
+        }
+
+        const u32 period = channel_period(i);
+        if (period == 0 || (i < 2 && period < PULSE_ALIAS_PERIOD)) {
+            // noise with a stopped clock, or a pulse far above the audible range (its level is the duty average)
+            ch.next_step = std::max(ch.next_step, until);
+            continue;
+        }
+
+        // only steps that change the output produce a delta, everything else is just counting
+        while (ch.next_step < until) {
+            if (i < 2) {
+                ch.position = (ch.position + 1) & 7;
+            } else if (i == 2) {
+                ch.position = (ch.position + 1) & 31;
+            } else {
+                const u16 bit = (ch.lfsr ^ (ch.lfsr >> 1)) & 1;
+                ch.lfsr = static_cast<u16>((ch.lfsr >> 1) | (bit << 14));
+                if (registers[0x12] & 0x08) {
+                    ch.lfsr = static_cast<u16>((ch.lfsr & ~0x40) | (bit << 6)); // 7-bit mode
+                }
+            }
+            update_level(i, ch.next_step);
+            ch.next_step += period;
+        }
+    }
+}
+
+void Apu::clock_sequencer()
+{
+    const u64 time = next_sequencer_step;
+
+    if ((sequencer_step & 1) == 0) {
+        for (ApuChannel& ch : channels) {
+            clock_length(ch);
+        }
+    }
+    if (sequencer_step == 2 || sequencer_step == 6) {
+        clock_sweep();
+    }
+    if (sequencer_step == 7) {
+        clock_envelope(channels[0]);
+        clock_envelope(channels[1]);
+        clock_envelope(channels[3]);
+    }
+
+    sequencer_step = (sequencer_step + 1) & 7;
+    next_sequencer_step += FRAME_SEQUENCER_PERIOD;
+
+    for (int i = 0; i < 4; ++i) {
+        update_level(i, time);
+    }
+}
+
+void Apu::clock_length(ApuChannel& ch)
+{
+    if (ch.length_enabled && ch.length_counter > 0 && --ch.length_counter == 0) {
+        ch.enabled = false;
+    }
+}
+
+void Apu::clock_envelope(ApuChannel& ch)
+{
+    if (ch.envelope_period == 0 || --ch.envelope_timer > 0) {
+        return;
+    }
+
+    ch.envelope_timer = ch.envelope_period;
+    if (ch.envelope_increase && ch.volume < 15) {
+        ch.volume++;
+    } else if (!ch.envelope_increase && ch.volume > 0) {
+        ch.volume--;
+    }
+}
+
+void Apu::clock_sweep()
+{
+    if (--sweep_timer > 0) {
+        return;
+    }
+
+    const u8 period = (registers[0x00] >> 4) & 0x07;
+    const u8 shift = registers[0x00] & 0x07;
+    sweep_timer = period ? period : 8;
+    if (!sweep_enabled || period == 0) {
+        return;
+    }
+
+    const u16 frequency = sweep_next_frequency();
+    if (frequency <= 0x7FF && shift) {
+        sweep_shadow_frequency = frequency;
+        channels[0].frequency = frequency;
+        sweep_next_frequency(); // second overflow check with the new frequency
+    }
+}
+
+u16 Apu::sweep_next_frequency()
+{
+    const u16 delta = sweep_shadow_frequency >> (registers[0x00] & 0x07);
+    const u16 frequency = (registers[0x00] & 0x08) ? static_cast<u16>(sweep_shadow_frequency - delta)
+                                                   : static_cast<u16>(sweep_shadow_frequency + delta);
+    if (frequency > 0x7FF) {
+        channels[0].enabled = false;
+    }
+    return frequency;
+}
+
+void Apu::trigger(int index)
+{
+    ApuChannel& ch = channels[index];
+    const size_t base = static_cast<size_t>(index) * 5;
+
+    ch.enabled = ch.dac_enabled;
+    if (ch.length_counter == 0) {
+        ch.length_counter = index == 2 ? 256 : 64;
+    }
+    ch.next_step = current_cycle + channel_period(index);
+
+    if (index == 2) {
+        ch.position = 0;
+    } else {
+        const u8 envelope = registers[base + 2];
+        ch.volume = envelope >> 4;
+        ch.envelope_increase = envelope & 0x08;
+        ch.envelope_period = envelope & 0x07;
+        ch.envelope_timer = ch.envelope_period;
+    }
+
+    if (index == 3) {
+        ch.lfsr = 0x7FFF;
+    }
+
+    if (index == 0) {
+        const u8 period = (registers[0x00] >> 4) & 0x07;
+        const u8 shift = registers[0x00] & 0x07;
+        sweep_shadow_frequency = ch.frequency;
+        sweep_timer = period ? period : 8;
+        sweep_enabled = period || shift;
+        if (shift) {
+            sweep_next_frequency();
+        }
+    }
+}
+
+u32 Apu::channel_period(int index) const
+{
+    if (index < 2) {
+        return (2048u - channels[index].frequency) * 4;
+    }
+    if (index == 2) {
+        return (2048u - channels[index].frequency) * 2;
+    }
+
+    const u8 nr43 = registers[0x12];
+    const u8 shift = nr43 >> 4;
+    if (shift >= 14) {
+        return 0; // the LFSR is not clocked at all
+    }
+    const u32 divisor = (nr43 & 0x07) ? (nr43 & 0x07) * 16u : 8u;
+    return divisor << shift;
+}
+
+u8 Apu::channel_level(int index) const
+{
+    const ApuChannel& ch = channels[index];
+    if (!ch.enabled || !ch.dac_enabled) {
+        return 0;
+    }
+
+    switch (index) {
+    case 0:
+    case 1:
+        if (channel_period(index) < PULSE_ALIAS_PERIOD) {
+            return static_cast<u8>(ch.volume * std::popcount(DUTY_PATTERNS[ch.duty]) / 8);
+        }
+        return ((DUTY_PATTERNS[ch.duty] >> ch.position) & 1) ? ch.volume : 0;
+    case 2: {
+        const u8 code = (registers[0x0C] >> 5) & 0x03;
+        if (code == 0) {
+            return 0;
+        }
+        const u8 sample_byte = registers[0x20 + ch.position / 2];
+        const u8 sample = (ch.position & 1) ? (sample_byte & 0x0F) : (sample_byte >> 4);
+        return static_cast<u8>(sample >> (code - 1));
+    }
+    default:
+        return (ch.lfsr & 1) ? 0 : ch.volume;
+    }
+}
+
+void Apu::update_level(int index, u64 time)
+{
+    if (muted) {
+        return;
+    }
+
+    ApuChannel& ch = channels[index];
+    ch.level = channel_level(index);
+
+    const u8 nr50 = registers[0x14];
+    const u8 nr51 = registers[0x15];
+    const i32 amplitude_left = (nr51 & (0x10 << index)) ? ch.level * (((nr50 >> 4) & 0x07) + 1) * AMPLITUDE_SCALE : 0;
+    const i32 amplitude_right = (nr51 & (0x01 << index)) ? ch.level * ((nr50 & 0x07) + 1) * AMPLITUDE_SCALE : 0;
+
+    const u32 frame_time = static_cast<u32>(time - frame_start_cycle);
+    if (amplitude_left != ch.amplitude_left) {
+        left.add_delta(frame_time, amplitude_left - ch.amplitude_left);
+        ch.amplitude_left = amplitude_left;
+    }
+    if (amplitude_right != ch.amplitude_right) {
+        right.add_delta(frame_time, amplitude_right - ch.amplitude_right);
+        ch.amplitude_right = amplitude_right;
+    }
+}
+
+void Apu::update_mix(u64 time)
+{
+    for (int i = 0; i < 4; ++i) {
+        update_level(i, time);
+    }
+}
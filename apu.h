@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+#include "save_state.h"
+#include "types.h"
+
+constexpr u32 APU_CLOCK_RATE = 4194304; // APU timers run at the normal speed clock, also in CGB double speed
+constexpr u32 AUDIO_SAMPLE_RATE = 48000; // default output sample rate
+constexpr u32 FRAME_SEQUENCER_PERIOD = 8192; // cycles between frame sequencer steps (512 Hz)
+constexpr int BLIP_PHASE_BITS = 5; // sub-sample resolution of a step, 32 phases
+constexpr int BLIP_PHASES = 1 << BLIP_PHASE_BITS;
+constexpr int BLIP_TAPS = 16; // length of the band-limited step kernel in output samples
+constexpr int BLIP_UNIT_BITS = 12; // kernel taps of one phase sum to 1 << BLIP_UNIT_BITS
+constexpr int BLIP_BASS_SHIFT = 9; // leak of the output integrator, high-pass at roughly 15 Hz
+constexpr size_t BLIP_CAPACITY = 8192; // output samples a buffer can hold before the oldest are dropped
+
+// band-limited step synthesis: amplitude changes are added as pre-filtered steps
+// at sub-sample precision, output samples are the running sum of those steps
+struct BlipBuffer {
+    u64 factor; // output samples per clock, 32.32 fixed point
+    u64 offset; // position of the current frame start, 32.32 fixed point
+    i32 integrator; // running sum carried over between reads
+    size_t available; // complete output samples ready to be read
+    std::pmr::vector<i32> buffer; // BLIP_CAPACITY + BLIP_TAPS once allocate ran, empty while nothing was synthesized
+
+    explicit BlipBuffer(std::pmr::memory_resource* resource)
+        : buffer(resource)
+    {
+    }
+
+    void allocate();
+    void set_rates(double clock_rate, double sample_rate);
+    void clear();
+    void add_delta(u32 clock_time, i32 delta); // clock_time is relative to the current frame start
+    void end_frame(u32 clock_duration);
+    size_t read_samples(i16* out, size_t count, size_t stride); // out may be nullptr to drop samples
+    size_t live_size() const; // samples plus pending kernel tails, the rest of buffer is zero
+    void save_state(SaveState& state) const;
+    void load_state(SaveStateReader& reader);
+};
+
+// shared by both pulse channels, the wave and the noise channel
+struct ApuChannel {
+    bool enabled; // channel is playing (NR52 status bit)
+    bool dac_enabled;
+    bool length_enabled;
+    u16 length_counter;
+    u16 frequency; // 11-bit period value (pulse and wave)
+    u64 next_step; // cycle at which the waveform advances next
+    u8 duty; // pulse duty pattern (0-3)
+    u8 position; // pulse duty step (0-7) or wave sample index (0-31)
+    u8 volume; // current envelope volume (0-15)
+    u8 envelope_period;
+    u8 envelope_timer;
+    bool envelope_increase;
+    u16 lfsr; // noise shift register
+    u8 level; // current digital output (0-15)
+    i32 amplitude_left; // last amplitude handed to the blip buffers
+    i32 amplitude_right;
+};
+
+struct Apu {
+    std::array<u8, 0x30> registers; // raw contents of 0xFF10-0xFF3F (wave RAM included)
+    std::array<ApuChannel, 4> channels;
+    bool powered; // NR52 bit 7
+    bool muted; // skip synthesis, only keep register visible state up to date
+    u8 sequencer_step; // frame sequencer position (0-7)
+    u64 next_sequencer_step; // cycle of the next frame sequencer clock
+    u64 current_cycle; // cycle the APU state has been brought up to
+    u64 frame_start_cycle; // cycle matching the start of the blip buffer frame
+    bool sweep_enabled;
+    u16 sweep_shadow_frequency;
+    u8 sweep_timer;
+    BlipBuffer left;
+    BlipBuffer right;
+
+    explicit Apu(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : left(resource)
+        , right(resource)
+    {
+    }
+
+    void reset(u64 now);
+    void set_muted(bool mute, u64 now);
+    void set_sample_rate(double sample_rate);
+    u8 read(u16 addr, u64 now);
+    void write(u16 addr, u8 value, u64 now);
+    void end_frame(u64 now);
+    size_t samples_available() const;
+    size_t read_samples(i16* out, size_t frames); // interleaved stereo, returns frames read
+    void save_state(SaveState& state) const;
+    void load_state(SaveStateReader& reader);
+
+private:
+    void run_until(u64 now);
+    void run_channels(u64 until);
+    void skip_sequencer(u64 now);
+    void clock_sequencer();
+    void clock_length(ApuChannel& ch);
+    void clock_envelope(ApuChannel& ch);
+    void clock_sweep();
+    u16 sweep_next_frequency();
+    void trigger(int index);
+    u32 channel_period(int index) const;
+    u8 channel_level(int index) const;
+    void update_level(int index, u64 time);
+    void update_mix(u64 time);
+};
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "gameboy.h"
+
+static size_t align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+InstanceArena::~InstanceArena()
+{
+    close();
+}
+
+bool InstanceArena::open(size_t bytes)
+{
+    close();
+    const size_t size = align_up(bytes, ARENA_HUGE_PAGE_SIZE);
+
+    // explicit huge pages only exist when the administrator reserved enough of them (reserved up front,
+    // a later shortage would be a SIGBUS), transparent ones are the fallback
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_pages = memory != MAP_FAILED;
+    if (!huge_pages) {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            std::cerr << "Failed to map instance arena of " << size << " bytes (" << std::strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        madvise(memory, size, MADV_HUGEPAGE);
+    }
+
+    // pages are placed when first touched, possibly by another thread, so the node is set explicitly.
+    // preferred rather than bound, a full node then spills over instead of failing
+    unsigned cpu = 0;
+    unsigned node = 0;
+    numa_node = -1;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < sizeof(unsigned long) * 8) {
+        const unsigned long node_mask = 1UL << node;
+        if (syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8, 0) == 0) {
+            numa_node = static_cast<int>(node);
+        }
+    }
+
+    mapping = static_cast<u8*>(memory);
+    mapping_size = size;
+    used = 0;
+    free_lists.clear();
+    free_lists.reserve(ARENA_SIZE_CLASSES);
+    return true;
+}
+
+// instances still in the arena are not destroyed, destroy them first
+void InstanceArena::close()
+{
+    if (!mapping) {
+        return;
+    }
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+    used = 0;
+    free_lists.clear();
+}
+
+Gameboy* InstanceArena::create(const std::string& rom_path, bool use_save_file)
+{
+    void* memory = nullptr;
+    try {
+        memory = allocate(sizeof(Gameboy), alignof(Gameboy));
+        return new (memory) Gameboy(rom_path, use_save_file, this);
+    } catch (const std::bad_alloc&) {
+        if (memory) {
+            deallocate(memory, sizeof(Gameboy), alignof(Gameboy));
+        }
+        std::cerr << "Instance arena is full (" << used << " of " << mapping_size << " bytes used)" << std::endl;
+        return nullptr;
+    }
+}
+
+void InstanceArena::destroy(Gameboy* gb)
+{
+    if (!gb) {
+        return;
+    }
+    gb->~Gameboy();
+    deallocate(gb, sizeof(Gameboy), alignof(Gameboy));
+}
+
+void* InstanceArena::do_allocate(size_t bytes, size_t alignment)
+{
+    if (alignment > ARENA_ALIGNMENT) {
+        throw std::bad_alloc();
+    }
+
+    const size_t size = align_up(std::max<size_t>(bytes, 1), ARENA_ALIGNMENT);
+    FreeList& list = free_list(size);
+    if (list.head) {
+        void* block = list.head;
+        std::memcpy(&list.head, block, sizeof(void*));
+        return block;
+    }
+
+    if (!mapping || mapping_size - used < size) {
+        throw std::bad_alloc();
+    }
+    void* block = mapping + used;
+    used += size;
+    return block;
+}
+
+void InstanceArena::do_deallocate(void* block, size_t bytes, size_t)
+{
+    FreeList& list = free_list(align_up(std::max<size_t>(bytes, 1), ARENA_ALIGNMENT));
+    std::memcpy(block, &list.head, sizeof(void*));
+    list.head = block;
+}
+
+// a handful of sizes per ROM, a linear search beats anything fancier
+InstanceArena::FreeList& InstanceArena::free_list(size_t size)
+{
+    for (FreeList& list : free_lists) {
+        if (list.size == size) {
+            return list;
+        }
+    }
+    return free_lists.emplace_back(FreeList { size, nullptr });
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+struct Gameboy;
+
+constexpr size_t ARENA_ALIGNMENT = 64; // every block starts on its own cache line
+constexpr size_t ARENA_HUGE_PAGE_SIZE = 2 << 20;
+constexpr size_t ARENA_SIZE_CLASSES = 32; // distinct block sizes before the size class table has to grow
+constexpr size_t ARENA_INSTANCE_RESERVE = 1 << 20; // address space per instance, only touched pages cost memory
+
+// per worker storage for many instances of one ROM. a single mapping, on huge pages where the system
+// has them and bound to the NUMA node of the thread that opens it, is handed out front to back.
+// freed blocks go to a free list per size, and since all instances of one ROM ask for the same
+// sizes, destroying and creating instances after the first round never touches the heap.
+// not thread safe, one arena per worker thread or process
+struct InstanceArena final : std::pmr::memory_resource {
+    struct FreeList {
+        size_t size;
+        void* head; // the first bytes of every free block point to the next one
+    };
+
+    u8* mapping = nullptr;
+    size_t mapping_size = 0;
+    size_t used = 0; // bytes handed out from the mapping so far, free blocks included
+    bool huge_pages = false; // explicit huge pages, otherwise transparent ones were asked for
+    int numa_node = -1; // node the mapping is bound to (-1 = not bound)
+    std::vector<FreeList> free_lists;
+
+    InstanceArena() = default;
+    InstanceArena(const InstanceArena&) = delete;
+    InstanceArena& operator=(const InstanceArena&) = delete;
+    ~InstanceArena() override;
+
+    bool open(size_t bytes);
+    void close();
+
+    // the instance and all of its buffers come from the arena, nullptr once it is full
+    Gameboy* create(const std::string& rom_path, bool use_save_file = false);
+    void destroy(Gameboy* gb);
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* block, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    FreeList& free_list(size_t size);
+};
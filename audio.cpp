@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "audio.h"
+
+#ifndef HEADLESS
+#include "raylib.h"
+#endif
+
+constexpr size_t AUDIO_RING_MASK = AUDIO_RING_FRAMES - 1;
+static_assert((AUDIO_RING_FRAMES & AUDIO_RING_MASK) == 0, "ring size must be a power of two");
+
+size_t AudioRing::size() const
+{
+    return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_acquire);
+}
+
+size_t AudioRing::push(const i16* frames, size_t count)
+{
+    const size_t write = write_index.load(std::memory_order_relaxed);
+    const size_t read = read_index.load(std::memory_order_acquire);
+    count = std::min(count, AUDIO_RING_FRAMES - (write - read));
+    if (count == 0) {
+        return 0;
+    }
+
+    // copy in up to two pieces, the second one after wrapping around
+    const size_t start = write & AUDIO_RING_MASK;
+    const size_t first = std::min(count, AUDIO_RING_FRAMES - start);
+    std::memcpy(samples.data() + start * 2, frames, first * 2 * sizeof(i16));
+    std::memcpy(samples.data(), frames + first * 2, (count - first) * 2 * sizeof(i16));
+
+    write_index.store(write + count, std::memory_order_release);
+    push_counter.fetch_add(1, std::memory_order_release);
+    push_counter.notify_one();
+    return count;
+}
+
+size_t AudioRing::pop(i16* frames, size_t count)
+{
+    const size_t read = read_index.load(std::memory_order_relaxed);
+    const size_t write = write_index.load(std::memory_order_acquire);
+    count = std::min(count, write - read);
+    if (count == 0) {
+        return 0;
+    }
+
+    const size_t start = read & AUDIO_RING_MASK;
+    const size_t first = std::min(count, AUDIO_RING_FRAMES - start);
+    std::memcpy(frames, samples.data() + start * 2, first * 2 * sizeof(i16));
+    std::memcpy(frames + first * 2, samples.data(), (count - first) * 2 * sizeof(i16));
+
+    read_index.store(read + count, std::memory_order_release);
+    pop_counter.fetch_add(1, std::memory_order_release);
+    pop_counter.notify_one();
+    return count;
+}
+
+#ifndef HEADLESS
+static AudioOutput* device_output = nullptr; // raylib audio callbacks carry no user pointer
+
+static void device_callback(void* buffer, unsigned int frames)
+{
+    device_output->fill_device(static_cast<i16*>(buffer), frames);
+}
+#endif
+
+AudioOutput::~AudioOutput()
+{
+    close();
+}
+
+bool AudioOutput::open_device()
+{
+#ifdef HEADLESS
+    return false;
+#else
+    InitAudioDevice();
+    if (!IsAudioDeviceReady()) {
+        std::cerr << "Failed to open audio device, running without sound" << std::endl;
+        return false;
+    }
+
+    SetAudioStreamBufferSizeDefault(AUDIO_DEVICE_PERIOD);
+    AudioStream* audio_stream = new AudioStream(LoadAudioStream(AUDIO_SAMPLE_RATE, 16, 2));
+    ring.samples.assign(AUDIO_RING_FRAMES * 2, 0);
+    device_output = this;
+    SetAudioStreamCallback(*audio_stream, device_callback);
+
+    stream = static_cast<void*>(audio_stream);
+    sink = AudioSink::device;
+    nominal_rate = AUDIO_SAMPLE_RATE;
+    current_rate = AUDIO_SAMPLE_RATE;
+    PlayAudioStream(*audio_stream);
+    return true;
+#endif
+}
+
+bool AudioOutput::open_wav(const std::filesystem::path& path)
+{
+    wav_file.open(path, std::ios::binary | std::ios::trunc);
+    if (!wav_file) {
+        std::cerr << "Failed to open WAV file for writing: " << path << std::endl;
+        return false;
+    }
+
+    ring.samples.assign(AUDIO_RING_FRAMES * 2, 0);
+    sink = AudioSink::wav;
+    nominal_rate = AUDIO_SAMPLE_RATE;
+    current_rate = AUDIO_SAMPLE_RATE;
+    wav_frames = 0;
+    write_wav_header(); // placeholder sizes, rewritten on close
+    stopping.store(false, std::memory_order_relaxed);
+    writer = std::thread(&AudioOutput::run_wav_writer, this);
+    return true;
+}
+
+void AudioOutput::close()
+{
+    if (sink == AudioSink::device) {
+#ifndef HEADLESS
+        AudioStream* audio_stream = static_cast<AudioStream*>(stream);
+        StopAudioStream(*audio_stream);
+        UnloadAudioStream(*audio_stream);
+        delete audio_stream;
+        stream = nullptr;
+        device_output = nullptr;
+        CloseAudioDevice();
+#endif
+    } else if (sink == AudioSink::wav) {
+        stopping.store(true, std::memory_order_release);
+        ring.push_counter.fetch_add(1, std::memory_order_release);
+        ring.push_counter.notify_one();
+        writer.join();
+
+        write_wav_header();
+        wav_file.close();
+        std::cout << "Wrote " << wav_frames << " audio frames" << std::endl;
+    }
+    sink = AudioSink::none;
+}
+
+void AudioOutput::submit(Apu& apu, bool wait)
+{
+    if (sink == AudioSink::none) {
+        return;
+    }
+
+    std::array<i16, AUDIO_CHUNK_FRAMES * 2> chunk;
+    while (apu.samples_available() > 0) {
+        const size_t count = apu.read_samples(chunk.data(), AUDIO_CHUNK_FRAMES);
+        size_t done = 0;
+        while (done < count) {
+            const u32 seen = ring.pop_counter.load(std::memory_order_acquire);
+            done += ring.push(chunk.data() + done * 2, count - done);
+            if (done < count) {
+                if (!wait) {
+                    break; // running faster than the sink, drop the rest
+                }
+                ring.pop_counter.wait(seen, std::memory_order_acquire);
+            }
+        }
+    }
+
+    if (sink != AudioSink::device) {
+        return;
+    }
+
+    // sync to audio: the device drains at exactly its own rate,
+    // so holding the producer at the target fill paces emulation
+    if (wait) {
+        while (true) {
+            const u32 seen = ring.pop_counter.load(std::memory_order_acquire);
+            if (ring.size() <= AUDIO_TARGET_FILL) {
+                break;
+            }
+            ring.pop_counter.wait(seen, std::memory_order_acquire);
+        }
+    }
+
+    // dynamic rate control: produce slightly more samples when the ring runs low and fewer
+    // when it fills up, small enough to be inaudible but enough to absorb clock drift
+    const double fill_error = (static_cast<double>(AUDIO_TARGET_FILL) - static_cast<double>(ring.size())) / AUDIO_TARGET_FILL;
+    current_rate = nominal_rate * (1.0 + std::clamp(fill_error, -1.0, 1.0) * AUDIO_MAX_RATE_ADJUST);
+    apu.set_sample_rate(current_rate);
+}
+
+void AudioOutput::fill_device(i16* out, size_t frames)
+{
+    const size_t count = ring.pop(out, frames);
+    if (count > 0) {
+        last_frame = { out[count * 2 - 2], out[count * 2 - 1] };
+    }
+    for (size_t i = count; i < frames; ++i) {
+        out[i * 2] = last_frame[0];
+        out[i * 2 + 1] = last_frame[1];
+    }
+}
+
+void AudioOutput::run_wav_writer()
+{
+    std::array<i16, AUDIO_CHUNK_FRAMES * 2> chunk;
+    while (true) {
+        const u32 seen = ring.push_counter.load(std::memory_order_acquire);
+        const size_t count = ring.pop(chunk.data(), AUDIO_CHUNK_FRAMES);
+        if (count > 0) {
+            wav_file.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(count * 2 * sizeof(i16)));
+            wav_frames += count;
+            continue;
+        }
+
+        if (stopping.load(std::memory_order_acquire)) {
+            if (ring.size() == 0) {
+                return;
+            }
+            continue;
+        }
+        ring.push_counter.wait(seen, std::memory_order_acquire);
+    }
+}
+
+// 16-bit stereo PCM, sizes taken from wav_frames
+void AudioOutput::write_wav_header()
+{
+    const u32 data_size = static_cast<u32>(wav_frames * 4);
+    const u32 sample_rate = static_cast<u32>(nominal_rate);
+    std::array<u8, 44> header {};
+    auto put16 = [&](size_t offset, u16 value) {
+        header[offset] = value & 0xFF;
+        header[offset + 1] = static_cast<u8>(value >> 8);
+    };
+    auto put32 = [&](size_t offset, u32 value) {
+        put16(offset, value & 0xFFFF);
+        put16(offset + 2, static_cast<u16>(value >> 16));
+    };
+
+    std::memcpy(header.data(), "RIFF", 4);
+    put32(4, 36 + data_size);
+    std::memcpy(header.data() + 8, "WAVEfmt ", 8);
+    put32(16, 16); // fmt chunk size
+    put16(20, 1); // PCM
+    put16(22, 2); // channels
+    put32(24, sample_rate);
+    put32(28, sample_rate * 4); // byte rate
+    put16(32, 4); // block align
+    put16(34, 16); // bits per sample
+    std::memcpy(header.data() + 36, "data", 4);
+    put32(40, data_size);
+
+    wav_file.seekp(0);
+    wav_file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    wav_file.seekp(0, std::ios::end);
+}
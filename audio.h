@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <memory_resource>
+#include <thread>
+#include <vector>
+
+#include "apu.h"
+#include "types.h"
+
+constexpr size_t AUDIO_RING_FRAMES = 8192; // stereo frames, power of two (~170 ms at 48 kHz)
+constexpr size_t AUDIO_TARGET_FILL = 2400; // frames the device pipeline keeps queued (50 ms), the producer blocks above it
+constexpr double AUDIO_MAX_RATE_ADJUST = 0.005; // dynamic rate control stretches the output by at most 0.5%
+constexpr u32 AUDIO_DEVICE_PERIOD = 512; // frames the audio device pulls per callback
+constexpr size_t AUDIO_CHUNK_FRAMES = 1024; // frames moved per copy between APU, ring and sinks
+
+// lock-free single producer (emulation thread) / single consumer (audio callback or WAV writer)
+// ring of interleaved stereo frames, both sides can block on the other's counter with atomic wait
+struct AudioRing {
+    alignas(64) std::atomic<size_t> write_index { 0 };
+    alignas(64) std::atomic<size_t> read_index { 0 };
+    alignas(64) std::atomic<u32> push_counter { 0 }; // bumped after every push, the consumer waits on it
+    alignas(64) std::atomic<u32> pop_counter { 0 }; // bumped after every pop, the producer waits on it
+    std::pmr::vector<i16> samples; // AUDIO_RING_FRAMES * 2, allocated when a sink opens
+
+    explicit AudioRing(std::pmr::memory_resource* resource)
+        : samples(resource)
+    {
+    }
+
+    size_t size() const;
+    size_t push(const i16* frames, size_t count);
+    size_t pop(i16* frames, size_t count);
+};
+
+enum class AudioSink {
+    none, // no consumer, the APU runs muted
+    device, // raylib audio stream, paces emulation
+    wav, // background thread writing a WAV file
+};
+
+// moves APU output into the ring and from there to the selected sink
+struct AudioOutput {
+    AudioRing ring;
+    AudioSink sink = AudioSink::none;
+    double nominal_rate = AUDIO_SAMPLE_RATE; // rate the sink consumes at
+    double current_rate = AUDIO_SAMPLE_RATE; // rate the APU currently produces at (dynamic rate control)
+    std::array<i16, 2> last_frame {}; // repeated on underrun so gaps do not click
+    void* stream = nullptr; // raylib audio stream
+    std::ofstream wav_file;
+    u64 wav_frames = 0; // frames written to wav_file so far
+    std::atomic<bool> stopping { false };
+    std::thread writer;
+
+    explicit AudioOutput(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : ring(resource)
+    {
+    }
+    AudioOutput(const AudioOutput&) = delete;
+    AudioOutput& operator=(const AudioOutput&) = delete;
+    ~AudioOutput();
+
+    bool open_device();
+    bool open_wav(const std::filesystem::path& path);
+    void close();
+    void submit(Apu& apu, bool wait); // wait blocks while the ring is over target, this is what syncs to audio
+    void fill_device(i16* out, size_t frames); // called from the audio thread
+
+private:
+    void run_wav_writer();
+    void write_wav_header();
+};
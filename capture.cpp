@@ -0,0 +1,324 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "capture.h"
+#include "gameboy.h"
+
+constexpr size_t CAPTURE_FRAME_PIXELS = SCREEN_WIDTH * SCREEN_HEIGHT;
+constexpr size_t PNG_STORED_BLOCK = 65535; // largest uncompressed deflate block
+
+namespace {
+
+// weights of the BT.601 studio swing conversion in 1/256, per RGBA channel
+constexpr i16 Y_WEIGHTS[4] = { 66, 129, 25, 0 };
+constexpr i16 U_WEIGHTS[4] = { -38, -74, 112, 0 };
+constexpr i16 V_WEIGHTS[4] = { 112, -94, -18, 0 };
+
+int weigh(u32 pixel, const i16 (&weights)[4])
+{
+    return weights[0] * static_cast<int>(pixel & 0xFF)
+        + weights[1] * static_cast<int>((pixel >> 8) & 0xFF)
+        + weights[2] * static_cast<int>((pixel >> 16) & 0xFF);
+}
+
+// per byte (a + b + 1) / 2, the rounding of the SIMD average
+u32 average(u32 a, u32 b)
+{
+    return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+u8 clamp_byte(int value)
+{
+    return static_cast<u8>(std::clamp(value, 0, 255));
+}
+
+#if defined(__AVX2__)
+__m256i weights_vector(const i16 (&weights)[4])
+{
+    return _mm256_setr_epi16(weights[0], weights[1], weights[2], weights[3], weights[0], weights[1], weights[2], weights[3],
+        weights[0], weights[1], weights[2], weights[3], weights[0], weights[1], weights[2], weights[3]);
+}
+
+// weighted channel sums of 8 RGBA pixels as 8 ints, in pixel order
+__m256i weigh8(__m256i pixels, __m256i weights)
+{
+    const __m256i low = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(pixels));
+    const __m256i high = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(pixels, 1));
+    const __m256i sums = _mm256_hadd_epi32(_mm256_madd_epi16(low, weights), _mm256_madd_epi16(high, weights));
+    return _mm256_permutevar8x32_epi32(sums, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+}
+
+__m256i to_range(__m256i sums, int offset)
+{
+    return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(128)), 8), _mm256_set1_epi32(offset));
+}
+
+// 16 ints to 16 bytes with saturation
+void store_bytes16(u8* destination, __m256i first, __m256i second)
+{
+    const __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(first, second), 0xD8);
+    const __m256i bytes = _mm256_packus_epi16(words, words);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(destination), _mm256_castsi256_si128(_mm256_permute4x64_epi64(bytes, 0x08)));
+}
+
+// 8 ints to 8 bytes with saturation
+void store_bytes8(u8* destination, __m256i values)
+{
+    const __m256i words = _mm256_packus_epi32(values, values);
+    const __m256i bytes = _mm256_packus_epi16(words, words);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(destination), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0))));
+}
+#endif
+
+u32 crc32(const u8* data, size_t size, u32 crc = 0)
+{
+    static const std::array<u32, 256> table = [] {
+        std::array<u32, 256> entries {};
+        for (u32 i = 0; i < 256; ++i) {
+            u32 value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void put_big_endian(std::vector<u8>& out, u32 value)
+{
+    out.push_back(static_cast<u8>(value >> 24));
+    out.push_back(static_cast<u8>(value >> 16));
+    out.push_back(static_cast<u8>(value >> 8));
+    out.push_back(static_cast<u8>(value));
+}
+
+void put_png_chunk(std::vector<u8>& out, const char* type, const u8* data, size_t size)
+{
+    put_big_endian(out, static_cast<u32>(size));
+    const size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_big_endian(out, crc32(out.data() + start, size + 4));
+}
+
+}
+
+void rgba_to_yuv420(const u32* pixels, int width, int height, u8* y_plane, u8* u_plane, u8* v_plane)
+{
+    const int chroma_width = width / 2;
+    for (int y = 0; y < height; y += 2) {
+        const u32* top = pixels + static_cast<size_t>(y) * width;
+        const u32* bottom = top + width;
+        u8* y_top = y_plane + static_cast<size_t>(y) * width;
+        u8* y_bottom = y_top + width;
+        u8* u_row = u_plane + static_cast<size_t>(y / 2) * chroma_width;
+        u8* v_row = v_plane + static_cast<size_t>(y / 2) * chroma_width;
+
+        int x = 0;
+#if defined(__AVX2__)
+        const __m256i y_weights = weights_vector(Y_WEIGHTS);
+        const __m256i u_weights = weights_vector(U_WEIGHTS);
+        const __m256i v_weights = weights_vector(V_WEIGHTS);
+        const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        const __m256i odd = _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7);
+        for (; x + 16 <= width; x += 16) {
+            const __m256i top0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + x));
+            const __m256i top1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + x + 8));
+            const __m256i bottom0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + x));
+            const __m256i bottom1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + x + 8));
+            store_bytes16(y_top + x, to_range(weigh8(top0, y_weights), 16), to_range(weigh8(top1, y_weights), 16));
+            store_bytes16(y_bottom + x, to_range(weigh8(bottom0, y_weights), 16), to_range(weigh8(bottom1, y_weights), 16));
+
+            // average vertically, then the even and odd columns
+            const __m256i rows0 = _mm256_avg_epu8(top0, bottom0);
+            const __m256i rows1 = _mm256_avg_epu8(top1, bottom1);
+            const __m256i left = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(rows0, even), _mm256_permutevar8x32_epi32(rows1, even), 0xF0);
+            const __m256i right = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(rows0, odd), _mm256_permutevar8x32_epi32(rows1, odd), 0xF0);
+            const __m256i block = _mm256_avg_epu8(left, right);
+            store_bytes8(u_row + x / 2, to_range(weigh8(block, u_weights), 128));
+            store_bytes8(v_row + x / 2, to_range(weigh8(block, v_weights), 128));
+        }
+#endif
+        for (; x < width; x += 2) {
+            y_top[x] = clamp_byte(((weigh(top[x], Y_WEIGHTS) + 128) >> 8) + 16);
+            y_top[x + 1] = clamp_byte(((weigh(top[x + 1], Y_WEIGHTS) + 128) >> 8) + 16);
+            y_bottom[x] = clamp_byte(((weigh(bottom[x], Y_WEIGHTS) + 128) >> 8) + 16);
+            y_bottom[x + 1] = clamp_byte(((weigh(bottom[x + 1], Y_WEIGHTS) + 128) >> 8) + 16);
+
+            const u32 block = average(average(top[x], bottom[x]), average(top[x + 1], bottom[x + 1]));
+            u_row[x / 2] = clamp_byte(((weigh(block, U_WEIGHTS) + 128) >> 8) + 128);
+            v_row[x / 2] = clamp_byte(((weigh(block, V_WEIGHTS) + 128) >> 8) + 128);
+        }
+    }
+}
+
+FrameCapture::~FrameCapture()
+{
+    close();
+}
+
+bool FrameCapture::open(const std::filesystem::path& output_path, ScaleFilter filter, int scale_factor)
+{
+    path = output_path;
+    const std::string extension = path.extension().string();
+    format = extension == ".y4m" ? CaptureFormat::y4m : extension == ".png" ? CaptureFormat::png : CaptureFormat::raw;
+
+    scaling = filter != ScaleFilter::nearest || scale_factor != 1;
+    if (scaling && !scaler.configure(filter, scale_factor)) {
+        return false;
+    }
+    width = scaling ? scaler.output_width : SCREEN_WIDTH;
+    height = scaling ? scaler.output_height : SCREEN_HEIGHT;
+
+    if (format != CaptureFormat::png) {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            std::cerr << "Failed to open capture file for writing: " << path << std::endl;
+            return false;
+        }
+    }
+    if (format == CaptureFormat::y4m) {
+        // frame rate is the exact refresh rate of the Game Boy, ffmpeg reads XCOLORRANGE
+        const std::string header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height)
+            + " F" + std::to_string(CLOCKSPEED) + ":" + std::to_string(CYCLES_PER_FRAME) + " Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n";
+        file.write(header.data(), static_cast<std::streamsize>(header.size()));
+    }
+
+    queue.start(*this, CAPTURE_QUEUE_FRAMES, CAPTURE_FRAME_PIXELS * sizeof(u32));
+    return true;
+}
+
+// waits for the queued frames to be written
+void FrameCapture::close()
+{
+    if (!queue.running()) {
+        return;
+    }
+    queue.stop();
+    file.close();
+
+    std::cout << "Captured " << queue.written.load(std::memory_order_relaxed) << " frames to " << path;
+    if (queue.stalls) {
+        std::cout << " (emulation waited for the writer " << queue.stalls << " times)";
+    }
+    std::cout << std::endl;
+}
+
+void FrameCapture::submit(const u32* pixels)
+{
+    std::memcpy(queue.acquire(), pixels, CAPTURE_FRAME_PIXELS * sizeof(u32));
+    queue.submit(CAPTURE_FRAME_PIXELS * sizeof(u32));
+}
+
+bool FrameCapture::write_slot(const u8* data, size_t size, u32 number)
+{
+    (void)size;
+    return write_frame(reinterpret_cast<const u32*>(data), number);
+}
+
+bool FrameCapture::write_frame(const u32* pixels, u32 number)
+{
+    if (scaling) {
+        pixels = scaler.run(pixels);
+    }
+    const size_t frame_pixels = static_cast<size_t>(width) * height;
+
+    switch (format) {
+    case CaptureFormat::raw:
+        return write_bytes(pixels, frame_pixels * sizeof(u32)); // pack_color order is RGBA in memory
+    case CaptureFormat::y4m: {
+        static constexpr char frame_header[] = "FRAME\n";
+        encoded.resize(frame_pixels * 3 / 2);
+        u8* y_plane = encoded.data();
+        u8* u_plane = y_plane + frame_pixels;
+        rgba_to_yuv420(pixels, width, height, y_plane, u_plane, u_plane + frame_pixels / 4);
+        return write_bytes(frame_header, sizeof(frame_header) - 1) && write_bytes(encoded.data(), encoded.size());
+    }
+    case CaptureFormat::png: {
+        char number_text[16];
+        std::snprintf(number_text, sizeof(number_text), "_%06u", number);
+        std::filesystem::path frame_path = path;
+        frame_path.replace_filename(path.stem().string() + number_text + ".png");
+
+        encode_png(pixels);
+        file.open(frame_path, std::ios::binary | std::ios::trunc);
+        const bool ok = file && write_bytes(encoded.data(), encoded.size());
+        file.close();
+        if (!ok) {
+            std::cerr << "Failed to write capture file: " << frame_path << std::endl;
+        }
+        return ok;
+    }
+    }
+    return false;
+}
+
+bool FrameCapture::write_bytes(const void* data, size_t size)
+{
+    file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    if (!file && format != CaptureFormat::png) {
+        std::cerr << "Failed to write capture file: " << path << std::endl;
+    }
+    return static_cast<bool>(file);
+}
+
+// 8-bit RGB in uncompressed deflate blocks: no zlib dependency and no time spent compressing,
+// Y4M is the better choice for long captures
+void FrameCapture::encode_png(const u32* pixels)
+{
+    static constexpr u8 signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    encoded.assign(signature, signature + sizeof(signature));
+
+    std::vector<u8> header;
+    put_big_endian(header, static_cast<u32>(width));
+    put_big_endian(header, static_cast<u32>(height));
+    header.insert(header.end(), { 8, 2, 0, 0, 0 }); // bit depth, truecolor, deflate, no filter, not interlaced
+    put_png_chunk(encoded, "IHDR", header.data(), header.size());
+
+    // scanlines with filter type 0, then split into stored blocks
+    const size_t row_size = 1 + static_cast<size_t>(width) * 3;
+    std::vector<u8> rows(row_size * height);
+    for (int y = 0; y < height; ++y) {
+        u8* row = rows.data() + y * row_size;
+        row[0] = 0;
+        for (int x = 0; x < width; ++x) {
+            const u32 pixel = pixels[static_cast<size_t>(y) * width + x];
+            row[1 + x * 3] = static_cast<u8>(pixel);
+            row[2 + x * 3] = static_cast<u8>(pixel >> 8);
+            row[3 + x * 3] = static_cast<u8>(pixel >> 16);
+        }
+    }
+
+    std::vector<u8> zlib = { 0x78, 0x01 };
+    u32 adler_low = 1;
+    u32 adler_high = 0;
+    for (size_t offset = 0; offset < rows.size(); offset += PNG_STORED_BLOCK) {
+        const size_t size = std::min(PNG_STORED_BLOCK, rows.size() - offset);
+        const u8 last = offset + size == rows.size() ? 1 : 0;
+        zlib.insert(zlib.end(), { last, static_cast<u8>(size), static_cast<u8>(size >> 8), static_cast<u8>(~size), static_cast<u8>(~size >> 8) });
+        zlib.insert(zlib.end(), rows.begin() + static_cast<std::ptrdiff_t>(offset), rows.begin() + static_cast<std::ptrdiff_t>(offset + size));
+        for (size_t i = offset; i < offset + size; ++i) {
+            adler_low = (adler_low + rows[i]) % 65521;
+            adler_high = (adler_high + adler_low) % 65521;
+        }
+    }
+    put_big_endian(zlib, (adler_high << 16) | adler_low);
+    put_png_chunk(encoded, "IDAT", zlib.data(), zlib.size());
+    put_png_chunk(encoded, "IEND", nullptr, 0);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "scaler.h"
+#include "types.h"
+#include "writer_queue.h"
+
+constexpr u32 CAPTURE_QUEUE_FRAMES = 8; // frames that can wait for the writer before emulation blocks
+
+enum class CaptureFormat {
+    y4m, // YUV 4:2:0 video, readable by ffmpeg, mpv, x264
+    raw, // RGBA frames back to back, no header
+    png, // one numbered PNG file per frame
+};
+
+// writes every published frame to a file on a background thread. the emulation thread only copies
+// the frame into a WriterQueue, scaling and encoding happen on the writer thread
+struct FrameCapture : SlotWriter {
+    CaptureFormat format = CaptureFormat::raw;
+    std::filesystem::path path; // output file, or the name the numbered PNG files are derived from
+    std::ofstream file;
+    Scaler scaler;
+    bool scaling = false;
+    int width = 0; // of the written frames
+    int height = 0;
+    std::vector<u8> encoded; // writer thread: Y4M planes or PNG file of the current frame
+    WriterQueue queue; // CAPTURE_QUEUE_FRAMES source frames
+
+    FrameCapture() = default;
+    FrameCapture(const FrameCapture&) = delete;
+    FrameCapture& operator=(const FrameCapture&) = delete;
+    ~FrameCapture() override;
+
+    // format from the extension (.y4m, .png, anything else raw), frames are written at 160x144 unless a filter scales them
+    bool open(const std::filesystem::path& output_path, ScaleFilter filter = ScaleFilter::nearest, int scale_factor = 1);
+    void close();
+    void submit(const u32* pixels); // emulation thread, SCREEN_WIDTH x SCREEN_HEIGHT pixels
+
+private:
+    bool write_slot(const u8* data, size_t size, u32 number) override;
+    bool write_frame(const u32* pixels, u32 number);
+    bool write_bytes(const void* data, size_t size);
+    void encode_png(const u32* pixels);
+};
+
+// BT.601 limited range, chroma averaged over 2x2 pixels. width and height must be even
+void rgba_to_yuv420(const u32* pixels, int width, int height, u8* y_plane, u8* u_plane, u8* v_plane);
@@ -0,0 +1,153 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gameboy.h"
+
+// fork_from copies only the pages either side marked since the last fork from the same parent, so
+// every write path into VRAM, work RAM and cart RAM has to call mark_page. random input, random
+// writes through write8, re-forks and load_state are checked against the full state after every
+// fork_from, on DMG and CGB (VRAM bank 1, WRAM banks), with make test-fork
+
+constexpr int TEST_ROUNDS = 300;
+
+// a DMG MBC1 or CGB MBC5 cartridge with 32KB RAM whose code keeps adding to every byte of
+// 0x8000-0xEFFF, so the CPU writes VRAM, cart RAM, work RAM and its echo on its own
+static std::vector<u8> fork_rom(bool cgb)
+{
+    std::vector<u8> rom(0x8000, 0x00);
+    rom[0x101] = 0xC3; // jp 0x0150
+    rom[0x102] = 0x50;
+    rom[0x103] = 0x01;
+    rom[0x143] = cgb ? 0x80 : 0x00;
+    rom[0x147] = cgb ? 0x1A : 0x02; // MBC5+RAM or MBC1+RAM, no battery
+    rom[0x149] = 0x03; // 4 RAM banks
+
+    const std::vector<u8> code = {
+        0x3E, 0x0A, // ld a,0x0A
+        0xEA, 0x00, 0x00, // ld (0x0000),a: cart RAM on
+        0x21, 0x00, 0x80, // ld hl,0x8000
+        0x7E, // loop: ld a,(hl)
+        0x85, // add a,l
+        0x22, // ld (hl+),a
+        0x7C, // ld a,h
+        0xFE, 0xF0, // cp 0xF0
+        0x20, 0xF8, // jr nz,loop
+        0x26, 0x80, // ld h,0x80
+        0x18, 0xF4, // jr loop
+    };
+    std::copy(code.begin(), code.end(), rom.begin() + 0x150);
+    return rom;
+}
+
+static std::filesystem::path write_rom(const std::string& name, const std::vector<u8>& rom)
+{
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / name;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(rom.data()), static_cast<std::streamsize>(rom.size()));
+    return path;
+}
+
+static bool same_state(const Gameboy& a, const Gameboy& b)
+{
+    SaveState first;
+    SaveState second;
+    a.save_state(first);
+    b.save_state(second);
+    return first.data == second.data;
+}
+
+static void run_frames(Gameboy& gb, std::mt19937& random, u32 frames)
+{
+    for (u32 i = 0; i < frames; ++i) {
+        gb.input_buttons.store(static_cast<u8>(random()), std::memory_order_relaxed);
+        gb.run_one_frame();
+    }
+}
+
+// what a game or a Python caller could write between frames, bank registers included
+static void random_writes(Gameboy& gb, std::mt19937& random)
+{
+    gb.write8(0x0000, 0x0A);
+    gb.write8(0x4000, static_cast<u8>(random() % 4));
+    gb.write8(static_cast<u16>(0xA000 + random() % 0x2000), static_cast<u8>(random()));
+    gb.write8(static_cast<u16>(0xC000 + random() % 0x2000), static_cast<u8>(random()));
+    gb.write8(static_cast<u16>(0x8000 + random() % 0x2000), static_cast<u8>(random()));
+    if (gb.cgb_mode) {
+        gb.write8(0xFF4F, static_cast<u8>(random() % 2));
+        gb.write8(0xFF70, static_cast<u8>(random() % 8));
+    }
+}
+
+static int check_forks(const std::filesystem::path& rom_path, const char* name)
+{
+    std::mt19937 random(1);
+    Gameboy root(rom_path.string(), false);
+    run_frames(root, random, 60);
+    const std::unique_ptr<Gameboy> child = root.fork();
+    const std::unique_ptr<Gameboy> reference = std::make_unique<Gameboy>(rom_path.string(), false);
+
+    int failures = 0;
+    const auto expect_same = [&](const Gameboy& a, const Gameboy& b, const char* what, int round) {
+        if (!same_state(a, b)) {
+            std::cerr << name << ": " << what << " differs from the full state in round " << round << std::endl;
+            failures++;
+        }
+    };
+
+    for (int round = 0; round < TEST_ROUNDS; ++round) {
+        run_frames(*child, random, random() % 5);
+        random_writes(*child, random);
+        random_writes(root, random);
+        run_frames(root, random, random() % 3);
+
+        // a node forked from the child, moved on and brought back
+        if (round % 7 == 0) {
+            const std::unique_ptr<Gameboy> grandchild = child->fork();
+            run_frames(*grandchild, random, 2);
+            run_frames(*child, random, 1);
+            grandchild->fork_from(*child);
+            expect_same(*grandchild, *child, "re-forked grandchild", round);
+        }
+        if (round % 13 == 0) {
+            SaveState state;
+            root.save_state(state);
+            root.load_state(state);
+        }
+
+        child->fork_from(root);
+        expect_same(*child, root, "child", round);
+
+        // the fork also has to run on like the state it copied
+        if (round % 50 == 0) {
+            SaveState state;
+            root.save_state(state);
+            reference->load_state(state);
+            std::mt19937 child_input(round);
+            std::mt19937 reference_input(round);
+            run_frames(*child, child_input, 10);
+            run_frames(*reference, reference_input, 10);
+            expect_same(*child, *reference, "child run on", round);
+            child->fork_from(root);
+        }
+    }
+    std::cout << name << ": " << TEST_ROUNDS << " rounds, " << failures << " failures" << std::endl;
+    return failures;
+}
+
+int main()
+{
+    const std::filesystem::path dmg_path = write_rom("gameboy_fork_dmg.gb", fork_rom(false));
+    const std::filesystem::path cgb_path = write_rom("gameboy_fork_cgb.gb", fork_rom(true));
+
+    const int failures = check_forks(dmg_path, "DMG") + check_forks(cgb_path, "CGB");
+    std::filesystem::remove(dmg_path);
+    std::filesystem::remove(cgb_path);
+
+    std::cout << (failures == 0 ? "Fork test passed" : "Fork test failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <format>
+#include <string_view>
+
+#include "frame_timing.h"
+
+namespace {
+
+constexpr u64 SUB_BUCKETS = u64 { 1 } << LATENCY_SUB_BUCKET_BITS;
+
+size_t bucket_index(u64 value)
+{
+    value = std::min(value, (u64 { 1 } << LATENCY_MAX_BITS) - 1);
+    if (value < SUB_BUCKETS * 2) {
+        return value;
+    }
+    const int shift = std::bit_width(value) - LATENCY_SUB_BUCKET_BITS - 1;
+    return static_cast<size_t>(shift) * SUB_BUCKETS + (value >> shift);
+}
+
+// largest value that lands in the bucket
+u64 bucket_upper(size_t index)
+{
+    if (index < SUB_BUCKETS * 2) {
+        return index;
+    }
+    const int shift = static_cast<int>(index / SUB_BUCKETS) - 1;
+    const u64 top = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+void print_histogram(std::ostream& out, std::string_view name, std::string_view unit, const LatencyHistogram& histogram)
+{
+    const auto ms = [](u64 nanoseconds) { return static_cast<double>(nanoseconds) / 1e6; };
+    if (histogram.count() == 0) {
+        out << std::format("{:<16} no {}\n", name, unit);
+        return;
+    }
+    out << std::format("{:<16} {} {}, p50 {:.3f} ms, p99 {:.3f} ms, p99.9 {:.3f} ms, max {:.3f} ms\n", name, histogram.count(), unit,
+        ms(histogram.percentile(0.5)), ms(histogram.percentile(0.99)), ms(histogram.percentile(0.999)),
+        ms(histogram.max.load(std::memory_order_relaxed)));
+}
+
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration)
+{
+    const u64 value = static_cast<u64>(std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+    std::atomic<u64>& bucket = counts[bucket_index(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    total.store(total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed)) {
+        max.store(value, std::memory_order_relaxed);
+    }
+}
+
+// a reader racing the recording thread sees a total a few samples off the buckets, which moves a rank by as much
+u64 LatencyHistogram::percentile(double fraction) const
+{
+    const u64 samples = count();
+    if (samples == 0) {
+        return 0;
+    }
+    const u64 rank = std::max<u64>(static_cast<u64>(std::ceil(fraction * static_cast<double>(samples))), 1);
+    if (rank >= samples) {
+        return max.load(std::memory_order_relaxed);
+    }
+    u64 seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucket_upper(i), max.load(std::memory_order_relaxed));
+        }
+    }
+    return max.load(std::memory_order_relaxed);
+}
+
+// keeps the earliest change the emulation has not picked up yet
+void FrameTiming::input_changed()
+{
+    Stamp none = 0;
+    sampled.compare_exchange_strong(none, std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release, std::memory_order_relaxed);
+}
+
+// the keys were stored before the stamp, so the frame run after taking it sees them in update_inputs
+FrameTiming::Stamp FrameTiming::take_input()
+{
+    return sampled.exchange(0, std::memory_order_acquire);
+}
+
+// one input is followed at a time, later ones are dropped until it was presented
+void FrameTiming::frame_emulated(Stamp input, u32 frames_published)
+{
+    if (input == 0 || emulated.load(std::memory_order_acquire) != 0) {
+        return;
+    }
+    emulated_frame.store(frames_published, std::memory_order_relaxed);
+    emulated.store(input, std::memory_order_release);
+}
+
+// render_screen shows the latest published frame, at least the one counted before it was called
+void FrameTiming::frame_presented(u32 frames_published)
+{
+    const Stamp input = emulated.load(std::memory_order_acquire);
+    if (input == 0 || static_cast<i32>(emulated_frame.load(std::memory_order_relaxed) - frames_published) > 0) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    input_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - std::chrono::steady_clock::duration(input)));
+    emulated.store(0, std::memory_order_release);
+}
+
+void FrameTiming::print(std::ostream& out) const
+{
+    print_histogram(out, "emulation", "frames", emulation);
+    print_histogram(out, "present", "frames", present);
+    print_histogram(out, "input to photon", "inputs", input_latency);
+    out.flush();
+}
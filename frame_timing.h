@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+#include "types.h"
+
+constexpr int LATENCY_SUB_BUCKET_BITS = 7; // 128 buckets per power of two, under 1% error
+constexpr int LATENCY_MAX_BITS = 40; // longer than about 18 minutes is recorded as that
+constexpr size_t LATENCY_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS;
+
+// durations in nanoseconds in log-linear buckets like an HdrHistogram: exact up to 255 ns, then
+// 128 buckets per power of two. recording is a bucket increment, one thread records and any thread
+// reads, so a spike of a single frame shows up in the high percentiles instead of vanishing in an average
+struct LatencyHistogram {
+    std::array<std::atomic<u64>, LATENCY_BUCKETS> counts {};
+    std::atomic<u64> total { 0 };
+    std::atomic<u64> max { 0 };
+
+    void record(std::chrono::nanoseconds duration);
+    u64 count() const { return total.load(std::memory_order_relaxed); }
+    u64 percentile(double fraction) const; // nanoseconds, the upper end of the bucket holding that rank
+};
+
+// where the frames of the window front end spend their time
+struct FrameTiming {
+    LatencyHistogram emulation; // run_one_frame_ahead on the emulation thread, without audio and timer pacing
+    LatencyHistogram present; // render_screen on the presentation thread, including raylib's wait for the display rate
+    LatencyHistogram input_latency; // keyboard change to the end of presenting the first frame emulated after it
+
+    using Stamp = std::chrono::steady_clock::rep;
+
+    // input_latency hand-over, as steady_clock ticks (0 = none). sampled is written by the
+    // presentation thread when the keys change and taken by the emulation thread before it runs a frame,
+    // emulated is set once that frame is published and taken by the presentation thread when it shows it
+    std::atomic<Stamp> sampled { 0 };
+    std::atomic<Stamp> emulated { 0 };
+    std::atomic<u32> emulated_frame { 0 }; // frames_published once the frame holding emulated was published
+
+    void input_changed();
+    Stamp take_input(); // emulation thread, before a frame
+    void frame_emulated(Stamp input, u32 frames_published); // emulation thread, after that frame
+    void frame_presented(u32 frames_published); // presentation thread, frames_published as read before render_screen
+
+    void print(std::ostream& out) const; // p50, p99 and p99.9 of every histogram
+};
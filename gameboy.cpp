@@ -1,73 +1,274 @@
 #include <algorithm>
 #include <bit>
+#include <chrono>
 #include <filesystem>
 #include <format>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <system_error>
+#include <thread>
 
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "capture.h"
 #include "gameboy.h"
 #include "opcodes.h"
+#include "trace.h"
 
+#ifndef HEADLESS
 #include "raylib.h"
+#endif
 
 namespace fs = std::filesystem;
 
-Gameboy::Gameboy(const std::string& path_rom)
-    : current_rom_bank_ptr(nullptr)
-    , rom_path(path_rom)
+// writable bits of the MBC3 RTC registers (seconds, minutes, hours, day low, day high)
+constexpr std::array<u8, 5> RTC_REGISTER_MASKS = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
+
+// CGB palette RAM holds RGB555 colors, widen each channel to 8 bits by bit replication
+static constexpr std::array<u32, 0x8000> build_rgb555_table()
+{
+    std::array<u32, 0x8000> table {};
+    for (u32 color = 0; color < table.size(); ++color) {
+        const u32 r = color & 0x1F;
+        const u32 g = (color >> 5) & 0x1F;
+        const u32 b = (color >> 10) & 0x1F;
+        table[color] = pack_color(
+            static_cast<u8>((r << 3) | (r >> 2)),
+            static_cast<u8>((g << 3) | (g >> 2)),
+            static_cast<u8>((b << 3) | (b >> 2)),
+            0xFF);
+    }
+    return table;
+}
+
+static constexpr std::array<u32, 0x8000> RGB555_TO_RGBA = build_rgb555_table();
+
+// decoded tile rows hold one pixel per byte, so an x-flip is a byte swap of the whole row
+static_assert(std::endian::native == std::endian::little);
+
+static inline u64 tile_row_bits(const std::array<u8, 8>& row, bool flip_x)
+{
+    const u64 bits = std::bit_cast<u64>(row);
+    return flip_x ? __builtin_bswap64(bits) : bits;
+}
+
+static u64 unix_time_now()
+{
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<u64>(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+}
+
+Gameboy::Gameboy(const std::string& path_rom, bool use_save_file, std::pmr::memory_resource* memory_resource)
+    : resource(memory_resource)
+    , mbc_type(0)
+    , rom_bank_count(0)
+    , rom_bank0_ptr(nullptr)
+    , current_rom_bank_ptr(nullptr)
+    , current_ram_bank_ptr(nullptr)
+    , ram_bank_mask(0)
+    , mbc1_multicart(false)
+    , cartridge_has_rumble(false)
+    , rtc_registers {}
+    , rtc_latched_registers {}
+    , ram_storage(memory_resource)
+    , framebuffers(nullptr)
+    , frame_capture(nullptr)
+    , trace(nullptr)
+    , pixel_format(PixelFormat::rgba)
+    , pixel_output(nullptr)
+    , run_ahead_state { std::pmr::vector<u8>(memory_resource) }
+    , page_stamps(memory_resource)
+    , fork_state { std::pmr::vector<u8>(memory_resource) }
+    , tile_cache(memory_resource)
+    , header_title(memory_resource)
+    , rom_path(path_rom, memory_resource)
     , save_path()
     , ram_bank_size(0)
     , ram_bank_count(0)
     , cartridge_has_ram(false)
     , cartridge_has_battery(false)
+    , cartridge_has_rtc(false)
+    , save_file_enabled(use_save_file)
     , ram_dirty(false)
+    , save_mapping(nullptr)
+    , save_mapping_size(0)
+    , save_flush_timer(0)
+    , cgb_mode(false)
+    , vram_bank1(memory_resource)
+    , wram_banks(memory_resource)
+    , apu(memory_resource)
+    , audio_output(memory_resource)
+    , audio_sync(false)
+    , serial_link(nullptr)
+    , serial_transfer_deadline(SERIAL_NEVER)
+    , serial_poll_cycle(SERIAL_NEVER)
+    , serial_next_event(SERIAL_NEVER)
     , texture(nullptr)
 {
     initialize_memory();
     initialize_io_masks();
-    save_path = rom_path;
-    if (!save_path.has_extension()) {
-        save_path += ".sav";
-    } else {
-        save_path.replace_extension(".sav");
+    if (save_file_enabled) {
+        save_path = std::string_view(rom_path);
+        if (!save_path.has_extension()) {
+            save_path += ".sav";
+        } else {
+            save_path.replace_extension(".sav");
+        }
     }
     load_cartridge(path_rom);
     extract_header_title();
     initialize_cpu_state();
     initialize_io_registers();
     initialize_runtime_state();
-    initialize_opcode_tables();
+    static std::once_flag opcode_tables_once;
+    std::call_once(opcode_tables_once, initialize_opcode_tables);
     init_graphics();
+    init_audio();
+}
+
+// boot ROM overlays are made once per cartridge and boot ROM file, a ROM changed on disk since gets
+// a new one, a changed boot ROM file is not read again
+static std::shared_ptr<BootImage> shared_boot_image(const std::shared_ptr<const std::vector<u8>>& rom, std::string_view rom_path, const std::string& boot_rom_path)
+{
+    static std::mutex cache_mutex;
+    static std::map<std::pair<std::string, std::string>, std::shared_ptr<BootImage>> cache;
+
+    const std::lock_guard lock(cache_mutex);
+    std::shared_ptr<BootImage>& image = cache[{ std::string(rom_path), boot_rom_path }];
+    if (image && image->rom == rom) {
+        return image;
+    }
+
+    std::ifstream file(boot_rom_path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open boot ROM file: " << boot_rom_path << std::endl;
+        return nullptr;
+    }
+    const std::vector<u8> contents(std::istreambuf_iterator<char>(file), {});
+    if (contents.size() != BOOT_ROM_SIZE) {
+        std::cerr << "Invalid boot ROM file (expected " << BOOT_ROM_SIZE << " bytes, got " << contents.size() << "): " << boot_rom_path << std::endl;
+        return nullptr;
+    }
+
+    image = std::make_shared<BootImage>();
+    image->rom = rom;
+    std::copy_n(rom->begin(), image->bank0.size(), image->bank0.begin());
+    std::copy(contents.begin(), contents.end(), image->bank0.begin());
+    return image;
+}
+
+// runs the DMG boot ROM at path from power on instead of starting with the registers it leaves behind.
+// the first instance to boot the cartridge with it keeps the machine it hands over, instances after
+// it (and resets) start from there right away instead of running it again
+bool Gameboy::use_boot_rom(const std::string& path)
+{
+    if (cgb_mode) {
+        std::cerr << "A DMG boot ROM cannot start a CGB cartridge" << std::endl;
+        return false;
+    }
+    std::shared_ptr<BootImage> image = shared_boot_image(rom, rom_path, path);
+    if (!image) {
+        return false;
+    }
+    boot_image = std::move(image);
+    reset();
+    return true;
+}
+
+// power cycle: the state a new instance of the ROM starts in, without reading the ROM or the save
+// file again, touching the window or audio device, or allocating. battery RAM and the clock keep
+// their contents as on the real cartridge, RAM without a save file behind it starts out zeroed
+// like it does in a new instance. call it between frames, like load_state
+void Gameboy::reset()
+{
+    if (has_save_file()) {
+        rtc_sync(); // the clock is counted from cycle 0 again below
+    } else {
+        std::fill(ram_banks.begin(), ram_banks.end(), 0);
+        rtc_registers.fill(0);
+        rtc_latched_registers.fill(0);
+        ram_dirty = false; // nothing to save, but both are part of the state
+        save_flush_timer = 0;
+    }
+
+    const bool muted = apu.muted;
+    initialize_memory();
+    initialize_io_masks();
+    set_rom_bank0(0);
+    set_rom_bank(current_rom_bank);
+    initialize_cpu_state();
+    initialize_io_registers();
+    initialize_runtime_state();
+    if (boot_image) {
+        std::shared_ptr<const SaveState> post_boot;
+        {
+            const std::lock_guard lock(boot_image->mutex);
+            post_boot = boot_image->post_boot;
+        }
+        if (post_boot) {
+            read_state(*post_boot, StateScope::boot); // as if the boot ROM ran, this cartridge's RAM and clock stay
+        }
+    }
+    apu.set_muted(muted, cycle_count);
+
+    serial_transfer_deadline = SERIAL_NEVER;
+    set_serial_link(serial_link); // polls, if the link needs any, start over from cycle 0
 }
 
+// the machine as it powers on. what describes the cartridge, its RAM and its clock is left
+// to load_cartridge, so reset can run this again with the cartridge still plugged in
 void Gameboy::initialize_memory()
 {
     memory.fill(0);
-    ram_banks.clear();
-    ram_bank_size = 0;
-    ram_bank_count = 0;
+    boot_rom_mapped = boot_image != nullptr;
+    ram_enabled = false;
     set_ram_bank(0);
     current_rom_bank = 1;
-    rom_bank_count = 0;
-    ram_enabled = false;
+    bank_register_low = 1;
+    bank_register_high = 0;
     rom_banking = true;
-    mbc_type = 0;
-    rtc_registers.fill(0);
-    rtc_latched_registers.fill(0);
+    rumble_active = false;
     rtc_selected_register = 0xFF;
     rtc_latch_previous_value = 0xFF;
     rtc_latch_active = false;
+    rtc_last_sync_cycle = 0;
+    rtc_subsecond_cycles = 0;
+    cycle_count = 0;
+    frame_cycle = 0;
     scanline_counter = 0; // counts cycles within current scanline
     scanline_sprite_count = 0;
     ppu_cycle = 0;
     ppu_mode = 0;
     window_line_counter = 0;
     scanline_rendered = false;
-    cartridge_has_ram = false;
-    cartridge_has_battery = false;
-    ram_dirty = false;
+
+    double_speed = false;
+    std::fill(vram_bank1.begin(), vram_bank1.end(), 0);
+    std::fill(wram_banks.begin(), wram_banks.end(), 0);
+    set_vram_bank(0);
+    set_wram_bank(1);
+    bg_palette_ram.fill(0xFF);
+    obj_palette_ram.fill(0xFF);
+    for (size_t i = 0; i < 8; ++i) {
+        cgb_bg_palette_cache[i].fill(RGB555_TO_RGBA[0x7FFF]);
+        cgb_obj_palette_cache[i].fill(RGB555_TO_RGBA[0x7FFF]);
+    }
+    hdma_source = 0;
+    hdma_destination = 0;
+    hdma_blocks_left = 0;
+    hdma_active = false;
+    dma_stall_cycles = 0;
+
+    apu.muted = true; // until init_audio finds a consumer for the samples
 }
 
 void Gameboy::initialize_io_masks()
@@ -99,50 +300,102 @@ void Gameboy::initialize_io_masks()
     io_register_masks[0x07] = 0xF8; // TAC: bits 3-7 unused
     io_register_masks[0x0F] = 0xE0; // IF: bits 5-7 unused
     io_register_masks[0x10] = 0x80; // NR10: bit 7 unused
+    io_register_masks[0x11] = 0x3F; // NR11: length is write-only
+    io_register_masks[0x13] = 0xFF; // NR13: write-only
+    io_register_masks[0x14] = 0xBF; // NR14: only length enable reads back
+    io_register_masks[0x16] = 0x3F; // NR21: length is write-only
+    io_register_masks[0x18] = 0xFF; // NR23: write-only
+    io_register_masks[0x19] = 0xBF; // NR24: only length enable reads back
     io_register_masks[0x1A] = 0x7F; // NR30: bits 0-6 unused
+    io_register_masks[0x1B] = 0xFF; // NR31: write-only
     io_register_masks[0x1C] = 0x9F; // NR32: bits 0-4,7 unused
-    io_register_masks[0x20] = 0xC0; // NR41: bits 6-7 unused
-    io_register_masks[0x23] = 0x3F; // NR44: bits 0-5 unused
+    io_register_masks[0x1D] = 0xFF; // NR33: write-only
+    io_register_masks[0x1E] = 0xBF; // NR34: only length enable reads back
+    io_register_masks[0x20] = 0xFF; // NR41: write-only
+    io_register_masks[0x23] = 0xBF; // NR44: only length enable reads back
     io_register_masks[0x26] = 0x70; // NR52: bits 4-6 unused
     io_register_masks[0x41] = 0x80; // STAT: bit 7 unused
 }
 
-void Gameboy::load_cartridge(const std::string& path_rom)
+// instances of one ROM file share its contents. the cache keeps them for the life of the process,
+// so recycling every instance of a ROM does not read it again, a file changed on disk since is
+static std::shared_ptr<const std::vector<u8>> shared_rom(const std::string& path_rom)
 {
+    struct CachedRom {
+        std::shared_ptr<const std::vector<u8>> contents;
+        timespec write_time;
+    };
+    static std::mutex cache_mutex;
+    static std::map<std::string, CachedRom, std::less<>> cache;
+
+    // stat rather than std::filesystem, a hit must not allocate (see InstanceArena)
+    struct stat file_status {};
+    const bool known_time = stat(path_rom.c_str(), &file_status) == 0;
+    const timespec write_time = file_status.st_mtim;
+    const std::lock_guard lock(cache_mutex);
+    auto cached = cache.find(path_rom);
+    if (cached == cache.end()) {
+        cached = cache.emplace(path_rom, CachedRom {}).first;
+    }
+    const CachedRom& entry = cached->second;
+    if (entry.contents && known_time && entry.write_time.tv_sec == write_time.tv_sec && entry.write_time.tv_nsec == write_time.tv_nsec) {
+        return entry.contents;
+    }
+
     std::ifstream file(path_rom, std::ios::binary);
     if (!file) {
         std::cerr << "Failed to open ROM file: " << path_rom << std::endl;
         exit(1);
     }
 
-    cartridge = std::vector<u8>(std::istreambuf_iterator<char>(file), {});
+    std::vector<u8> contents(std::istreambuf_iterator<char>(file), {});
     file.close();
 
-    if (cartridge.size() < 0x8000) {
+    if (contents.size() < 0x8000) {
         std::cerr << "Invalid ROM file (too small): " << path_rom << std::endl;
         exit(1);
     }
 
-    size_t bank_count = std::max<size_t>(1, (cartridge.size() + 0x3FFF) / 0x4000);
-    if (bank_count > std::numeric_limits<u16>::max()) {
-        bank_count = std::numeric_limits<u16>::max();
-    }
-    rom_bank_count = static_cast<u16>(bank_count);
-    const size_t padded_size = static_cast<size_t>(rom_bank_count) * 0x4000;
-    if (cartridge.size() < padded_size) {
-        cartridge.resize(padded_size, 0xFF);
-    }
+    // whole 16KB banks, at most as many as a u16 bank number reaches
+    const size_t bank_count = std::min<size_t>((contents.size() + 0x3FFF) / 0x4000, std::numeric_limits<u16>::max());
+    contents.resize(bank_count * 0x4000, 0xFF);
+    contents.shrink_to_fit();
+
+    auto shared = std::make_shared<const std::vector<u8>>(std::move(contents));
+    cached->second = { shared, write_time };
+    return shared;
+}
+
+void Gameboy::load_cartridge(const std::string& path_rom)
+{
+    rom = shared_rom(path_rom);
+    cartridge = *rom;
+    rom_bank_count = static_cast<u16>(cartridge.size() / 0x4000);
+    set_rom_bank0(0);
     set_rom_bank(current_rom_bank);
 
     const u8 cartridge_type = cartridge[0x147];
     const u8 ram_size_code = cartridge[0x149];
 
+    // 0x80 = CGB enhanced, 0xC0 = CGB only; DMG cartridges keep running in DMG mode
+    cgb_mode = cartridge[0x143] & 0x80;
+    if (cgb_mode) {
+        std::cout << "Running in CGB mode" << std::endl;
+    }
+
+    // the second VRAM bank and WRAM banks 2-7 only exist on a CGB
+    vram_bank1.assign(cgb_mode ? 0x2000 : 0, 0);
+    wram_banks.assign(cgb_mode ? 0x6000 : 0, 0);
+    tile_cache.assign(VRAM_TILE_ROWS * (cgb_mode ? VRAM_BANK_COUNT : 1), {});
+
     std::cout << "Cartridge type: 0x"
               << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(cartridge_type)
               << std::dec << std::endl;
 
     cartridge_has_ram = false;
     cartridge_has_battery = false;
+    cartridge_has_rtc = false;
+    cartridge_has_rumble = false;
 
     switch (cartridge_type) {
     case 0x00:
@@ -169,11 +422,14 @@ void Gameboy::load_cartridge(const std::string& path_rom)
         break;
     case 0x0F:
         mbc_type = 3;
+        cartridge_has_battery = true;
+        cartridge_has_rtc = true;
         break;
     case 0x10:
         mbc_type = 3;
         cartridge_has_ram = true;
         cartridge_has_battery = true;
+        cartridge_has_rtc = true;
         break;
     case 0x11:
         mbc_type = 3;
@@ -187,6 +443,33 @@ void Gameboy::load_cartridge(const std::string& path_rom)
         cartridge_has_ram = true;
         cartridge_has_battery = true;
         break;
+    case 0x19:
+        mbc_type = 5;
+        break;
+    case 0x1A:
+        mbc_type = 5;
+        cartridge_has_ram = true;
+        break;
+    case 0x1B:
+        mbc_type = 5;
+        cartridge_has_ram = true;
+        cartridge_has_battery = true;
+        break;
+    case 0x1C:
+        mbc_type = 5;
+        cartridge_has_rumble = true;
+        break;
+    case 0x1D:
+        mbc_type = 5;
+        cartridge_has_ram = true;
+        cartridge_has_rumble = true;
+        break;
+    case 0x1E:
+        mbc_type = 5;
+        cartridge_has_ram = true;
+        cartridge_has_battery = true;
+        cartridge_has_rumble = true;
+        break;
     default:
         std::cerr << "Unsupported MBC type in ROM header: 0x"
                   << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(cartridge_type)
@@ -194,6 +477,13 @@ void Gameboy::load_cartridge(const std::string& path_rom)
         exit(1);
     }
 
+    // MBC1M multicarts are 1MB MBC1 ROMs with a second game header (and logo) at bank 0x10
+    mbc1_multicart = mbc_type == 1 && rom_bank_count == 64
+        && std::equal(cartridge.begin() + 0x104, cartridge.begin() + 0x134, cartridge.begin() + 0x40104);
+    if (mbc1_multicart) {
+        std::cout << "Detected MBC1 multicart" << std::endl;
+    }
+
     // MBC2 always has 512x4-bit internal RAM despite header reporting 0
     if (mbc_type == 2) {
         cartridge_has_ram = true;
@@ -245,70 +535,151 @@ void Gameboy::load_cartridge(const std::string& path_rom)
         ram_bank_count = 1;
     }
 
-    if (!cartridge_has_ram || ram_bank_size == 0 || ram_bank_count == 0) {
-        ram_banks.clear();
-    } else {
-        ram_banks.assign(ram_bank_size * ram_bank_count, 0);
+    ram_storage.clear();
+    ram_banks = {};
+    if (cartridge_has_ram && ram_bank_size != 0 && ram_bank_count != 0) {
+        ram_storage.assign(ram_bank_size * ram_bank_count, 0);
+        ram_banks = ram_storage;
     }
+    ram_bank_mask = ram_bank_size ? ram_bank_size - 1 : 0;
     set_ram_bank(0);
     ram_dirty = false;
-
-    const size_t first_chunk = std::min(cartridge.size(), size_t(0x8000));
-    std::copy(cartridge.begin(), cartridge.begin() + first_chunk, memory.begin());
-    if (first_chunk < 0x8000) {
-        std::fill(memory.begin() + first_chunk, memory.begin() + 0x8000, 0xFF);
-    }
+    rtc_registers.fill(0);
+    rtc_latched_registers.fill(0);
 
     load_save_ram();
 }
 
-void Gameboy::load_save_ram()
+bool Gameboy::has_save_file() const
 {
-    if (!cartridge_has_ram || !cartridge_has_battery || ram_banks.empty()) {
-        return;
-    }
+    return save_file_enabled && cartridge_has_battery && (!ram_banks.empty() || cartridge_has_rtc);
+}
+
+size_t Gameboy::save_file_size() const
+{
+    return ram_banks.size() + (cartridge_has_rtc ? RTC_FOOTER_SIZE : 0);
+}
 
+// reads the whole save file, returns false if it is missing or unreadable
+bool Gameboy::read_save_file(std::vector<u8>& contents) const
+{
     std::error_code ec;
     if (!fs::exists(save_path, ec)) {
         if (ec) {
             std::cerr << "Failed to access save file: " << save_path << " (" << ec.message() << ")" << std::endl;
         }
-        return;
-    }
-
-    const auto expected_size = ram_banks.size();
-    ec.clear();
-    const auto actual_size = fs::file_size(save_path, ec);
-    bool file_size_mismatch = false;
-    if (ec) {
-        std::cerr << "Failed to query save file size: " << save_path << " (" << ec.message() << ")" << std::endl;
-    } else if (actual_size != expected_size) {
-        file_size_mismatch = true;
-        std::cout << "Save file size (" << actual_size << " bytes) does not match expected RAM size (" << expected_size
-                  << " bytes); loading as much as possible." << std::endl;
+        return false;
     }
 
     std::ifstream file(save_path, std::ios::binary);
     if (!file) {
         std::cerr << "Failed to open save file for reading: " << save_path << std::endl;
+        return false;
+    }
+
+    contents.assign(std::istreambuf_iterator<char>(file), {});
+    if (file.bad()) {
+        std::cerr << "Failed while reading save file: " << save_path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// copies RAM and RTC state out of a save file image, returns whether it had the expected size
+bool Gameboy::apply_save_contents(const std::vector<u8>& contents)
+{
+    const size_t ram_size = ram_banks.size();
+    const size_t copied_bytes = std::min(ram_size, contents.size());
+    std::copy_n(contents.begin(), copied_bytes, ram_banks.begin());
+    std::fill(ram_banks.begin() + copied_bytes, ram_banks.end(), 0);
+
+    if (cartridge_has_rtc && contents.size() > ram_size) {
+        load_rtc_footer(contents.data() + ram_size, contents.size() - ram_size);
+    }
+
+    return contents.size() == save_file_size();
+}
+
+void Gameboy::load_rtc_footer(const u8* footer, size_t size)
+{
+    // 48 byte footer has a 64-bit timestamp, older 44 byte variant a 32-bit one
+    if (size != RTC_FOOTER_SIZE && size != RTC_FOOTER_SIZE - 4) {
+        std::cout << "Ignoring RTC data of unexpected size (" << size << " bytes)" << std::endl;
         return;
     }
 
-    file.read(reinterpret_cast<char*>(ram_banks.data()), static_cast<std::streamsize>(ram_banks.size()));
-    const std::streamsize read_bytes = file.gcount();
-    const size_t copied_bytes = read_bytes < 0 ? 0 : static_cast<size_t>(read_bytes);
-    if (copied_bytes < ram_banks.size()) {
-        std::fill(ram_banks.begin() + copied_bytes, ram_banks.end(), 0);
+    auto get32 = [footer](size_t offset) -> u32 {
+        return static_cast<u32>(footer[offset])
+            | (static_cast<u32>(footer[offset + 1]) << 8)
+            | (static_cast<u32>(footer[offset + 2]) << 16)
+            | (static_cast<u32>(footer[offset + 3]) << 24);
+    };
+
+    for (size_t i = 0; i < 5; ++i) {
+        rtc_registers[i] = static_cast<u8>(get32(i * 4) & RTC_REGISTER_MASKS[i]);
+        rtc_latched_registers[i] = static_cast<u8>(get32(20 + i * 4) & RTC_REGISTER_MASKS[i]);
     }
 
-    if (!file && !file.eof()) {
-        std::cerr << "Failed while reading save file: " << save_path << std::endl;
-        ram_dirty = true;
+    u64 timestamp = get32(40);
+    if (size == RTC_FOOTER_SIZE) {
+        timestamp |= static_cast<u64>(get32(44)) << 32;
+    }
+
+    rtc_last_sync_cycle = cycle_count;
+    rtc_subsecond_cycles = 0;
+
+    // catch up on the time that passed while the emulator was not running
+    const u64 now = unix_time_now();
+    if (timestamp != 0 && now > timestamp && !(rtc_registers[4] & 0x40)) {
+        rtc_advance(now - timestamp);
+    }
+}
+
+void Gameboy::store_rtc_footer(u8* footer)
+{
+    rtc_sync();
+
+    auto put32 = [footer](size_t offset, u32 value) {
+        for (size_t i = 0; i < 4; ++i) {
+            footer[offset + i] = static_cast<u8>(value >> (i * 8));
+        }
+    };
+
+    for (size_t i = 0; i < 5; ++i) {
+        put32(i * 4, rtc_registers[i]);
+        put32(20 + i * 4, rtc_latched_registers[i]);
+    }
+
+    const u64 now = unix_time_now();
+    put32(40, static_cast<u32>(now));
+    put32(44, static_cast<u32>(now >> 32));
+}
+
+void Gameboy::load_save_ram()
+{
+    if (!has_save_file()) {
+        return;
+    }
+
+    if (map_save_ram()) {
+        return;
+    }
+
+    // mapping failed, keep RAM on the heap and fall back to whole-file reads and writes
+
+    std::vector<u8> contents;
+    if (!read_save_file(contents)) {
         return;
     }
 
-    const bool partial_read = copied_bytes != expected_size;
-    ram_dirty = file_size_mismatch || partial_read;
+    const size_t expected_size = save_file_size();
+    if (contents.size() != expected_size) {
+        std::cout << "Save file size (" << contents.size() << " bytes) does not match expected size (" << expected_size
+                  << " bytes); loading as much as possible." << std::endl;
+    }
+
+    ram_dirty = !apply_save_contents(contents);
 
     if (ram_dirty) {
         std::cout << "Loaded save file: " << save_path << " (will rewrite to expected size)" << std::endl;
@@ -317,57 +688,152 @@ void Gameboy::load_save_ram()
     }
 }
 
-void Gameboy::save_save_ram()
+bool Gameboy::map_save_ram()
 {
-    if (!cartridge_has_ram || !cartridge_has_battery || ram_banks.empty()) {
-        return;
+    const size_t ram_size = ram_banks.size();
+    const size_t expected_size = save_file_size();
+
+    std::error_code ec;
+    const bool exists = fs::exists(save_path, ec);
+    if (ec) {
+        std::cerr << "Failed to access save file: " << save_path << " (" << ec.message() << ")" << std::endl;
+        return false;
     }
 
-    if (!ram_dirty) {
-        return;
+    const auto actual_size = exists ? fs::file_size(save_path, ec) : 0;
+    if (ec) {
+        std::cerr << "Failed to query save file size: " << save_path << " (" << ec.message() << ")" << std::endl;
+        return false;
     }
 
-    std::error_code ec;
-    fs::path parent = save_path.parent_path();
-    if (!parent.empty()) {
-        if (!fs::exists(parent, ec)) {
-            if (ec) {
-                std::cerr << "Failed to access save directory: " << parent << " (" << ec.message() << ")" << std::endl;
-                return;
+    const bool needs_rewrite = !exists || actual_size != expected_size;
+    if (needs_rewrite) {
+        // the mapping needs a file of exactly the right size, create or resize it atomically
+        if (exists) {
+            std::cout << "Save file size (" << actual_size << " bytes) does not match expected size (" << expected_size
+                      << " bytes); resizing." << std::endl;
+            std::vector<u8> existing;
+            if (!read_save_file(existing)) {
+                return false;
             }
-            ec.clear();
-            if (!fs::create_directories(parent, ec)) {
-                if (ec) {
-                    std::cerr << "Failed to create save directory: " << parent << " (" << ec.message() << ")" << std::endl;
-                    return;
-                }
-            }
-        } else if (ec) {
-            std::cerr << "Failed to access save directory: " << parent << " (" << ec.message() << ")" << std::endl;
-            return;
+            apply_save_contents(existing);
+        }
+
+        std::vector<u8> contents(expected_size, 0);
+        std::copy(ram_banks.begin(), ram_banks.end(), contents.begin());
+        if (cartridge_has_rtc) {
+            store_rtc_footer(contents.data() + ram_size);
+        }
+        if (!write_file_atomically(save_path, contents.data(), contents.size())) {
+            return false;
         }
     }
 
-    std::ofstream file(save_path, std::ios::binary | std::ios::trunc);
-    if (!file) {
-        std::cerr << "Failed to open save file for writing: " << save_path << std::endl;
+    const int fd = open(save_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open save file for mapping: " << save_path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, expected_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map save file: " << save_path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    save_mapping = static_cast<u8*>(mapping);
+    save_mapping_size = expected_size;
+    save_flush_timer = 0;
+    ram_storage.clear();
+    ram_storage.shrink_to_fit();
+    ram_banks = std::span<u8>(save_mapping, ram_size);
+    ram_dirty = false;
+    update_ram_mapping();
+
+    if (cartridge_has_rtc && !needs_rewrite) {
+        load_rtc_footer(save_mapping + ram_size, RTC_FOOTER_SIZE);
+    }
+
+    std::cout << "Mapped save file: " << save_path << std::endl;
+    return true;
+}
+
+void Gameboy::unmap_save_ram()
+{
+    if (!save_mapping) {
         return;
     }
 
-    file.write(reinterpret_cast<const char*>(ram_banks.data()), static_cast<std::streamsize>(ram_banks.size()));
-    if (!file) {
-        std::cerr << "Failed to write save file: " << save_path << std::endl;
+    munmap(save_mapping, save_mapping_size);
+    save_mapping = nullptr;
+    save_mapping_size = 0;
+    save_flush_timer = 0;
+    ram_banks = {};
+    update_ram_mapping();
+}
+
+void Gameboy::flush_save_mapping(bool wait)
+{
+    // ram_dirty and the timer are part of the state, the rollback leaves the flush pending
+    if (!save_mapping || speculating) {
         return;
     }
 
-    file.flush();
-    if (!file) {
-        std::cerr << "Failed to flush save file: " << save_path << std::endl;
+    ram_dirty = false;
+    save_flush_timer = 0;
+
+    if (cartridge_has_rtc) {
+        store_rtc_footer(save_mapping + ram_banks.size());
+    }
+
+    if (!wait) {
+        // msync can stall on slow storage, let the save writer thread do it
+        auto job = std::make_unique<SaveJob>();
+        job->path = save_path;
+        job->mapping = save_mapping;
+        job->mapping_size = save_mapping_size;
+        SaveWriter::instance().submit(save_slot, std::move(job));
+        metrics.save_flushes.add(1);
+        return;
+    }
+
+    SaveWriter::instance().drain(save_slot);
+    metrics.save_flushes.add(1);
+    if (msync(save_mapping, save_mapping_size, MS_SYNC) != 0) {
+        std::cerr << "Failed to flush save file: " << save_path << " (" << std::strerror(errno) << ")" << std::endl;
+    }
+}
+
+void Gameboy::save_save_ram()
+{
+    if (!has_save_file() || speculating) {
+        return;
+    }
+
+    if (!ram_dirty) {
         return;
     }
 
+    if (save_mapping) {
+        // writes already landed in the page cache, just make sure a flush is pending
+        if (save_flush_timer == 0) {
+            save_flush_timer = SAVE_FLUSH_INTERVAL;
+        }
+        return;
+    }
+
+    // hand a snapshot to the save writer thread, the emulation keeps going immediately
+    auto job = std::make_unique<SaveJob>();
+    job->path = save_path;
+    job->snapshot.resize(save_file_size());
+    std::copy(ram_banks.begin(), ram_banks.end(), job->snapshot.begin());
+    if (cartridge_has_rtc) {
+        store_rtc_footer(job->snapshot.data() + ram_banks.size());
+    }
+    SaveWriter::instance().submit(save_slot, std::move(job));
+    metrics.save_flushes.add(1);
     ram_dirty = false;
-    std::cout << "Saved save file: " << save_path << std::endl;
 }
 
 void Gameboy::extract_header_title()
@@ -384,6 +850,21 @@ void Gameboy::extract_header_title()
 
 void Gameboy::initialize_cpu_state()
 {
+    if (boot_rom_mapped) {
+        AF = BC = DE = HL = SP = PC = 0; // the boot ROM sets up what the cartridge relies on
+        return;
+    }
+
+    if (cgb_mode) {
+        AF = 0x1180;
+        BC = 0x0000;
+        DE = 0xFF56;
+        HL = 0x000D;
+        SP = 0xFFFE;
+        PC = 0x0100;
+        return;
+    }
+
     AF = 0x01B0;
     BC = 0x0013;
     DE = 0x00D8;
@@ -394,6 +875,20 @@ void Gameboy::initialize_cpu_state()
 
 void Gameboy::initialize_io_registers()
 {
+    if (boot_rom_mapped) {
+        // power on, the LCD and sound are switched off until the boot ROM turns them on
+        memory[0xFF00] = 0xCF;
+        memory[0xFF0F] = 0xE0;
+        apu.reset(cycle_count);
+        apu.write(0xFF26, 0x00, cycle_count);
+        for (u8 palette = 0; palette < 3; ++palette) {
+            refresh_palette_cache(palette, 0x00);
+        }
+        ppu_mode = 0;
+        update_stat_coincidence_flag();
+        return;
+    }
+
     memory[0xFF00] = 0xCF;
     memory[0xFF01] = 0x00;
     memory[0xFF02] = 0x7E;
@@ -402,27 +897,7 @@ void Gameboy::initialize_io_registers()
     memory[0xFF06] = 0x00;
     memory[0xFF07] = 0xF8;
     memory[0xFF0F] = 0xE1;
-    memory[0xFF10] = 0x80;
-    memory[0xFF11] = 0xBF;
-    memory[0xFF12] = 0xF3;
-    memory[0xFF13] = 0xFF;
-    memory[0xFF14] = 0xBF;
-    memory[0xFF16] = 0x3F;
-    memory[0xFF17] = 0x00;
-    memory[0xFF18] = 0xFF;
-    memory[0xFF19] = 0xBF;
-    memory[0xFF1A] = 0x7F;
-    memory[0xFF1B] = 0xFF;
-    memory[0xFF1C] = 0x9F;
-    memory[0xFF1D] = 0xFF;
-    memory[0xFF1E] = 0xBF;
-    memory[0xFF20] = 0xFF;
-    memory[0xFF21] = 0x00;
-    memory[0xFF22] = 0x00;
-    memory[0xFF23] = 0xBF;
-    memory[0xFF24] = 0x77;
-    memory[0xFF25] = 0xF3;
-    memory[0xFF26] = 0xF1;
+    apu.reset(cycle_count); // sound registers live in the APU
     memory[0xFF40] = 0x91;
     memory[0xFF41] = 0x85;
     memory[0xFF42] = 0x00;
@@ -441,16 +916,55 @@ void Gameboy::initialize_io_registers()
     refresh_palette_cache(1, memory[0xFF48]);
     refresh_palette_cache(2, memory[0xFF49]);
 
+    if (cgb_mode) {
+        // expose the CGB registers, everything else in 0xFF4C-0xFF7F stays unmapped
+        io_register_masks[0x02] = 0x7C; // SC: bit 1 selects the fast clock
+        io_register_masks[0x4D] = 0x7E; // KEY1: bits 1-6 unused
+        io_register_masks[0x4F] = 0xFE; // VBK: bits 1-7 unused
+        io_register_masks[0x55] = 0x00; // HDMA5
+        io_register_masks[0x68] = 0x40; // BCPS: bit 6 unused
+        io_register_masks[0x69] = 0x00; // BCPD
+        io_register_masks[0x6A] = 0x40; // OCPS: bit 6 unused
+        io_register_masks[0x6B] = 0x00; // OCPD
+        io_register_masks[0x70] = 0xF8; // SVBK: bits 3-7 unused
+
+        memory[0xFF4D] = 0x00;
+        memory[0xFF4F] = 0x00;
+        memory[0xFF55] = 0xFF;
+        memory[0xFF68] = 0x00;
+        memory[0xFF69] = bg_palette_ram[0];
+        memory[0xFF6A] = 0x00;
+        memory[0xFF6B] = obj_palette_ram[0];
+        memory[0xFF70] = 0x01;
+    }
+
     ppu_mode = memory[0xFF41] & 0x03;
     update_stat_coincidence_flag();
 }
 
 void Gameboy::initialize_runtime_state()
 {
-    framebuffer_front_pixels = framebuffers[0].data();
-    framebuffer_back_pixels = framebuffers[1].data();
-    framebuffers[0].fill(0);
-    framebuffers[1].fill(0);
+    framebuffer_front_index = 0;
+    framebuffer_back_index = 1;
+    framebuffer_ready.store(2, std::memory_order_relaxed);
+    framebuffer_front_pixels = nullptr;
+    framebuffer_back_pixels = nullptr;
+    if (framebuffers) {
+        // back buffers are drawn over line by line before they are published, only the picture
+        // shown until then has to be blank like in a new instance
+        (*framebuffers)[framebuffer_front_index].fill(0);
+        framebuffer_front_pixels = (*framebuffers)[framebuffer_front_index].data();
+        framebuffer_back_pixels = (*framebuffers)[framebuffer_back_index].data();
+    }
+    hidden_pictures = 0;
+    speculating = false;
+    static std::atomic<u64> next_instance_id { 1 };
+    instance_id = next_instance_id.fetch_add(1, std::memory_order_relaxed);
+    write_clock.store(1, std::memory_order_relaxed);
+    page_stamps.assign(CART_RAM_FIRST_PAGE + (ram_banks.size() + STATE_PAGE_SIZE - 1) / STATE_PAGE_SIZE, 0);
+    fork_parent_id = 0;
+    fork_parent_clock = 0;
+    fork_clock = 0;
     for (auto& row : tile_cache) {
         row.fill(0);
     }
@@ -463,6 +977,7 @@ void Gameboy::initialize_runtime_state()
     halted = false;
     halt_bug = false;
     joypad_state = 0xFF; // all buttons unpressed
+    input_buttons.store(0xFF, std::memory_order_relaxed);
     timer_counter = 1024; // CLOCKSPEED / frequency (4096 Hz default)
     divider_counter = 0; // DIV increments at 16384 Hz
 }
@@ -984,13 +1499,17 @@ void Gameboy::init_graphics()
 {
     target_fps = 60;
 
-    window_title = "Gameboy Emulator - " + header_title;
-
+#ifndef HEADLESS
+    window_title = "Gameboy Emulator - ";
+    window_title += header_title;
     InitWindow(SCREEN_WIDTH * SCREEN_SCALE, SCREEN_HEIGHT * SCREEN_SCALE, window_title.c_str());
-    SetTargetFPS(target_fps);
+    // presentation runs at the display's rate, emulation is paced separately
+    const int refresh_rate = GetMonitorRefreshRate(GetCurrentMonitor());
+    SetTargetFPS(refresh_rate > 0 ? refresh_rate : 60);
     SetExitKey(0); // Disable ESC exit key
 
     // Create texture for framebuffer
+    allocate_framebuffers();
     Image image = {
         .data = framebuffer_front_pixels,
         .width = SCREEN_WIDTH,
@@ -1002,15 +1521,60 @@ void Gameboy::init_graphics()
     Texture2D* tex = new Texture2D(LoadTextureFromImage(image));
     SetTextureFilter(*tex, TEXTURE_FILTER_POINT);
     texture = static_cast<void*>(tex);
+#endif
+}
+
+void Gameboy::init_audio()
+{
+    audio_output.open_device();
+
+    // without a consumer there is no point in synthesizing samples
+    apu.set_muted(audio_output.sink == AudioSink::none, cycle_count);
+    apply_frame_pacing();
+}
+
+void Gameboy::queue_audio()
+{
+    audio_output.submit(apu, audio_sync || audio_output.sink == AudioSink::wav);
+}
+
+void Gameboy::apply_frame_pacing()
+{
+    // at normal speed the audio device paces frames, fast and slow motion fall back to the frame timer
+    audio_sync = audio_output.sink == AudioSink::device && target_fps.load(std::memory_order_relaxed) == 60;
+}
+
+// paces the emulation thread with a frame timer unless queue_audio already blocked on the audio device
+void Gameboy::wait_for_next_frame()
+{
+    apply_frame_pacing();
+    if (audio_sync) {
+        next_frame_time = std::chrono::steady_clock::now();
+        return;
+    }
+
+    const auto period = std::chrono::nanoseconds(1'000'000'000 / target_fps.load(std::memory_order_relaxed));
+    const auto now = std::chrono::steady_clock::now();
+    next_frame_time += period;
+    if (next_frame_time + period < now) {
+        next_frame_time = now; // fell behind by more than a frame, do not try to catch up
+    } else {
+        std::this_thread::sleep_until(next_frame_time);
+    }
 }
 
 void Gameboy::update_window_title(size_t measured_fps)
 {
+#ifndef HEADLESS
     SetWindowTitle(std::format("{} - {} FPS", window_title, measured_fps).c_str());
+#else
+    (void)measured_fps;
+#endif
 }
 
 void Gameboy::cleanup_graphics()
 {
+#ifndef HEADLESS
     if (texture) {
         Texture2D* tex = static_cast<Texture2D*>(texture);
         UnloadTexture(*tex);
@@ -1018,6 +1582,7 @@ void Gameboy::cleanup_graphics()
         texture = nullptr;
     }
     CloseWindow();
+#endif
 }
 
 void Gameboy::request_interrupt(u8 bit)
@@ -1029,36 +1594,27 @@ void Gameboy::write8(u16 addr, u8 value)
 {
     if (addr < 0x8000) {
         handle_banking(addr, value);
-    } else if (addr < 0x9800) {
-        memory[addr] = value;
-        update_tile_cache(addr);
-    } else if ((addr >= 0xA000) && (addr < 0xC000)) {
-        if (!ram_enabled) {
-            return;
+    } else if (addr < 0xA000) {
+        vram_ptr[addr - 0x8000] = value;
+        metrics.vram_writes.add(1);
+        mark_page(vram_bank ? VRAM1_FIRST_PAGE + ((addr >> 12) & 1) : (addr - 0x8000) >> 12);
+        if (addr < 0x9800) {
+            update_tile_cache(vram_bank, addr);
         }
-
-        if (mbc_type == 3 && rtc_selected_register <= 0x04) {
-            rtc_registers[rtc_selected_register] = value;
-            return;
-        }
-
-        if (ram_banks.empty() || ram_bank_size == 0 || ram_bank_count == 0) {
-            return;
-        }
-
-        const size_t offset = addr - 0xA000;
-        const size_t bank_offset = ram_bank_size ? (offset % ram_bank_size) : 0;
-        const size_t bank_index = ram_bank_count ? (current_ram_bank % ram_bank_count) : 0;
-        const size_t absolute_index = bank_index * ram_bank_size + bank_offset;
-        if (absolute_index >= ram_banks.size()) {
-            return;
-        }
-
-        u8& target = ram_banks[absolute_index];
-        if (target != value) {
-            target = value;
-            ram_dirty = true;
+    } else if ((addr >= 0xA000) && (addr < 0xC000)) {
+        if (current_ram_bank_ptr) {
+            u8& target = current_ram_bank_ptr[(addr - 0xA000) & ram_bank_mask];
+            if (target != value) {
+                target = value;
+                ram_dirty = true;
+                mark_page(CART_RAM_FIRST_PAGE + static_cast<size_t>(&target - ram_banks.data()) / STATE_PAGE_SIZE);
+            }
+        } else if (rtc_selected_register <= 0x04 && ram_enabled) {
+            rtc_write(rtc_selected_register, value);
         }
+    } else if ((addr >= 0xD000) && (addr < 0xE000)) {
+        wram_bank_ptr[addr - 0xD000] = value;
+        mark_page(wram_bank >= 2 ? WRAM_FIRST_PAGE + wram_bank - 2 : (0xD000 - 0x8000) / STATE_PAGE_SIZE);
     } else if (addr == 0xFF00) {
         // joypad register, only bits 4-5 are writable
         memory[0xFF00] = (memory[0xFF00] & 0xCF) | (value & 0x30);
@@ -1086,12 +1642,16 @@ void Gameboy::write8(u16 addr, u8 value)
                 break; // 16384 Hz
             }
         }
+    } else if (addr == 0xFF02) {
+        write_serial_control(value);
     } else if (addr == 0xFF0F) {
         // IF (0xFF0F): only bits 0-4 are writable
         memory[0xFF0F] = value & 0x1F;
     } else if (addr == 0xFF44) {
         // writing to LY register resets it to 0
         memory[0xFF44] = 0;
+    } else if (addr >= 0xFF10 && addr < 0xFF40) {
+        apu.write(addr, value, cycle_count);
     } else if (addr == 0xFF46) {
         // DMA transfer
         u16 source = static_cast<u16>(value) << 8;
@@ -1101,8 +1661,20 @@ void Gameboy::write8(u16 addr, u8 value)
     } else if (addr == 0xFF47 || addr == 0xFF48 || addr == 0xFF49) {
         memory[addr] = value;
         refresh_palette_cache(static_cast<u8>(addr - 0xFF47), value);
+    } else if (addr == 0xFF50 && boot_rom_mapped && value) {
+        // the boot ROM hands over to the cartridge, there is no mapping it back in
+        boot_rom_mapped = false;
+        set_rom_bank0(0);
+        if (mbc_type == 1) {
+            update_mbc1_banks();
+        }
+    } else if (cgb_mode && addr >= 0xFF4D && addr <= 0xFF70) {
+        write_cgb_register(addr, value);
     } else {
         memory[addr] = value;
+        if (addr < 0xF000) {
+            mark_page((addr - 0x8000) / STATE_PAGE_SIZE);
+        }
     }
 }
 
@@ -1134,7 +1706,7 @@ void Gameboy::handle_banking(u16 addr, u8 value)
             } else if (masked == 0x00) {
                 ram_enabled = false;
             }
-        } else if (mbc_type == 3) {
+        } else if (mbc_type == 3 || mbc_type == 5) {
             value &= 0x0F;
             ram_enabled = (value == 0x0A);
             if (!ram_enabled) {
@@ -1142,58 +1714,81 @@ void Gameboy::handle_banking(u16 addr, u8 value)
             }
         }
 
+        update_ram_mapping();
+
         if (previous_ram_enabled && !ram_enabled) {
             save_save_ram();
         }
     }
     // ROM bank change
     else if ((addr >= 0x2000) && (addr < 0x4000)) {
+        if (mbc_type) {
+            metrics.bank_switches.add(1);
+        }
         if (mbc_type == 1 || mbc_type == 2) {
 
             // DoChangeLoROMBank
 
             if (mbc_type == 2) {
                 u16 bank = value & 0x0F;
-                set_rom_bank(bank);
+                set_rom_bank(bank ? bank : 1);
                 return;
             }
 
-            u16 bank = (current_rom_bank & 0xE0) | (value & 0x1F); // combine high bits with new low bits
-            set_rom_bank(bank);
+            // bank 0 is translated before the upper bits are applied, so 0x20 selects 0x21
+            bank_register_low = value & 0x1F;
+            if (bank_register_low == 0) {
+                bank_register_low = 1;
+            }
+            update_mbc1_banks();
         }
         if (mbc_type == 3) {
             u16 bank = value & 0x7F;
-            set_rom_bank(bank);
+            set_rom_bank(bank ? bank : 1);
+        }
+        if (mbc_type == 5) {
+            // low 8 bits at 0x2000-0x2FFF, bit 8 at 0x3000-0x3FFF, bank 0 is selectable
+            if (addr < 0x3000) {
+                bank_register_low = value;
+            } else {
+                bank_register_high = value & 0x01;
+            }
+            set_rom_bank(static_cast<u16>((bank_register_high << 8) | bank_register_low));
         }
     }
     // do ROM or RAM bank change
     else if ((addr >= 0x4000) && (addr < 0x6000)) {
+        if (mbc_type) {
+            metrics.bank_switches.add(1);
+        }
         // there is no MBC2 RAM banking
         if (mbc_type == 1) {
-            if (rom_banking) {
 
-                // DoChangeHiRomBank
+            // DoChangeHiRomBank / DoRAMBankChange, which one depends on the banking mode
 
-                u16 bank = (current_rom_bank & 0x1F) | (value & 0xE0); // combine low bits with new high bits
-                set_rom_bank(bank);
-
-            } else {
-
-                // DoRAMBankChange
-
-                set_ram_bank(value & 0x03);
-            }
+            bank_register_high = value & 0x03;
+            update_mbc1_banks();
         }
         if (mbc_type == 3) {
             if ((value & 0x0F) <= 0x03) {
-                set_ram_bank(value & 0x03);
                 rtc_selected_register = 0xFF;
+                set_ram_bank(value & 0x03);
             } else if ((value & 0x0F) >= 0x08 && (value & 0x0F) <= 0x0C) {
                 rtc_selected_register = (value & 0x0F) - 0x08;
+                update_ram_mapping();
             } else {
                 rtc_selected_register = 0xFF;
+                update_ram_mapping();
             }
         }
+        if (mbc_type == 5) {
+            if (cartridge_has_rumble) {
+                // bit 3 drives the motor instead of selecting RAM
+                rumble_active = value & 0x08;
+                value &= 0x07;
+            }
+            set_ram_bank(value & 0x0F);
+        }
     }
     // this will change whether we are doing ROM banking
     // or RAM banking with the above if statement
@@ -1204,15 +1799,14 @@ void Gameboy::handle_banking(u16 addr, u8 value)
 
             value &= 0x01;
             rom_banking = (value == 0);
-            if (rom_banking) {
-                set_ram_bank(0);
-            }
+            update_mbc1_banks();
         } else if (mbc_type == 3) {
             if (value == 0x00) {
                 rtc_latch_active = false;
                 rtc_latch_previous_value = 0x00;
             } else if (value == 0x01) {
                 if (rtc_latch_previous_value == 0x00) {
+                    rtc_sync();
                     rtc_latched_registers = rtc_registers;
                     rtc_latch_active = true;
                 }
@@ -1226,28 +1820,148 @@ void Gameboy::set_rom_bank(u16 bank)
 {
     if (rom_bank_count == 0) {
         current_rom_bank = 0;
-        current_rom_bank_ptr = memory.data() + 0x4000;
         return;
     }
 
-    bank %= rom_bank_count;
-    if (bank == 0 && rom_bank_count > 1) {
-        bank = 1;
-    }
-
-    current_rom_bank = bank;
+    current_rom_bank = bank % rom_bank_count;
     const size_t offset = static_cast<size_t>(current_rom_bank) * 0x4000;
     current_rom_bank_ptr = cartridge.data() + offset;
 }
 
+void Gameboy::set_rom_bank0(u16 bank)
+{
+    if (rom_bank_count == 0) {
+        return;
+    }
+
+    // the mapper cannot move the boot ROM, it covers bank 0 until it hands over
+    rom_bank0_ptr = boot_rom_mapped ? boot_image->bank0.data() : cartridge.data() + static_cast<size_t>(bank % rom_bank_count) * 0x4000;
+}
+
 void Gameboy::set_ram_bank(u8 bank)
 {
     if (ram_bank_count == 0) {
         current_ram_bank = 0;
+    } else {
+        current_ram_bank = bank % ram_bank_count;
+    }
+
+    update_ram_mapping();
+}
+
+// MBC1 derives all three mappings from BANK1, BANK2 and the banking mode
+void Gameboy::update_mbc1_banks()
+{
+    const int high_shift = mbc1_multicart ? 4 : 5;
+    const u16 low = mbc1_multicart ? (bank_register_low & 0x0F) : bank_register_low;
+    const u16 high = static_cast<u16>(bank_register_high << high_shift);
+
+    set_rom_bank(high | low);
+    set_rom_bank0(rom_banking ? 0 : high);
+    set_ram_bank(rom_banking ? 0 : bank_register_high);
+}
+
+// recomputes the pointer read8/write8 use for 0xA000-0xBFFF, only called when banking state changes
+void Gameboy::update_ram_mapping()
+{
+    if (!ram_enabled || ram_banks.empty() || rtc_selected_register <= 0x04) {
+        current_ram_bank_ptr = nullptr;
+        return;
+    }
+
+    current_ram_bank_ptr = ram_banks.data() + static_cast<size_t>(current_ram_bank) * ram_bank_size;
+}
+
+// brings rtc_registers up to date with the emulated time that passed since the last sync
+void Gameboy::rtc_sync()
+{
+    const u64 elapsed = cycle_count - rtc_last_sync_cycle;
+    rtc_last_sync_cycle = cycle_count;
+
+    if (rtc_registers[4] & 0x40) {
+        return; // halted
+    }
+
+    const u64 cycles = rtc_subsecond_cycles + elapsed;
+    rtc_subsecond_cycles = static_cast<u32>(cycles % CLOCKSPEED);
+    rtc_advance(cycles / CLOCKSPEED);
+}
+
+void Gameboy::rtc_advance(u64 seconds)
+{
+    auto& rtc = rtc_registers;
+
+    // out of range values written by the game count up to the register width and
+    // wrap to 0 without carrying, so walk those back into range one second at a time
+    while (seconds > 0 && (rtc[0] >= 60 || rtc[1] >= 60 || rtc[2] >= 24)) {
+        rtc_tick();
+        --seconds;
+    }
+
+    if (seconds == 0) {
+        return;
+    }
+
+    u64 total = (static_cast<u64>(rtc[4] & 0x01) << 8) | rtc[3];
+    total = ((total * 24 + rtc[2]) * 60 + rtc[1]) * 60 + rtc[0] + seconds;
+
+    rtc[0] = static_cast<u8>(total % 60);
+    total /= 60;
+    rtc[1] = static_cast<u8>(total % 60);
+    total /= 60;
+    rtc[2] = static_cast<u8>(total % 24);
+    total /= 24;
+
+    u8 day_high = rtc[4] & 0xC0;
+    if (total > 0x1FF) {
+        day_high |= 0x80; // day counter overflow, sticky until the game clears it
+        total &= 0x1FF;
+    }
+    rtc[3] = static_cast<u8>(total & 0xFF);
+    rtc[4] = static_cast<u8>(day_high | ((total >> 8) & 0x01));
+}
+
+void Gameboy::rtc_tick()
+{
+    auto& rtc = rtc_registers;
+
+    rtc[0] = static_cast<u8>((rtc[0] + 1) & 0x3F);
+    if (rtc[0] != 60) {
+        return;
+    }
+    rtc[0] = 0;
+
+    rtc[1] = static_cast<u8>((rtc[1] + 1) & 0x3F);
+    if (rtc[1] != 60) {
+        return;
+    }
+    rtc[1] = 0;
+
+    rtc[2] = static_cast<u8>((rtc[2] + 1) & 0x1F);
+    if (rtc[2] != 24) {
         return;
     }
+    rtc[2] = 0;
+
+    u16 day = static_cast<u16>(((rtc[4] & 0x01) << 8) | rtc[3]);
+    day = static_cast<u16>(day + 1);
+    if (day > 0x1FF) {
+        day = 0;
+        rtc[4] |= 0x80;
+    }
+    rtc[3] = static_cast<u8>(day & 0xFF);
+    rtc[4] = static_cast<u8>((rtc[4] & 0xFE) | ((day >> 8) & 0x01));
+}
+
+void Gameboy::rtc_write(u8 reg, u8 value)
+{
+    rtc_sync();
 
-    current_ram_bank = bank % ram_bank_count;
+    if (reg == 0) {
+        rtc_subsecond_cycles = 0; // writing seconds resets the prescaler
+    }
+
+    rtc_registers[reg] = value & RTC_REGISTER_MASKS[reg];
 }
 
 void Gameboy::refresh_palette_cache(u8 index, u8 value)
@@ -1259,7 +1973,7 @@ void Gameboy::refresh_palette_cache(u8 index, u8 value)
     cache[3] = DMG_PALETTE[(value >> 6) & 0x03];
 }
 
-void Gameboy::update_tile_cache(u16 addr)
+void Gameboy::update_tile_cache(u8 bank, u16 addr)
 {
     if (addr < 0x8000 || addr >= 0x9800) {
         return;
@@ -1273,16 +1987,139 @@ void Gameboy::update_tile_cache(u16 addr)
 
     const size_t tile_index = static_cast<size_t>(tile_offset / 16);
     const size_t row_index = static_cast<size_t>((tile_offset / 2) % 8);
-    const u8 low = memory[base];
-    const u8 high = memory[static_cast<u16>(base + 1)];
+    const u8* const vram = bank ? vram_bank1.data() : memory.at(0x8000);
+    const u8 low = vram[tile_offset];
+    const u8 high = vram[tile_offset + 1];
 
-    auto& decoded_row = tile_cache[tile_index * 8 + row_index];
+    auto& decoded_row = tile_cache[bank * VRAM_TILE_ROWS + tile_index * 8 + row_index];
     for (int bit = 7; bit >= 0; --bit) {
         const u8 color = static_cast<u8>(((high >> bit) & 0x01) << 1 | ((low >> bit) & 0x01));
         decoded_row[7 - bit] = color;
     }
 }
 
+void Gameboy::write_cgb_register(u16 addr, u8 value)
+{
+    switch (addr) {
+    case 0xFF4D:
+        // KEY1: only the prepare bit is writable, the switch happens on STOP
+        memory[0xFF4D] = static_cast<u8>((double_speed ? 0x80 : 0x00) | (value & 0x01));
+        break;
+    case 0xFF4F:
+        set_vram_bank(value & 0x01);
+        break;
+    case 0xFF51:
+        hdma_source = static_cast<u16>((hdma_source & 0x00FF) | (value << 8));
+        break;
+    case 0xFF52:
+        hdma_source = static_cast<u16>((hdma_source & 0xFF00) | (value & 0xF0));
+        break;
+    case 0xFF53:
+        hdma_destination = static_cast<u16>((hdma_destination & 0x00FF) | ((value & 0x1F) << 8));
+        break;
+    case 0xFF54:
+        hdma_destination = static_cast<u16>((hdma_destination & 0xFF00) | (value & 0xF0));
+        break;
+    case 0xFF55: {
+        if (hdma_active && !(value & 0x80)) {
+            // writing bit 7 = 0 during an HBlank DMA cancels it
+            hdma_active = false;
+            memory[0xFF55] = static_cast<u8>(0x80 | ((hdma_blocks_left - 1) & 0x7F));
+            break;
+        }
+
+        hdma_blocks_left = static_cast<u8>((value & 0x7F) + 1);
+        if (value & 0x80) {
+            hdma_active = true;
+            memory[0xFF55] = static_cast<u8>(hdma_blocks_left - 1);
+            break;
+        }
+
+        // general purpose DMA copies everything at once while the CPU is stalled
+        while (hdma_blocks_left > 0) {
+            run_hdma_block();
+        }
+        break;
+    }
+    case 0xFF68:
+        memory[0xFF68] = value & 0xBF;
+        memory[0xFF69] = bg_palette_ram[value & 0x3F];
+        break;
+    case 0xFF69:
+        write_palette_data(false, value);
+        break;
+    case 0xFF6A:
+        memory[0xFF6A] = value & 0xBF;
+        memory[0xFF6B] = obj_palette_ram[value & 0x3F];
+        break;
+    case 0xFF6B:
+        write_palette_data(true, value);
+        break;
+    case 0xFF70:
+        set_wram_bank(value & 0x07);
+        break;
+    default:
+        memory[addr] = value;
+        break;
+    }
+}
+
+void Gameboy::set_vram_bank(u8 bank)
+{
+    vram_bank = bank & 0x01;
+    vram_ptr = vram_bank ? vram_bank1.data() : memory.at(0x8000);
+    memory[0xFF4F] = vram_bank;
+}
+
+void Gameboy::set_wram_bank(u8 bank)
+{
+    wram_bank = bank ? bank : 1; // bank 0 selects bank 1
+    wram_bank_ptr = wram_bank == 1 ? memory.at(0xD000) : wram_banks.data() + (wram_bank - 2) * 0x1000;
+    memory[0xFF70] = wram_bank;
+}
+
+void Gameboy::write_palette_data(bool obj, u8 value)
+{
+    const u16 index_register = obj ? 0xFF6A : 0xFF68;
+    auto& palette_ram = obj ? obj_palette_ram : bg_palette_ram;
+    auto& cache = obj ? cgb_obj_palette_cache : cgb_bg_palette_cache;
+
+    const u8 spec = memory[index_register];
+    const u8 index = spec & 0x3F;
+    palette_ram[index] = value;
+
+    // each color is two bytes, refresh the decoded entry it belongs to
+    const u8 color_index = index & 0x3E;
+    const u16 color = static_cast<u16>(palette_ram[color_index] | (palette_ram[color_index + 1] << 8));
+    cache[color_index >> 3][(color_index >> 1) & 0x03] = RGB555_TO_RGBA[color & 0x7FFF];
+
+    u8 next_index = index;
+    if (spec & 0x80) {
+        next_index = (index + 1) & 0x3F; // auto increment
+        memory[index_register] = static_cast<u8>((spec & 0x80) | next_index);
+    }
+    memory[index_register + 1] = palette_ram[next_index];
+}
+
+// a block takes 8 us in either speed, the CPU is stalled for it, after this instruction for an HBlank DMA
+void Gameboy::run_hdma_block()
+{
+    dma_stall_cycles += double_speed ? 64 : 32;
+    for (int i = 0; i < 16; ++i) {
+        const u8 value = read8(hdma_source);
+        write8(static_cast<u16>(0x8000 | (hdma_destination & 0x1FFF)), value);
+        hdma_source = static_cast<u16>(hdma_source + 1);
+        hdma_destination = static_cast<u16>((hdma_destination + 1) & 0x1FFF);
+    }
+
+    if (--hdma_blocks_left == 0) {
+        hdma_active = false;
+        memory[0xFF55] = 0xFF;
+    } else {
+        memory[0xFF55] = static_cast<u8>(hdma_blocks_left - 1);
+    }
+}
+
 u8 Gameboy::run_opcode()
 {
     if (halted) {
@@ -1293,6 +2130,9 @@ u8 Gameboy::run_opcode()
     bool had_halt_bug = halt_bug;
 
     u8 opcode = read8(had_halt_bug ? PC + 1 : PC);
+    if (trace) [[unlikely]] {
+        trace->record_instruction(*this, opcode);
+    }
     u8 cycles = opcodes[opcode](*this);
 
     if (had_halt_bug) {
@@ -1307,16 +2147,16 @@ u8 Gameboy::run_opcode()
     return cycles;
 }
 
-void Gameboy::update_inputs()
+// samples the keyboard on the presentation thread, the emulation thread picks the result up in update_inputs
+void Gameboy::poll_keyboard()
 {
+#ifndef HEADLESS
     // handle FPS updates with page up and down
 
     if (IsKeyPressed(KEY_PAGE_UP)) {
-        target_fps += 30;
-        SetTargetFPS(target_fps);
+        target_fps.fetch_add(30, std::memory_order_relaxed);
     } else if (IsKeyPressed(KEY_PAGE_DOWN)) {
-        target_fps = std::max(target_fps - 30, 30);
-        SetTargetFPS(target_fps);
+        target_fps.store(std::max(target_fps.load(std::memory_order_relaxed) - 30, 30), std::memory_order_relaxed);
     }
 
     // now the actual gameboy inputs
@@ -1349,6 +2189,14 @@ void Gameboy::update_inputs()
         new_state &= ~(1 << 7); // Start
     }
 
+    input_buttons.store(new_state, std::memory_order_relaxed);
+#endif
+}
+
+void Gameboy::update_inputs()
+{
+    const u8 new_state = input_buttons.load(std::memory_order_relaxed);
+
     u8 pressed = joypad_state & ~new_state; // bits that went from 1 to 0
     joypad_state = new_state; // save new state
 
@@ -1387,6 +2235,7 @@ u8 Gameboy::check_interrupts()
         ime = false;
         ime_scheduled = false;
         write8(0xFF0F, requested & ~(1 << bit_idx));
+        metrics.interrupts[bit_idx].add(1);
 
         SP -= 2;
         write16(SP, PC);
@@ -1408,6 +2257,9 @@ u8 Gameboy::check_interrupts()
             PC = 0x60;
             break; // Joypad
         }
+        if (trace) [[unlikely]] {
+            trace->record_interrupt(*this, static_cast<u8>(bit_idx));
+        }
 
         return 20; // 20 t-cycles
     }
@@ -1427,14 +2279,15 @@ void Gameboy::update_timers(u8 cycles)
     }
 
     // timer enabled if bit 2 of TMC is set
-    if (read8(TMC) & (1 << 2)) {
+    // (TMC/TIMA/TMA are plain memory, skip the read8/write8 dispatch on this hot path)
+    if (memory[TMC] & (1 << 2)) {
 
         timer_counter -= cycles;
 
         while (timer_counter <= 0) {
 
             // reset clock based on frequency
-            switch (read8(TMC) & 0x3) {
+            switch (memory[TMC] & 0x3) {
             case 0:
                 timer_counter += 1024;
                 break; // 4096 Hz
@@ -1450,11 +2303,11 @@ void Gameboy::update_timers(u8 cycles)
             }
 
             // check for timer overflow interrupt
-            if (read8(TIMA) == 255) {
-                write8(TIMA, read8(TMA));
+            if (memory[TIMA] == 255) {
+                memory[TIMA] = memory[TMA];
                 request_interrupt(2);
             } else {
-                write8(TIMA, read8(TIMA) + 1);
+                memory[TIMA]++;
             }
         }
     }
@@ -1551,6 +2404,24 @@ void Gameboy::evaluate_sprites(u8 ly)
     }
 }
 
+// whether render_scanline would draw part of the window on the current line
+bool Gameboy::scanline_uses_window() const
+{
+    const u8 ly = memory[0xFF44];
+    const u8 lcdc = memory[0xFF40];
+    return ly < SCREEN_HEIGHT && (lcdc & 0x20) && ly >= memory[0xFF4A] && memory[0xFF4B] <= 166;
+}
+
+// lines of the back buffer that belong to the picture in progress, the rest is stale
+size_t Gameboy::drawn_lines() const
+{
+    const u8 ly = memory[0xFF44];
+    if (ly >= SCREEN_HEIGHT) {
+        return 0; // the finished picture was already published at LY 144
+    }
+    return ly + (scanline_rendered ? 1 : 0);
+}
+
 bool Gameboy::render_scanline()
 {
     const u8 ly = memory[0xFF44];
@@ -1586,7 +2457,7 @@ bool Gameboy::render_scanline()
     const int window_tile_row = (window_line >> 3) & 0x1F;
     const int window_tile_line = window_line & 0x07;
 
-    const u8* mem = memory.data();
+    const HighMemory& mem = memory;
 
     auto compute_tile_addr = [use_signed_tile_index](u8 tile_number) -> u16 {
         if (!use_signed_tile_index) {
@@ -1693,14 +2564,12 @@ bool Gameboy::render_scanline()
                 continue;
             }
             const size_t cache_index = static_cast<size_t>(tile_offset / 16) * 8 + tile_line;
-            const auto& decoded_row = tile_cache[cache_index];
+            const u64 row = tile_row_bits(tile_cache[cache_index], sprite.attributes & 0x20);
 
-            const bool flip_x = sprite.attributes & 0x20;
             const int start_px = std::max(0, -screen_x);
             const int end_px = std::min(8, SCREEN_WIDTH - screen_x);
             for (int px = start_px; px < end_px; ++px) {
-                const int src_px = flip_x ? (7 - px) : px;
-                const u8 color = decoded_row[src_px];
+                const u8 color = static_cast<u8>((row >> (px * 8)) & 0x03);
                 if (color == 0) {
                     continue;
                 }
@@ -1718,31 +2587,287 @@ bool Gameboy::render_scanline()
         }
     }
 
-    const u32* const bg_palette = palette_cache[0].data();
-    const u32* const obj_palette0 = palette_cache[1].data();
-    const u32* const obj_palette1 = palette_cache[2].data();
+    // picks BG or sprite for every pixel, emit gets the palette (0 BGP, 1 OBP0, 2 OBP1) and the color number
+    auto compose = [&](auto&& emit) {
+        for (int x = 0; x < SCREEN_WIDTH; ++x) {
+            const u8 bg_color = bg_colors[x];
+            u8 color_id = bg_enabled ? bg_color : 0;
+            int palette = 0;
+
+            if (sprite_enabled && sprite_line_stamp[x] == sprite_line_stamp_value) {
+                const u8 sprite_data = sprite_line_data[x];
+                const bool sprite_priority = sprite_data & 0x08;
+                if (!(sprite_priority && bg_enabled && bg_color != 0)) {
+                    color_id = sprite_data & 0x03;
+                    palette = (sprite_data & 0x04) ? 2 : 1;
+                }
+            }
+
+            emit(x, palette, static_cast<u8>(color_id & 0x03));
+        }
+    };
+
+    if (pixel_format == PixelFormat::rgba) {
+        if (!framebuffers) {
+            allocate_framebuffers();
+        }
+        u32* framebuffer_line = framebuffer_back_pixels + static_cast<size_t>(ly) * SCREEN_WIDTH;
+        compose([&](int x, int palette, u8 color_id) { framebuffer_line[x] = palette_cache[palette][color_id]; });
+    } else {
+        std::array<u8, SCREEN_WIDTH> shades;
+        compose([&](int x, int palette, u8 color_id) { shades[x] = static_cast<u8>((mem[0xFF47 + palette] >> (color_id * 2)) & 0x03); });
+        store_index_line(ly, shades);
+    }
+
+    return window_used_this_line;
+}
+
+// CGB variant of render_scanline: tile attributes from VRAM bank 1, color palettes,
+// and the CGB BG/OBJ priority rules
+bool Gameboy::render_scanline_cgb()
+{
+    const u8 ly = memory[0xFF44];
+    if (ly >= SCREEN_HEIGHT) {
+        return false;
+    }
+
+    const u8 lcdc = memory[0xFF40];
+    const bool bg_master_priority = lcdc & 0x01; // when clear, sprites always win over BG/window
+    const bool sprite_enabled = lcdc & 0x02;
+    const bool tall_sprites = lcdc & 0x04;
+    const bool window_enabled = lcdc & 0x20;
+
+    const u16 bg_map_base = (lcdc & 0x08) ? 0x9C00 : 0x9800;
+    const u16 window_map_base = (lcdc & 0x40) ? 0x9C00 : 0x9800;
+    const bool use_signed_tile_index = !(lcdc & 0x10);
+
+    const u8 scx = memory[0xFF43];
+    const u8 scy = memory[0xFF42];
+    const u8 wx = memory[0xFF4B];
+    const u8 wy = memory[0xFF4A];
+
+    const bool window_possible = window_enabled && ly >= wy && wx <= 166;
+    const int window_screen_x = std::max(0, static_cast<int>(wx) - 7);
+
+    const int bg_y = (static_cast<int>(scy) + ly) & 0xFF;
+    const int bg_tile_row = (bg_y >> 3) & 0x1F;
+    const int bg_tile_line = bg_y & 0x07;
+    const int scx_offset = scx & 0x07;
+
+    const int window_line = window_line_counter;
+    const int window_tile_row = (window_line >> 3) & 0x1F;
+    const int window_tile_line = window_line & 0x07;
+
+    const HighMemory& mem = memory;
+
+    // per BG pixel: bits 0-1 color, bits 2-4 palette, bit 7 BG-to-OBJ priority
+    std::array<u8, SCREEN_WIDTH> bg_pixels {};
+
+    // fetches the flip-adjusted row of the tile referenced by a map entry
+    auto fetch_row = [&](u16 map_addr, int tile_line, u8& pixel_bits) -> u64 {
+        const u8 tile_number = mem[map_addr];
+        const u8 attributes = vram_bank1[map_addr - 0x8000];
+        const size_t tile_index = use_signed_tile_index ? static_cast<size_t>(256 + static_cast<i8>(tile_number)) : tile_number;
+        const int line = (attributes & 0x40) ? 7 - tile_line : tile_line;
+        const size_t bank_offset = (attributes & 0x08) ? VRAM_TILE_ROWS : 0;
+        pixel_bits = static_cast<u8>(((attributes & 0x07) << 2) | (attributes & 0x80));
+        return tile_row_bits(tile_cache[bank_offset + tile_index * 8 + line], attributes & 0x20);
+    };
+
+    if (++sprite_line_stamp_value == 0) {
+        sprite_line_stamp.fill(0);
+        sprite_line_stamp_value = 1;
+    }
+
+    {
+        int x = 0;
+        int tile_col = scx >> 3;
+        int pixel_offset = scx_offset;
+        const int row_offset = bg_tile_row * 32;
+
+        while (x < SCREEN_WIDTH) {
+            u8 pixel_bits = 0;
+            const u64 row = fetch_row(static_cast<u16>(bg_map_base + ((tile_col & 0x1F) + row_offset)), bg_tile_line, pixel_bits);
+            for (int px = pixel_offset; px < 8 && x < SCREEN_WIDTH; ++px, ++x) {
+                bg_pixels[x] = static_cast<u8>(((row >> (px * 8)) & 0x03) | pixel_bits);
+            }
+            pixel_offset = 0;
+            ++tile_col;
+        }
+    }
+
+    bool window_used_this_line = false;
+    if (window_possible && window_screen_x < SCREEN_WIDTH) {
+        window_used_this_line = true;
+        int x = window_screen_x;
+        int tile_col = 0;
+        const int row_offset = window_tile_row * 32;
+
+        while (x < SCREEN_WIDTH) {
+            u8 pixel_bits = 0;
+            const u64 row = fetch_row(static_cast<u16>(window_map_base + (row_offset + (tile_col & 0x1F))), window_tile_line, pixel_bits);
+            for (int px = 0; px < 8 && x < SCREEN_WIDTH; ++px, ++x) {
+                bg_pixels[x] = static_cast<u8>(((row >> (px * 8)) & 0x03) | pixel_bits);
+            }
+            ++tile_col;
+        }
+    }
+
+    if (sprite_enabled && scanline_sprite_count > 0) {
+        const int sprite_height = tall_sprites ? 16 : 8;
+        for (int i = 0; i < scanline_sprite_count; ++i) {
+            const Sprite& sprite = scanline_sprites[i]; // CGB priority is OAM order only
+
+            int screen_x = static_cast<int>(sprite.x) - 8;
+            if (screen_x >= SCREEN_WIDTH || screen_x <= -8) {
+                continue;
+            }
+
+            int line = static_cast<int>(ly) - (static_cast<int>(sprite.y) - 16);
+            if (line < 0 || line >= sprite_height) {
+                continue;
+            }
+
+            if (sprite.attributes & 0x40) {
+                line = sprite_height - 1 - line;
+            }
+
+            u8 tile_index = sprite.tile;
+            if (tall_sprites) {
+                tile_index &= 0xFE;
+                if (line >= 8) {
+                    tile_index += 1;
+                    line -= 8;
+                }
+            }
+
+            const size_t bank_offset = (sprite.attributes & 0x08) ? VRAM_TILE_ROWS : 0;
+            const u64 row = tile_row_bits(tile_cache[bank_offset + static_cast<size_t>(tile_index) * 8 + line], sprite.attributes & 0x20);
+            const u8 sprite_bits = static_cast<u8>(((sprite.attributes & 0x07) << 2) | ((sprite.attributes & 0x80) ? 0x20 : 0));
+
+            const int start_px = std::max(0, -screen_x);
+            const int end_px = std::min(8, SCREEN_WIDTH - screen_x);
+            for (int px = start_px; px < end_px; ++px) {
+                const u8 color = static_cast<u8>((row >> (px * 8)) & 0x03);
+                if (color == 0) {
+                    continue;
+                }
+
+                const int target_x = screen_x + px;
+                if (sprite_line_stamp[target_x] == sprite_line_stamp_value) {
+                    continue;
+                }
+
+                sprite_line_stamp[target_x] = sprite_line_stamp_value;
+                sprite_line_data[target_x] = static_cast<u8>(color | sprite_bits);
+            }
+        }
+    }
 
-    u32* framebuffer_line = framebuffer_back_pixels + static_cast<size_t>(ly) * SCREEN_WIDTH;
-    for (int x = 0; x < SCREEN_WIDTH; ++x) {
-        const u8 bg_color = bg_colors[x];
-        u8 color_id = bg_enabled ? bg_color : 0;
-        const u32* palette_ptr = bg_palette;
+    // emit gets the palette cache row and the color number of the pixel that wins
+    auto compose = [&](auto&& emit) {
+        for (int x = 0; x < SCREEN_WIDTH; ++x) {
+            const u8 bg_pixel = bg_pixels[x];
+            const u8 bg_color = bg_pixel & 0x03;
 
-        if (sprite_enabled && sprite_line_stamp[x] == sprite_line_stamp_value) {
-            const u8 sprite_data = sprite_line_data[x];
-            const bool sprite_priority = sprite_data & 0x08;
-            if (!(sprite_priority && bg_enabled && bg_color != 0)) {
-                color_id = sprite_data & 0x03;
-                palette_ptr = (sprite_data & 0x04) ? obj_palette1 : obj_palette0;
+            if (sprite_enabled && sprite_line_stamp[x] == sprite_line_stamp_value) {
+                const u8 sprite_pixel = sprite_line_data[x];
+                const bool bg_wins = bg_master_priority && bg_color != 0 && ((bg_pixel & 0x80) || (sprite_pixel & 0x20));
+                if (!bg_wins) {
+                    emit(x, cgb_obj_palette_cache[(sprite_pixel >> 2) & 0x07], static_cast<u8>(sprite_pixel & 0x03));
+                    continue;
+                }
             }
+            emit(x, cgb_bg_palette_cache[(bg_pixel >> 2) & 0x07], bg_color);
         }
+    };
 
-        framebuffer_line[x] = palette_ptr[color_id & 0x03];
+    if (pixel_format == PixelFormat::rgba) {
+        if (!framebuffers) {
+            allocate_framebuffers();
+        }
+        u32* framebuffer_line = framebuffer_back_pixels + static_cast<size_t>(ly) * SCREEN_WIDTH;
+        compose([&](int x, const std::array<u32, 4>& palette, u8 color_id) { framebuffer_line[x] = palette[color_id]; });
+    } else {
+        std::array<u8, SCREEN_WIDTH> color_ids;
+        compose([&](int x, const std::array<u32, 4>&, u8 color_id) { color_ids[x] = color_id; });
+        store_index_line(ly, color_ids);
     }
 
     return window_used_this_line;
 }
 
+// a caller that wants observations rather than pictures skips the palette expansion entirely
+bool Gameboy::set_pixel_output(PixelFormat format, u8* buffer)
+{
+    if ((format == PixelFormat::index2 || format == PixelFormat::gray8) && !buffer) {
+        std::cerr << "Index pixel formats need an output buffer" << std::endl;
+        return false;
+    }
+    pixel_format = format;
+    pixel_output = format == PixelFormat::index2 || format == PixelFormat::gray8 ? buffer : nullptr;
+    return true;
+}
+
+// instances that never produce RGBA pictures never pay for the 270KB of them
+void Gameboy::allocate_framebuffers()
+{
+    if (framebuffers) {
+        return;
+    }
+    framebuffers = std::pmr::polymorphic_allocator<>(resource).new_object<FrameBuffers>();
+    framebuffer_front_pixels = (*framebuffers)[framebuffer_front_index].data();
+    framebuffer_back_pixels = (*framebuffers)[framebuffer_back_index].data();
+}
+
+// memory this instance holds, for sizing hosts that run thousands of them. counts capacity,
+// so buffers that grew once (save states, run-ahead) are included
+Footprint Gameboy::footprint() const
+{
+    const auto string_heap = [](const auto& text) {
+        const char* const inline_begin = reinterpret_cast<const char*>(&text);
+        const bool inline_storage = text.data() >= inline_begin && text.data() < inline_begin + sizeof(text);
+        return inline_storage ? 0 : text.capacity() + 1;
+    };
+
+    size_t instance = sizeof(Gameboy);
+    instance += framebuffers ? sizeof(FrameBuffers) : 0;
+    instance += tile_cache.capacity() * sizeof(tile_cache[0]);
+    instance += vram_bank1.capacity() + wram_banks.capacity() + ram_storage.capacity();
+    instance += page_stamps.capacity() * sizeof(page_stamps[0]);
+    instance += run_ahead_state.data.capacity() + fork_state.data.capacity();
+    instance += (apu.left.buffer.capacity() + apu.right.buffer.capacity()) * sizeof(i32);
+    instance += audio_output.ring.samples.capacity() * sizeof(i16);
+    instance += string_heap(header_title) + string_heap(window_title);
+    instance += string_heap(rom_path) + string_heap(save_path.native());
+    size_t shared = rom ? rom->capacity() : 0;
+    if (boot_image) {
+        const std::lock_guard lock(boot_image->mutex);
+        shared += sizeof(BootImage) + (boot_image->post_boot ? boot_image->post_boot->data.capacity() : 0);
+    }
+    return { instance, shared };
+}
+
+void Gameboy::store_index_line(u8 ly, const std::array<u8, SCREEN_WIDTH>& indices)
+{
+    if (pixel_format == PixelFormat::gray8) {
+        u8* line = pixel_output + static_cast<size_t>(ly) * SCREEN_WIDTH;
+        for (int x = 0; x < SCREEN_WIDTH; ++x) {
+            line[x] = static_cast<u8>(255 - indices[x] * 85);
+        }
+        return;
+    }
+
+    // four 0-3 bytes of a little endian word fold into one byte: b0 | b1 << 2 | b2 << 4 | b3 << 6
+    u8* line = pixel_output + static_cast<size_t>(ly) * (SCREEN_WIDTH / 4);
+    for (int x = 0; x < SCREEN_WIDTH; x += 4) {
+        u32 group;
+        std::memcpy(&group, indices.data() + x, sizeof(group));
+        group |= group >> 6;
+        line[x / 4] = static_cast<u8>(group | (group >> 12));
+    }
+}
+
 void Gameboy::ppu_step(u8 cycles)
 {
     if (!(memory[0xFF40] & 0x80)) {
@@ -1767,7 +2892,9 @@ void Gameboy::ppu_step(u8 cycles)
             if (ppu_cycle < 80) {
                 if (ppu_mode != 2) {
                     set_ppu_mode(2);
-                    evaluate_sprites(ly);
+                    if (!picture_hidden()) {
+                        evaluate_sprites(ly);
+                    }
                     scanline_rendered = false;
                 }
                 target_cycle = 80;
@@ -1776,7 +2903,16 @@ void Gameboy::ppu_step(u8 cycles)
                     set_ppu_mode(3);
                 }
                 if (!scanline_rendered) {
-                    bool window_used = render_scanline();
+                    const bool timed = metrics.time_rendering.load(std::memory_order_relaxed) && !picture_hidden();
+                    const auto render_start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point {};
+                    // pictures run-ahead throws away only need the window line count kept right
+                    bool window_used = picture_hidden() ? scanline_uses_window()
+                        : cgb_mode                     ? render_scanline_cgb()
+                                                       : render_scanline();
+                    if (timed) {
+                        metrics.render_nanoseconds.add(static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - render_start).count()));
+                        metrics.rendered_lines.add(1);
+                    }
                     if (window_used) {
                         window_line_counter++;
                     }
@@ -1786,6 +2922,9 @@ void Gameboy::ppu_step(u8 cycles)
             } else {
                 if (ppu_mode != 0) {
                     set_ppu_mode(0);
+                    if (hdma_active) {
+                        run_hdma_block();
+                    }
                 }
                 target_cycle = 456;
             }
@@ -1820,16 +2959,32 @@ void Gameboy::ppu_step(u8 cycles)
             if (new_ly == 144) {
                 set_ppu_mode(1);
                 request_interrupt(0);
-                std::swap(framebuffer_front_pixels, framebuffer_back_pixels);
+                if (hidden_pictures) {
+                    hidden_pictures--;
+                } else {
+                    if (frame_capture && framebuffers) {
+                        frame_capture->submit(framebuffer_back_pixels);
+                    }
+                    // publish the finished frame, the PPU continues in whichever buffer was ready before
+                    framebuffer_back_index = framebuffer_ready.exchange(framebuffer_back_index | FRAMEBUFFER_FRESH, std::memory_order_acq_rel) & 0x03;
+                    if (framebuffers) {
+                        framebuffer_back_pixels = (*framebuffers)[framebuffer_back_index].data();
+                    }
+                    frames_published.fetch_add(1, std::memory_order_release); // after the exchange, see FrameTiming::frame_presented
+                }
             } else if (new_ly > 153) {
                 memory[0xFF44] = 0;
                 window_line_counter = 0;
                 scanline_rendered = false;
-                evaluate_sprites(0);
+                if (!picture_hidden()) {
+                    evaluate_sprites(0);
+                }
                 set_ppu_mode(2);
             } else if (new_ly < 144) {
                 scanline_rendered = false;
-                evaluate_sprites(new_ly);
+                if (!picture_hidden()) {
+                    evaluate_sprites(new_ly);
+                }
                 set_ppu_mode(2);
             }
 
@@ -1841,21 +2996,196 @@ void Gameboy::ppu_step(u8 cycles)
 void Gameboy::run_one_frame()
 {
     update_inputs();
+    run_until(cycle_count + (CYCLES_PER_FRAME - frame_cycle));
+}
+
+// runs whole instructions until cycle_count reaches target_cycle, finishing frames on the way.
+// frame length is counted in normal speed cycles, in double speed mode the CPU gets twice as many
+void Gameboy::run_instructions(u64 target_cycle)
+{
+    // per instruction counts stay in registers and reach metrics once per call
+    const u64 start_cycle = cycle_count;
+    u64 steps = 0;
+    u64 halted_steps = 0;
+
+    while (cycle_count < target_cycle) {
+        if (cycle_count >= serial_next_event) {
+            serial_event();
+        }
 
-    u32 cycles_this_frame = 0;
-    while (cycles_this_frame < CYCLES_PER_FRAME) {
+        steps++;
+        halted_steps += halted;
         u8 cycles = run_opcode();
         cycles += check_interrupts();
+        if (dma_stall_cycles) {
+            const u32 stall = std::min<u32>(dma_stall_cycles, 255 - cycles);
+            cycles = static_cast<u8>(cycles + stall);
+            dma_stall_cycles -= stall;
+        }
         update_timers(cycles);
-        ppu_step(cycles);
-        cycles_this_frame += cycles;
+        const u8 ppu_cycles = double_speed ? cycles >> 1 : cycles;
+        ppu_step(ppu_cycles);
+        cycle_count += ppu_cycles;
+        frame_cycle += ppu_cycles;
+
+        if (frame_cycle >= CYCLES_PER_FRAME) {
+            frame_cycle -= CYCLES_PER_FRAME;
+            finish_frame();
+        }
+    }
+
+    // a halted step is 4 CPU cycles
+    metrics.instructions.add(steps - halted_steps);
+    metrics.halted_cycles.add(double_speed ? halted_steps * 2 : halted_steps * 4);
+    metrics.cycles.add(cycle_count - start_cycle);
+}
+
+void Gameboy::run_until(u64 target_cycle)
+{
+    if (boot_rom_mapped) {
+        run_boot_rom_until(target_cycle);
+    }
+    run_instructions(target_cycle);
+}
+
+// runs the boot ROM to the point it hands over to the cartridge, for callers that want the
+// post-boot machine right away. false if it never does, a DMG boot ROM locks up on a bad logo
+bool Gameboy::run_boot_rom()
+{
+    if (!boot_rom_mapped) {
+        return true;
+    }
+    run_boot_rom_until(cycle_count + BOOT_ROM_CYCLE_LIMIT);
+    if (boot_rom_mapped) {
+        std::cerr << "Boot ROM did not hand over to the cartridge" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// the first instance to boot the cartridge keeps the machine the boot ROM handed over, the ones
+// after it start from there (see reset)
+void Gameboy::run_boot_rom_until(u64 target_cycle)
+{
+    // an instruction at a time, to stop at the one the boot ROM hands over with
+    while (boot_rom_mapped && cycle_count < target_cycle) {
+        run_instructions(cycle_count + 1);
+    }
+    if (boot_rom_mapped) {
+        return;
+    }
+
+    const std::lock_guard lock(boot_image->mutex);
+    if (boot_image->post_boot) {
+        return;
+    }
+    auto post_boot = std::make_shared<SaveState>();
+    write_state(*post_boot, StateScope::boot);
+    boot_image->post_boot = std::move(post_boot);
+}
+
+void Gameboy::finish_frame()
+{
+    apu.end_frame(cycle_count);
+    metrics.frames.add(1);
+
+    if (cartridge_has_rtc) {
+        rtc_sync();
+    }
+
+    if (save_flush_timer > 0 && --save_flush_timer == 0) {
+        flush_save_mapping(false);
+    }
+}
+
+void Gameboy::set_serial_link(SerialLink* link)
+{
+    serial_link = link;
+    serial_poll_cycle = (link && link->needs_poll()) ? cycle_count : SERIAL_NEVER;
+    schedule_serial_event();
+}
+
+void Gameboy::write_serial_control(u8 value)
+{
+    memory[0xFF02] = value;
+
+    // bit 7 starts a transfer, bit 0 selects the internal clock, external transfers wait for the peer
+    if ((value & 0x81) == 0x81) {
+        const u32 duration = (cgb_mode && (value & 0x02)) ? SERIAL_FAST_TRANSFER_CYCLES : SERIAL_TRANSFER_CYCLES;
+        serial_transfer_deadline = cycle_count + (double_speed ? duration / 2 : duration);
+    } else {
+        serial_transfer_deadline = SERIAL_NEVER;
+    }
+    schedule_serial_event();
+}
+
+void Gameboy::serial_event()
+{
+    if (cycle_count >= serial_transfer_deadline) {
+        serial_complete();
+    }
+    if (cycle_count >= serial_poll_cycle) {
+        serial_link->poll(*this);
+        serial_poll_cycle = cycle_count + SERIAL_POLL_INTERVAL;
+    }
+    schedule_serial_event();
+}
+
+void Gameboy::schedule_serial_event()
+{
+    serial_next_event = std::min(serial_transfer_deadline, serial_poll_cycle);
+}
+
+// the internally clocked transfer finished, all 8 bits have been exchanged with the peer
+void Gameboy::serial_complete()
+{
+    const u8 outgoing = memory[0xFF01];
+    memory[0xFF01] = serial_link ? serial_link->transfer(*this, outgoing) : 0xFF;
+    memory[0xFF02] &= 0x7F;
+    serial_transfer_deadline = SERIAL_NEVER;
+    schedule_serial_event();
+    request_interrupt(3);
+}
+
+// the peer clocked a transfer, only completes if this side is waiting on the external clock
+u8 Gameboy::serial_receive(u8 incoming)
+{
+    if ((memory[0xFF02] & 0x81) != 0x80) {
+        return 0xFF;
     }
+
+    const u8 outgoing = memory[0xFF01];
+    memory[0xFF01] = incoming;
+    memory[0xFF02] &= 0x7F;
+    request_interrupt(3);
+    return outgoing;
+}
+
+// shortest time between starting and completing a transfer in the current mode
+u32 Gameboy::serial_min_transfer_cycles() const
+{
+    const u32 duration = cgb_mode ? SERIAL_FAST_TRANSFER_CYCLES : SERIAL_TRANSFER_CYCLES;
+    return double_speed ? duration / 2 : duration;
+}
+
+// takes the latest completed frame as the front buffer, false if none was published since the last call
+bool Gameboy::acquire_frame()
+{
+    if (!framebuffers || !(framebuffer_ready.load(std::memory_order_relaxed) & FRAMEBUFFER_FRESH)) {
+        return false;
+    }
+    framebuffer_front_index = framebuffer_ready.exchange(framebuffer_front_index, std::memory_order_acq_rel) & 0x03;
+    framebuffer_front_pixels = (*framebuffers)[framebuffer_front_index].data();
+    return true;
 }
 
 void Gameboy::render_screen()
 {
+#ifndef HEADLESS
     Texture2D* tex = static_cast<Texture2D*>(texture);
-    UpdateTexture(*tex, framebuffer_front_pixels);
+    if (acquire_frame()) {
+        UpdateTexture(*tex, framebuffer_front_pixels);
+    }
 
     BeginDrawing();
     ClearBackground(BLACK);
@@ -1869,10 +3199,24 @@ void Gameboy::render_screen()
         WHITE);
 
     EndDrawing();
+#endif
 }
 
 Gameboy::~Gameboy()
 {
-    save_save_ram();
+    if (save_mapping) {
+        flush_save_mapping(true);
+        unmap_save_ram();
+    } else {
+        if (cartridge_has_rtc) {
+            ram_dirty = true; // always persist the clock
+        }
+        save_save_ram();
+        SaveWriter::instance().drain(save_slot);
+    }
+    audio_output.close();
     cleanup_graphics();
+    if (framebuffers) {
+        std::pmr::polymorphic_allocator<>(resource).delete_object(framebuffers);
+    }
 }
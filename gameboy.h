@@ -1,22 +1,31 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <bit>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <span>
 #include <string>
 #include <vector>
 
-#include "raylib.h"
+#include "apu.h"
+#include "audio.h"
+#include "metrics.h"
+#include "save_state.h"
+#include "save_writer.h"
+#include "serial.h"
+#include "types.h"
 
-using u8 = uint8_t;
-using i8 = int8_t;
-using u16 = uint16_t;
-using i16 = int16_t;
-using u32 = uint32_t;
-using u64 = uint64_t;
+#ifndef HEADLESS
+#include "raylib.h"
+#endif
 
 constexpr u8 FLAG_Z = 1 << 7; // zero flag
 constexpr u8 FLAG_N = 1 << 6; // subtract flag
@@ -30,11 +39,31 @@ constexpr int CLOCKSPEED = 4194304; // 4.194304 MHz
 constexpr int SCREEN_WIDTH = 160;
 constexpr int SCREEN_HEIGHT = 144;
 constexpr int SCREEN_SCALE = 5;
+constexpr u8 FRAMEBUFFER_FRESH = 0x80; // set in framebuffer_ready until the frame is picked up for presentation
 constexpr u32 CYCLES_PER_FRAME = 70224;
 constexpr size_t VRAM_TILE_COUNT = 384;
 constexpr size_t VRAM_TILE_ROWS = VRAM_TILE_COUNT * 8;
+constexpr size_t VRAM_BANK_COUNT = 2; // DMG uses bank 0 only, CGB adds bank 1
+constexpr size_t RTC_FOOTER_SIZE = 48; // RTC registers + timestamp appended to MBC3 saves (VBA-M/BGB layout)
+constexpr int SAVE_FLUSH_INTERVAL = 60; // frames between RAM disable and background flush of a mapped save file
+constexpr size_t STATE_PAGE_SIZE = 0x1000; // granularity of the write tracking fork_from copies by
+constexpr size_t MEMORY_PAGES = 7; // 0x8000-0xEFFF, IO and OAM above are part of every fork
+constexpr size_t VRAM1_FIRST_PAGE = MEMORY_PAGES; // then vram_bank1, wram_banks and ram_banks
+constexpr size_t WRAM_FIRST_PAGE = VRAM1_FIRST_PAGE + 2;
+constexpr size_t CART_RAM_FIRST_PAGE = WRAM_FIRST_PAGE + 6;
+constexpr size_t INDEX2_FRAME_BYTES = SCREEN_WIDTH * SCREEN_HEIGHT / 4;
+constexpr size_t GRAY8_FRAME_BYTES = SCREEN_WIDTH * SCREEN_HEIGHT;
 
+#ifdef HEADLESS
+struct PPU_Color {
+    u8 r;
+    u8 g;
+    u8 b;
+    u8 a;
+};
+#else
 using PPU_Color = Color;
+#endif
 
 constexpr u32 pack_color(u8 r, u8 g, u8 b, u8 a)
 {
@@ -51,6 +80,56 @@ constexpr std::array<u32, 4> DMG_PALETTE = {
     pack_color(0x08, 0x18, 0x20, 0xFF), // Black
 };
 
+struct FrameCapture;
+struct TraceRecorder;
+
+// what the PPU writes per pixel. the index formats hold the shade BGP/OBP0/OBP1 select on a DMG
+// (0 white to 3 black) and the color number within the palette on a CGB
+enum class PixelFormat : u8 {
+    rgba, // packed RGBA into framebuffers
+    index2, // 2-bit indices packed 4 per byte into pixel_output, leftmost pixel in the low bits
+    gray8, // one byte per pixel into pixel_output, 255 - 85 * index
+    none, // no picture at all, for callers that only look at RAM
+};
+
+using FrameBuffers = std::array<std::array<u32, SCREEN_WIDTH * SCREEN_HEIGHT>, 3>;
+
+// 0x8000-0xFFFF indexed by address, everything below is cartridge ROM read through the bank pointers
+struct HighMemory {
+    std::array<u8, 0x8000> bytes {};
+
+    u8& operator[](size_t addr) { return bytes[addr - 0x8000]; }
+    const u8& operator[](size_t addr) const { return bytes[addr - 0x8000]; }
+    u8* at(size_t addr) { return bytes.data() + (addr - 0x8000); }
+    const u8* at(size_t addr) const { return bytes.data() + (addr - 0x8000); }
+    void fill(u8 value) { bytes.fill(value); }
+};
+
+// what an instance costs, see Gameboy::footprint
+struct Footprint {
+    size_t instance; // the object plus the heap buffers only it uses
+    size_t shared; // ROM and boot image, shared with every other instance of the same files in the process
+};
+
+constexpr size_t BOOT_ROM_SIZE = 0x100; // DMG boot ROM, mapped at 0x0000-0x00FF until 0xFF50 is written
+constexpr u64 BOOT_ROM_CYCLE_LIMIT = CYCLES_PER_FRAME * 600; // a boot ROM still running after 10 seconds is stuck (bad logo)
+
+// a DMG boot ROM laid over bank 0 of one cartridge, shared by every instance that boots the cartridge
+// with it, together with the machine the boot ROM hands over to the cartridge
+struct BootImage {
+    std::shared_ptr<const std::vector<u8>> rom; // cartridge the overlay was made from
+    std::array<u8, 0x4000> bank0; // boot ROM, then the rest of cartridge bank 0
+    std::mutex mutex; // guards post_boot
+    std::shared_ptr<const SaveState> post_boot; // taken by the first instance to finish booting (nullptr until then)
+};
+
+// what write_state and read_state cover
+enum class StateScope : u8 {
+    full, // save_state and load_state
+    fork, // all but the page tracked memory, fork_from copies what changed of it itself
+    boot, // all but what the cartridge keeps, battery RAM and the clock, for the post-boot snapshot
+};
+
 struct Sprite {
     u8 x;
     u8 y;
@@ -65,9 +144,11 @@ struct Gameboy {
     /* ---  members  --- */
     /* ----------------- */
 
-    /* opcode tables */
-    u8 (*opcodes[256])(Gameboy&); // opcode table
-    u8 (*cb_opcodes[256])(Gameboy&); // CB-prefixed opcode table
+    /* opcode tables, shared by all instances */
+    static inline u8 (*opcodes[256])(Gameboy&); // opcode table
+    static inline u8 (*cb_opcodes[256])(Gameboy&); // CB-prefixed opcode table
+
+    std::pmr::memory_resource* resource; // every buffer of the instance comes from here, see InstanceArena
 
     /* CPU registers */
     union {
@@ -110,8 +191,9 @@ struct Gameboy {
     int scanline_counter; // counts CPU cycles for PPU scanlines
     int ppu_cycle; // current cycle within scanline
     int scanline_sprite_count; // number of sprites on current scanline
-    int target_fps; // target frames per second
-    u8 joypad_state; // current button states
+    std::atomic<int> target_fps; // target emulated frames per second, changed from the presentation thread
+    u8 joypad_state; // button states as of the last update_inputs, for the joypad interrupt
+    std::atomic<u8> input_buttons; // button states sampled by the presentation thread (or set by an embedder), JOYP reads them directly
     u8 ppu_mode; // current PPU mode (0-3)
     u8 window_line_counter; // how many window lines have been drawn this frame
     bool scanline_rendered; // whether the current scanline has been rendered
@@ -123,37 +205,109 @@ struct Gameboy {
     bool ime_scheduled; // whether to enable IME after next instruction
     bool halted; // whether the CPU is halted
     bool halt_bug; // whether the CPU is in halt bug state
+    bool boot_rom_mapped; // whether the boot ROM covers 0x0000-0x00FF (rom_bank0_ptr then points into boot_image)
     u16 current_rom_bank; // currently loaded ROM bank number
     u16 rom_bank_count; // total number of 16KB ROM banks
+    const u8* rom_bank0_ptr; // cached pointer to the ROM bank mapped at 0x0000-0x3FFF
     const u8* current_rom_bank_ptr; // cached pointer to currently selected ROM bank
     u8 current_ram_bank; // currently loaded RAM bank number
+    u8* current_ram_bank_ptr; // cached pointer to the RAM bank at 0xA000 (nullptr if disabled or RTC selected)
+    size_t ram_bank_mask; // offset mask within a RAM bank (banks smaller than 8KB are mirrored)
+    u8 bank_register_low; // MBC1 BANK1 / MBC5 ROM bank bits 0-7
+    u8 bank_register_high; // MBC1 BANK2 / MBC5 ROM bank bit 8
     bool ram_enabled; // whether external RAM is enabled
     bool rom_banking; // whether in ROM banking mode
+    bool mbc1_multicart; // MBC1M wiring, BANK2 sits above a 4-bit BANK1
+    bool cartridge_has_rumble; // whether the MBC5 RAM bank register drives a rumble motor
+    bool rumble_active; // current state of the rumble motor
     std::array<u8, 5> rtc_registers; // RTC registers (MBC3)
     std::array<u8, 5> rtc_latched_registers; // Latched RTC snapshot
     u8 rtc_selected_register; // currently selected RTC register (0xFF = none)
     u8 rtc_latch_previous_value; // previous value written to latch register
     bool rtc_latch_active; // whether RTC data is latched
+    u64 rtc_last_sync_cycle; // cycle_count at which rtc_registers were last brought up to date
+    u32 rtc_subsecond_cycles; // cycles accumulated towards the next RTC second
+    u64 cycle_count; // total cycles since power on, at normal speed
+    u32 frame_cycle; // cycles into the current frame, at normal speed
     u8 io_register_masks[256]; // which bits are always read as 1 in I/O registers
-    std::array<u8, 0x10000> memory {}; // 64KB addressable memory
-    std::vector<u8> cartridge; // full cartridge content
-    std::vector<u8> ram_banks; // external RAM banks (if any)
-    std::array<std::array<u32, SCREEN_WIDTH * SCREEN_HEIGHT>, 2> framebuffers {}; // double-buffered pixel storage
-    u32* framebuffer_front_pixels;
-    u32* framebuffer_back_pixels;
-    std::array<std::array<u8, 8>, VRAM_TILE_ROWS> tile_cache {}; // decoded 2bpp rows for VRAM tiles
+    HighMemory memory; // 0x8000-0xFFFF of the address space
+    std::shared_ptr<const std::vector<u8>> rom; // cartridge content, padded to whole banks
+    std::span<const u8> cartridge; // view of rom
+    std::shared_ptr<BootImage> boot_image; // boot ROM run at power on (nullptr = start with the registers it leaves behind)
+    std::pmr::vector<u8> ram_storage; // heap-backed external RAM (used when no save file is mapped)
+    std::span<u8> ram_banks; // external RAM banks (if any), either ram_storage or the mapped save file
+    FrameBuffers* framebuffers; // triple-buffered pixel storage, allocated by the first RGBA line
+    u32* framebuffer_front_pixels; // being presented, owned by the presentation thread (nullptr until allocated)
+    u32* framebuffer_back_pixels; // being rendered by the PPU, owned by the emulation thread
+    u8 framebuffer_front_index;
+    u8 framebuffer_back_index;
+    std::atomic<u8> framebuffer_ready; // index of the latest completed frame, plus FRAMEBUFFER_FRESH
+    std::atomic<u32> frames_published; // completed frames, for the FPS display and frame timing
+    FrameCapture* frame_capture; // receives every published frame (nullptr = not capturing)
+    TraceRecorder* trace; // receives every executed instruction and interrupt dispatch (nullptr = not tracing)
+    PixelFormat pixel_format; // index formats leave framebuffers untouched, published frames then go stale
+    u8* pixel_output; // caller's INDEX2_FRAME_BYTES or GRAY8_FRAME_BYTES buffer for the index formats
+    u32 hidden_pictures; // upcoming VBlanks whose picture is neither drawn nor published (run-ahead)
+    bool speculating; // running run-ahead frames that are rolled back, their cart RAM must not reach the save file
+    SaveState run_ahead_state; // snapshot the run-ahead frames are rolled back to
+    u64 instance_id; // unique per process, identifies the instance a fork was taken from
+    mutable std::atomic<u64> write_clock; // stamps page writes, advanced whenever this instance takes part in a fork, on any thread
+    std::pmr::vector<u64> page_stamps; // write_clock of the last write to every tracked page
+    u64 fork_parent_id; // instance this one was last forked from (0 = none)
+    u64 fork_parent_clock; // parent's write_clock when that happened
+    u64 fork_clock; // own write_clock when that happened
+    SaveState fork_state; // everything but the pages, reused by every fork_from
+    std::chrono::steady_clock::time_point next_frame_time; // frame timer deadline when not synced to audio
+    std::pmr::vector<std::array<u8, 8>> tile_cache; // decoded 2bpp rows for VRAM tiles, VRAM_TILE_ROWS per bank
     std::array<u16, SCREEN_WIDTH> sprite_line_stamp {};
     std::array<u8, SCREEN_WIDTH> sprite_line_data {};
     u16 sprite_line_stamp_value;
-    std::string header_title; // game title from ROM header
+    std::pmr::string header_title; // game title from ROM header
     std::string window_title; // window title string
-    std::filesystem::path rom_path; // path to loaded ROM
-    std::filesystem::path save_path; // path to battery-backed save file
+    std::pmr::string rom_path; // path to loaded ROM
+    std::filesystem::path save_path; // path to battery-backed save file (empty without use_save_file)
     size_t ram_bank_size; // size in bytes of one external RAM bank
     size_t ram_bank_count; // number of external RAM banks
     bool cartridge_has_ram; // whether cartridge exposes external RAM
     bool cartridge_has_battery; // whether cartridge RAM is battery-backed
+    bool cartridge_has_rtc; // whether cartridge has an MBC3 real-time clock
+    bool save_file_enabled; // false keeps battery RAM in memory only, e.g. for many instances of one ROM
     bool ram_dirty; // whether RAM content has been modified since last save
+    u8* save_mapping; // MAP_SHARED view of the save file (nullptr if not mapped)
+    size_t save_mapping_size; // size in bytes of save_mapping
+    int save_flush_timer; // frames left until the mapped save file is flushed (0 = idle)
+    SaveSlot save_slot; // mailbox for the background save writer
+
+    /* CGB state */
+    bool cgb_mode; // whether the cartridge runs in Game Boy Color mode
+    bool double_speed; // whether the CPU runs at twice the normal clock (KEY1)
+    u8 vram_bank; // VRAM bank selected through VBK
+    u8 wram_bank; // WRAM bank mapped at 0xD000-0xDFFF (1-7)
+    u8* vram_ptr; // CPU view of 0x8000-0x9FFF for the selected VRAM bank
+    u8* wram_bank_ptr; // CPU view of 0xD000-0xDFFF for the selected WRAM bank
+    std::pmr::vector<u8> vram_bank1; // VRAM bank 1 (bank 0 lives in memory), empty on a DMG
+    std::pmr::vector<u8> wram_banks; // WRAM banks 2-7 (bank 1 lives in memory), empty on a DMG
+    std::array<u8, 64> bg_palette_ram {}; // 8 palettes x 4 colors in RGB555
+    std::array<u8, 64> obj_palette_ram {};
+    std::array<std::array<u32, 4>, 8> cgb_bg_palette_cache; // palette RAM decoded to packed RGBA
+    std::array<std::array<u32, 4>, 8> cgb_obj_palette_cache;
+    u16 hdma_source; // next source address of the running VRAM DMA
+    u16 hdma_destination; // next VRAM offset of the running VRAM DMA
+    u8 hdma_blocks_left; // 16 byte blocks left for the HBlank DMA
+    bool hdma_active; // whether an HBlank DMA is in progress
+    u32 dma_stall_cycles; // CPU cycles the VRAM DMA still owes
+
+    mutable Apu apu; // sound registers 0xFF10-0xFF3F, catches up lazily when they are accessed
+    AudioOutput audio_output; // ring between the APU and the audio device or WAV writer
+    bool audio_sync; // frames are paced by the audio device instead of the frame timer
+
+    /* serial port */
+    SerialLink* serial_link; // other end of the link cable (nullptr = unplugged, reads 0xFF)
+    u64 serial_transfer_deadline; // cycle at which the running internally clocked transfer completes
+    u64 serial_poll_cycle; // cycle of the next poll of a remote link
+    u64 serial_next_event; // earliest of the two above, checked before every instruction
+
+    InstanceMetrics metrics; // counters for a MetricsExporter, kept across reset and load_state
 
     void* texture; // raylib texture for rendering
 
@@ -161,7 +315,7 @@ struct Gameboy {
     /* ---  methods  --- */
     /* ----------------- */
 
-    Gameboy(const std::string& path_rom);
+    Gameboy(const std::string& path_rom, bool use_save_file = true, std::pmr::memory_resource* memory_resource = std::pmr::get_default_resource());
     ~Gameboy();
 
     u8 read8(u16 addr) const;
@@ -171,24 +325,57 @@ struct Gameboy {
 
     u8 run_opcode();
     void run_one_frame();
+    void run_until(u64 target_cycle);
+    void run_one_frame_ahead(u32 frames);
+    void save_state(SaveState& state) const;
+    bool load_state(const SaveState& state);
+    void reset();
+    bool use_boot_rom(const std::string& path);
+    bool run_boot_rom();
+    bool reset_to_state(const SaveState& state);
+    std::unique_ptr<Gameboy> fork() const;
+    bool fork_from(const Gameboy& parent);
     void render_screen();
+    void poll_keyboard();
     void update_inputs();
+    bool acquire_frame();
+    void wait_for_next_frame();
     void request_interrupt(u8 bit);
     void update_timers(u8 cycles);
     void ppu_step(u8 cycles);
     u8 check_interrupts();
     void init_graphics();
     void cleanup_graphics();
+    void init_audio();
+    void queue_audio();
+    void apply_frame_pacing();
     void handle_banking(u16 addr, u8 value);
     void set_rom_bank(u16 bank);
+    void set_rom_bank0(u16 bank);
     void set_ram_bank(u8 bank);
+    void update_mbc1_banks();
+    void update_ram_mapping();
+    void rtc_sync();
+    void rtc_advance(u64 seconds);
+    void rtc_tick();
+    void rtc_write(u8 reg, u8 value);
     void refresh_palette_cache(u8 index, u8 value);
     PPU_Color get_color(u16 palette_register, u8 color_id);
     void set_ppu_mode(u8 mode);
     void update_stat_coincidence_flag();
     void evaluate_sprites(u8 ly);
+    bool scanline_uses_window() const;
+    size_t drawn_lines() const;
     void update_window_title(size_t measured_fps);
     bool render_scanline();
+    bool render_scanline_cgb();
+    bool set_pixel_output(PixelFormat format, u8* buffer);
+    void allocate_framebuffers();
+    Footprint footprint() const;
+    void set_serial_link(SerialLink* link);
+    void serial_complete();
+    u8 serial_receive(u8 incoming);
+    u32 serial_min_transfer_cycles() const;
 
 private:
     void initialize_memory();
@@ -198,53 +385,78 @@ private:
     void initialize_cpu_state();
     void initialize_io_registers();
     void initialize_runtime_state();
-    void initialize_opcode_tables();
-    void update_tile_cache(u16 addr);
+    static void initialize_opcode_tables();
+    void update_tile_cache(u8 bank, u16 addr);
+    void write_cgb_register(u16 addr, u8 value);
+    void set_vram_bank(u8 bank);
+    void set_wram_bank(u8 bank);
+    void write_palette_data(bool obj, u8 value);
+    void run_hdma_block();
+    void finish_frame();
+    void run_instructions(u64 target_cycle);
+    void run_boot_rom_until(u64 target_cycle);
+    void store_index_line(u8 ly, const std::array<u8, SCREEN_WIDTH>& indices);
+    bool picture_hidden() const { return hidden_pictures || pixel_format == PixelFormat::none; }
+    template <typename Self, typename Visitor>
+    static void visit_state(Self& gb, Visitor& visit);
+    void write_state(SaveState& state, StateScope scope) const;
+    bool read_state(const SaveState& state, StateScope scope);
+    void mark_page(size_t page) { page_stamps[page] = write_clock.load(std::memory_order_relaxed); }
+    void write_serial_control(u8 value);
+    void serial_event();
+    void schedule_serial_event();
+    bool has_save_file() const;
+    size_t save_file_size() const;
+    bool read_save_file(std::vector<u8>& contents) const;
+    bool apply_save_contents(const std::vector<u8>& contents);
+    void load_rtc_footer(const u8* footer, size_t size);
+    void store_rtc_footer(u8* footer);
     void load_save_ram();
+    bool map_save_ram();
+    void unmap_save_ram();
+    void flush_save_mapping(bool wait);
     void save_save_ram();
 };
 
 inline u8 Gameboy::read8(u16 addr) const
 {
-    const u8* const mem = memory.data();
+    const HighMemory& mem = memory;
 
     if (addr < 0x4000) {
-        return mem[addr];
+        return rom_bank0_ptr[addr];
     }
     if (addr < 0x8000) {
         return current_rom_bank_ptr[addr - 0x4000];
     }
+    if (addr < 0xA000) {
+        return vram_ptr[addr - 0x8000];
+    }
     if (addr >= 0xA000 && addr < 0xC000) {
-        if (mbc_type == 3) {
-            if (!ram_enabled) {
-                return 0xFF;
-            }
-            if (rtc_selected_register <= 0x04) {
-                return rtc_latch_active ? rtc_latched_registers[rtc_selected_register]
-                                        : rtc_registers[rtc_selected_register];
-            }
+        if (current_ram_bank_ptr) {
+            return current_ram_bank_ptr[(addr - 0xA000) & ram_bank_mask];
         }
-        if (ram_banks.empty() || ram_bank_size == 0 || ram_bank_count == 0) {
-            return 0xFF;
+        if (rtc_selected_register <= 0x04 && ram_enabled) {
+            return rtc_latch_active ? rtc_latched_registers[rtc_selected_register]
+                                    : rtc_registers[rtc_selected_register];
         }
-        const size_t offset = addr - 0xA000;
-        const size_t bank_offset = ram_bank_size ? (offset % ram_bank_size) : 0;
-        const size_t bank_index = ram_bank_count ? (current_ram_bank % ram_bank_count) : 0;
-        const size_t absolute_index = bank_index * ram_bank_size + bank_offset;
-        if (absolute_index >= ram_banks.size()) {
-            return 0xFF;
-        }
-        return ram_banks[absolute_index];
+        return 0xFF;
+    }
+    if (addr >= 0xD000 && addr < 0xE000) {
+        return wram_bank_ptr[addr - 0xD000];
     }
     if (addr >= 0xFF00) {
+        if (addr >= 0xFF10 && addr < 0xFF40) {
+            return static_cast<u8>(apu.read(addr, cycle_count) | io_register_masks[addr - 0xFF00]);
+        }
         if (addr == 0xFF00) {
             u8 select = mem[0xFF00] & 0x30;
             u8 result = static_cast<u8>(0xC0 | select | 0x0F);
+            const u8 buttons = input_buttons.load(std::memory_order_relaxed); // sampled when the game polls, not at frame start
             if (!(select & 0x10)) {
-                result = static_cast<u8>((result & 0xF0) | (joypad_state & 0x0F));
+                result = static_cast<u8>((result & 0xF0) | (buttons & 0x0F));
             }
             if (!(select & 0x20)) {
-                result = static_cast<u8>((result & 0xF0) | ((joypad_state >> 4) & 0x0F));
+                result = static_cast<u8>((result & 0xF0) | ((buttons >> 4) & 0x0F));
             }
             return result;
         }
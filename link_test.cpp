@@ -0,0 +1,114 @@
+#include <array>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "gameboy.h"
+#include "serial.h"
+
+// two instances exchanging bytes over the link cable, run once by LinkCable on this thread and once
+// by LinkScheduler with the second instance on a worker thread. the threaded run has to end in
+// exactly the same machines, and under ThreadSanitizer (make test-link) it must not report a race
+
+constexpr size_t TEST_FRAMES = 120;
+
+// a counter in C goes out through SB every transfer, what comes back lands in 0xFF80 and the
+// transfer count in 0xFF81. the master clocks the transfers, the slave adds 0x80 and waits for them
+static std::vector<u8> link_rom(bool master)
+{
+    std::vector<u8> rom(0x8000, 0x00);
+    rom[0x101] = 0xC3; // jp 0x0150
+    rom[0x102] = 0x50;
+    rom[0x103] = 0x01;
+
+    std::vector<u8> code = { 0x0E, 0x00 }; // ld c,0
+    const size_t loop = code.size();
+    code.push_back(0x79); // ld a,c
+    if (!master) {
+        code.insert(code.end(), { 0xC6, 0x80 }); // add a,0x80
+    }
+    code.insert(code.end(), {
+                                0xE0, 0x01, // ldh (SB),a
+                                0x3E, static_cast<u8>(master ? 0x81 : 0x80), // ld a,SC
+                                0xE0, 0x02, // ldh (SC),a
+                                0xF0, 0x02, // wait: ldh a,(SC)
+                                0xCB, 0x7F, // bit 7,a
+                                0x20, 0xFA, // jr nz,wait
+                                0xF0, 0x01, // ldh a,(SB)
+                                0xE0, 0x80, // ldh (0x80),a
+                                0x0C, // inc c
+                                0x79, // ld a,c
+                                0xE0, 0x81, // ldh (0x81),a
+                            });
+    code.push_back(0x18); // jr loop
+    code.push_back(static_cast<u8>(static_cast<int>(loop) - static_cast<int>(code.size() + 1)));
+    std::copy(code.begin(), code.end(), rom.begin() + 0x150);
+    return rom;
+}
+
+static std::filesystem::path write_rom(const std::string& name, const std::vector<u8>& rom)
+{
+    const std::filesystem::path path = std::filesystem::temp_directory_path() / name;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(rom.data()), static_cast<std::streamsize>(rom.size()));
+    return path;
+}
+
+struct LinkResult {
+    std::array<u64, 2> cycles;
+    std::array<u16, 2> pc;
+    std::array<u8, 2> received;
+    std::array<u8, 2> transfers;
+};
+
+static LinkResult run_link(const std::filesystem::path& master_path, const std::filesystem::path& slave_path, bool threaded)
+{
+    Gameboy master(master_path.string(), false);
+    Gameboy slave(slave_path.string(), false);
+    LinkCable cable(master, slave);
+    if (threaded) {
+        LinkScheduler scheduler(cable, true);
+        scheduler.run_frames(TEST_FRAMES);
+    } else {
+        cable.run_frames(TEST_FRAMES);
+    }
+    return { { master.cycle_count, slave.cycle_count }, { master.PC, slave.PC },
+        { master.memory[0xFF80], slave.memory[0xFF80] }, { master.memory[0xFF81], slave.memory[0xFF81] } };
+}
+
+int main()
+{
+    const std::filesystem::path master_path = write_rom("gameboy_link_master.gb", link_rom(true));
+    const std::filesystem::path slave_path = write_rom("gameboy_link_slave.gb", link_rom(false));
+
+    const LinkResult single = run_link(master_path, slave_path, false);
+    const LinkResult threaded = run_link(master_path, slave_path, true);
+    std::filesystem::remove(master_path);
+    std::filesystem::remove(slave_path);
+
+    bool passed = true;
+    for (size_t side = 0; side < 2; ++side) {
+        const char* name = side == 0 ? "master" : "slave";
+        std::cout << name << ": " << static_cast<int>(threaded.transfers[side]) << " transfers, last byte received 0x" << std::hex
+                  << static_cast<int>(threaded.received[side]) << std::dec << ", " << threaded.cycles[side] << " cycles" << std::endl;
+        if (threaded.cycles[side] != single.cycles[side] || threaded.pc[side] != single.pc[side]
+            || threaded.received[side] != single.received[side] || threaded.transfers[side] != single.transfers[side]) {
+            std::cerr << "Threaded " << name << " differs from the single-threaded run" << std::endl;
+            passed = false;
+        }
+        if (threaded.transfers[side] == 0) {
+            std::cerr << "No transfer completed on the " << name << " side" << std::endl;
+            passed = false;
+        }
+    }
+    // every transfer swaps the master's counter with the slave's counter plus 0x80
+    if (threaded.received[0] != static_cast<u8>(threaded.transfers[1] - 1 + 0x80) || threaded.received[1] != static_cast<u8>(threaded.transfers[0] - 1)) {
+        std::cerr << "Bytes did not cross the cable" << std::endl;
+        passed = false;
+    }
+    std::cout << (passed ? "Link test passed" : "Link test failed") << std::endl;
+    return passed ? 0 : 1;
+}
@@ -1,34 +1,124 @@
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <thread>
 
+#include "frame_timing.h"
 #include "gameboy.h"
 #include "raylib.h"
 
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <path_to_rom>" << std::endl;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <path_to_rom> [--link-listen <socket> | --link-connect <socket>] [--run-ahead <frames>] [--boot-rom <dmg_boot.bin>] [--metrics <output.prom>]" << std::endl;
+        return 1;
+    }
+
+    std::string link_mode;
+    std::string link_socket;
+    u32 run_ahead = 0;
+    std::string boot_rom_path;
+    std::string metrics_path;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if ((arg == "--link-listen" || arg == "--link-connect") && i + 1 < argc) {
+            link_mode = arg;
+            link_socket = argv[++i];
+        } else if (arg == "--run-ahead" && i + 1 < argc) {
+            run_ahead = static_cast<u32>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--boot-rom" && i + 1 < argc) {
+            boot_rom_path = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (run_ahead && !link_mode.empty()) {
+        std::cerr << "Run-ahead cannot be combined with a link cable" << std::endl;
         return 1;
     }
 
     Gameboy gb(argv[1]);
+    if (!boot_rom_path.empty() && !gb.use_boot_rom(boot_rom_path)) {
+        return 1;
+    }
+
+    MetricsExporter metrics;
+    if (!metrics_path.empty()) {
+        if (!metrics.start(metrics_path)) {
+            return 1;
+        }
+        metrics.add(gb.metrics, gb.header_title, std::to_string(gb.instance_id));
+    }
+
+    // link cable to another emulator process
+    std::unique_ptr<UnixSocketLink> link;
+    if (!link_mode.empty()) {
+        if (link_mode == "--link-listen") {
+            link = UnixSocketLink::listen(link_socket);
+        } else {
+            link = UnixSocketLink::connect(link_socket);
+        }
+        if (!link) {
+            return 1;
+        }
+        gb.set_serial_link(link.get());
+    }
+
+    // emulation runs on its own thread and publishes frames through the triple buffer,
+    // this thread only samples the keyboard and presents whatever frame is latest
+    FrameTiming timing;
+    std::jthread emulation([&gb, &timing, run_ahead](std::stop_token stop) {
+        while (!stop.stop_requested()) {
+            const FrameTiming::Stamp input = timing.take_input();
+            const auto emulation_start = std::chrono::steady_clock::now();
+            gb.run_one_frame_ahead(run_ahead);
+            timing.emulation.record(std::chrono::steady_clock::now() - emulation_start);
+            timing.frame_emulated(input, gb.frames_published.load(std::memory_order_relaxed));
+            gb.queue_audio(); // blocks while the audio buffer is full, this paces emulation
+            gb.wait_for_next_frame(); // frame timer when not synced to audio
+        }
+    });
 
     float total_time = 0.0f;
-    size_t frames = 0;
+    u32 last_frames = gb.frames_published.load(std::memory_order_relaxed);
+    u8 last_buttons = gb.input_buttons.load(std::memory_order_relaxed);
 
     while (!WindowShouldClose()) {
-        gb.run_one_frame();
+        gb.poll_keyboard();
+        const u8 buttons = gb.input_buttons.load(std::memory_order_relaxed);
+        if (buttons != last_buttons) {
+            timing.input_changed();
+            last_buttons = buttons;
+        }
+        if (IsKeyPressed(KEY_F3)) {
+            timing.print(std::cout);
+        }
+
+        const u32 published = gb.frames_published.load(std::memory_order_acquire); // render_screen shows this frame or a later one
+        const auto present_start = std::chrono::steady_clock::now();
         gb.render_screen();
+        timing.present.record(std::chrono::steady_clock::now() - present_start);
+        timing.frame_presented(published);
 
         total_time += GetFrameTime();
-        frames++;
-
         if (total_time >= 1.0f) {
-            gb.update_window_title(frames);
+            const u32 frames = gb.frames_published.load(std::memory_order_relaxed);
+            gb.update_window_title(frames - last_frames);
+            last_frames = frames;
             total_time -= 1.0f;
-            frames = 0;
         }
     }
 
+    emulation.request_stop();
+    emulation.join();
+    metrics.stop();
+    timing.print(std::cout);
     return 0;
 }
 
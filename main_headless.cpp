@@ -0,0 +1,225 @@
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "gameboy.h"
+#include "pool.h"
+#include "scaler.h"
+#include "trace.h"
+
+// runs a ROM without window or audio device as fast as possible,
+// e.g. for benchmarks, for checking the audio output offline or for test ROMs reporting over serial
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <path_to_rom> [frames] [--wav <output.wav>] [--serial] [--until-serial <text>] [--link-with <path_to_rom>] [--run-ahead <frames>] [--scale <filter[:factor]>] [--capture <output.y4m|.png|.rgba>] [--pixels <rgba|index2|gray8|none>] [--pool <workers>x<instances>] [--footprint] [--boot-rom <dmg_boot.bin>] [--metrics <output.prom>] [--trace <output.trace>]" << std::endl;
+        return 1;
+    }
+
+    size_t frame_limit = 3600;
+    std::string wav_path;
+    std::string link_rom_path;
+    std::string serial_stop_text;
+    std::string capture_path;
+    std::string boot_rom_path;
+    std::string metrics_path;
+    std::string trace_path;
+    PixelFormat pixel_format = PixelFormat::rgba;
+    u32 pool_workers = 0;
+    u32 pool_instances = 0;
+    bool print_serial = false;
+    bool print_footprint = false;
+    u32 run_ahead = 0;
+    Scaler scaler;
+    bool scaling = false;
+    ScaleFilter scale_filter = ScaleFilter::nearest;
+    int scale_factor = 1;
+    for (int i = 2; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--wav" && i + 1 < argc) {
+            wav_path = argv[++i];
+        } else if (arg == "--serial") {
+            print_serial = true;
+        } else if (arg == "--until-serial" && i + 1 < argc) {
+            serial_stop_text = argv[++i];
+            print_serial = true;
+        } else if (arg == "--link-with" && i + 1 < argc) {
+            link_rom_path = argv[++i];
+        } else if (arg == "--run-ahead" && i + 1 < argc) {
+            run_ahead = static_cast<u32>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--scale" && i + 1 < argc) {
+            if (!Scaler::parse(argv[++i], scale_filter, scale_factor) || !scaler.configure(scale_filter, scale_factor)) {
+                return 1;
+            }
+            scale_factor = scaler.scale;
+            scaling = true;
+        } else if (arg == "--capture" && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (arg == "--pool" && i + 1 < argc) {
+            char* end = nullptr;
+            pool_workers = static_cast<u32>(std::strtoul(argv[++i], &end, 10));
+            pool_instances = *end == 'x' ? static_cast<u32>(std::strtoul(end + 1, nullptr, 10)) : 1;
+        } else if (arg == "--pixels" && i + 1 < argc) {
+            const std::string format = argv[++i];
+            if (format == "index2") {
+                pixel_format = PixelFormat::index2;
+            } else if (format == "gray8") {
+                pixel_format = PixelFormat::gray8;
+            } else if (format == "none") {
+                pixel_format = PixelFormat::none;
+            } else if (format != "rgba") {
+                std::cerr << "Unknown pixel format: " << format << " (rgba, index2, gray8, none)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--footprint") {
+            print_footprint = true;
+        } else if (arg == "--boot-rom" && i + 1 < argc) {
+            boot_rom_path = argv[++i];
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else {
+            frame_limit = std::strtoull(argv[i], nullptr, 10);
+        }
+    }
+
+    // the index formats leave the framebuffers untouched, the capture would only see blank frames
+    if (!capture_path.empty() && pixel_format != PixelFormat::rgba) {
+        std::cerr << "Capturing needs the rgba pixel format, drop --pixels or use --pixels rgba" << std::endl;
+        return 1;
+    }
+
+    // many instances in worker processes instead of one here, forked before anything starts threads
+    if (pool_workers) {
+        InstancePool pool;
+        if (!pool.start(argv[1], pool_workers, pool_instances, pixel_format, boot_rom_path, metrics_path)) {
+            return 1;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        size_t frames = 0;
+        while (frames < frame_limit && pool.step(1)) {
+            frames++;
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const double instance_frames = static_cast<double>(frames) * pool.instance_count();
+        std::cout << pool.instance_count() << " instances x " << frames << " frames in " << seconds << " s ("
+                  << instance_frames / seconds << " instance frames per second)" << std::endl;
+        return pool.failed ? 1 : 0;
+    }
+
+    Gameboy gb(argv[1]);
+    if (!boot_rom_path.empty() && !gb.use_boot_rom(boot_rom_path)) {
+        return 1;
+    }
+
+    // observation buffer as an embedder would provide it, frames are not presented here anyway
+    std::vector<u8> pixel_output(GRAY8_FRAME_BYTES);
+    gb.set_pixel_output(pixel_format, pixel_output.data());
+
+    if (!wav_path.empty()) {
+        if (!gb.audio_output.open_wav(wav_path)) {
+            return 1;
+        }
+        gb.apu.set_muted(false, gb.cycle_count);
+    }
+
+    // scaling then belongs to the capture writer thread
+    FrameCapture capture_output;
+    if (!capture_path.empty()) {
+        if (!capture_output.open(capture_path, scale_filter, scale_factor)) {
+            return 1;
+        }
+        gb.frame_capture = &capture_output;
+        scaling = false;
+    }
+
+    // every instruction of this instance, e.g. to diff against a trace of another build with gameboy_trace
+    TraceRecorder trace;
+    if (!trace_path.empty()) {
+        if (!trace.open(trace_path)) {
+            return 1;
+        }
+        gb.trace = &trace;
+    }
+
+    // a second instance on the other end of an in-process link cable, otherwise capture what is sent
+    std::unique_ptr<Gameboy> peer;
+    std::unique_ptr<LinkCable> cable;
+    std::unique_ptr<LinkScheduler> scheduler;
+    SerialCapture capture;
+    if (!link_rom_path.empty()) {
+        // a second copy of the same ROM would map the same save file and share its battery RAM
+        std::error_code error;
+        const bool same_rom = std::filesystem::equivalent(argv[1], link_rom_path, error);
+        peer = std::make_unique<Gameboy>(link_rom_path, !same_rom);
+        cable = std::make_unique<LinkCable>(gb, *peer);
+        scheduler = std::make_unique<LinkScheduler>(*cable); // each side on its own core
+    } else if (print_serial) {
+        gb.set_serial_link(&capture);
+    }
+
+    MetricsExporter metrics;
+    if (!metrics_path.empty()) {
+        if (!metrics.start(metrics_path)) {
+            return 1;
+        }
+        metrics.add(gb.metrics, gb.header_title, std::to_string(gb.instance_id));
+        if (peer) {
+            metrics.add(peer->metrics, peer->header_title, std::to_string(peer->instance_id));
+        }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    size_t frames = 0;
+    size_t scaled_frames = 0;
+    std::chrono::steady_clock::duration scale_time {};
+    while (frames < frame_limit) {
+        if (scheduler) {
+            scheduler->run_frames(1);
+        } else {
+            gb.run_one_frame_ahead(run_ahead);
+        }
+        gb.queue_audio();
+        frames++;
+
+        // what a capture would do with every presented picture
+        if (scaling && gb.acquire_frame()) {
+            const auto scale_start = std::chrono::steady_clock::now();
+            scaler.run(gb.framebuffer_front_pixels);
+            scale_time += std::chrono::steady_clock::now() - scale_start;
+            scaled_frames++;
+        }
+
+        if (!serial_stop_text.empty() && capture.output.find(serial_stop_text) != std::string::npos) {
+            break;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    capture_output.close();
+    gb.trace = nullptr;
+    trace.close();
+    metrics.stop();
+
+    if (print_serial) {
+        std::cout << capture.output << std::endl;
+    }
+    std::cout << frames << " frames in " << seconds << " s (" << static_cast<double>(frames) / seconds << " FPS)" << std::endl;
+    if (scheduler && scheduler->parallel) {
+        std::cout << scheduler->slices << " link slices, " << scheduler->transfer_stalls << " cut short by transfers" << std::endl;
+    }
+    if (scaled_frames) {
+        const double micros = std::chrono::duration<double, std::micro>(scale_time).count() / static_cast<double>(scaled_frames);
+        std::cout << scaled_frames << " frames scaled to " << scaler.output_width << "x" << scaler.output_height << ", " << micros << " us per frame" << std::endl;
+    }
+    if (print_footprint) {
+        const Footprint footprint = gb.footprint();
+        std::cout << "Instance footprint: " << footprint.instance << " bytes, plus " << footprint.shared << " bytes of ROM shared by all instances of it" << std::endl;
+    }
+    return 0;
+}
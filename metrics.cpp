@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <format>
+#include <iostream>
+
+#include "metrics.h"
+#include "save_writer.h"
+
+namespace {
+
+constexpr std::array<std::string_view, 5> INTERRUPT_NAMES = { "vblank", "stat", "timer", "serial", "joypad" };
+
+// label values may hold anything a ROM header or file name does
+void append_label(std::string& text, std::string_view name, std::string_view value)
+{
+    text += name;
+    text += "=\"";
+    for (const char c : value) {
+        if (c == '\\' || c == '"') {
+            text += '\\';
+            text += c;
+        } else if (c == '\n') {
+            text += "\\n";
+        } else {
+            text += c;
+        }
+    }
+    text += '"';
+}
+
+void append_header(std::string& text, std::string_view name, std::string_view help)
+{
+    text += "# HELP ";
+    text += name;
+    text += ' ';
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += " counter\n";
+}
+
+template <typename Value>
+void append_sample(std::string& text, std::string_view name, const MetricsExporter::Source& source, std::string_view interrupt, Value value)
+{
+    text += name;
+    text += '{';
+    append_label(text, "rom", source.rom);
+    text += ',';
+    append_label(text, "instance", source.instance);
+    if (!interrupt.empty()) {
+        text += ',';
+        append_label(text, "type", interrupt);
+    }
+    text += "} ";
+    text += std::format("{}", value);
+    text += '\n';
+}
+
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    stop();
+}
+
+bool MetricsExporter::start(const std::filesystem::path& output_path, std::chrono::milliseconds dump_interval)
+{
+    stop();
+    path = output_path;
+    interval = dump_interval;
+    stopping = false;
+    if (!dump()) {
+        return false;
+    }
+    writer = std::thread(&MetricsExporter::run_writer, this);
+    return true;
+}
+
+// the last dump has the final counts, call it after the instances stopped running
+void MetricsExporter::stop()
+{
+    if (!writer.joinable()) {
+        return;
+    }
+    {
+        const std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    dump();
+}
+
+void MetricsExporter::add(InstanceMetrics& metrics, std::string_view rom, std::string_view instance)
+{
+    metrics.time_rendering.store(true, std::memory_order_relaxed);
+    const std::lock_guard lock(mutex);
+    sources.push_back({ &metrics, std::string(rom), std::string(instance) });
+}
+
+void MetricsExporter::remove(InstanceMetrics& metrics)
+{
+    metrics.time_rendering.store(false, std::memory_order_relaxed);
+    const std::lock_guard lock(mutex);
+    std::erase_if(sources, [&metrics](const Source& source) { return source.metrics == &metrics; });
+}
+
+bool MetricsExporter::dump()
+{
+    // every sample of one metric has to follow its header, so the sources are walked once per metric
+    struct Metric {
+        std::string_view name;
+        std::string_view help;
+        const MetricCounter InstanceMetrics::* counter;
+    };
+    static constexpr std::array<Metric, 8> METRICS = { {
+        { "gameboy_instructions_total", "Instructions retired.", &InstanceMetrics::instructions },
+        { "gameboy_cycles_total", "Emulated cycles at normal speed.", &InstanceMetrics::cycles },
+        { "gameboy_halted_cycles_total", "Emulated cycles the CPU spent halted.", &InstanceMetrics::halted_cycles },
+        { "gameboy_frames_total", "Emulated frames.", &InstanceMetrics::frames },
+        { "gameboy_bank_switches_total", "Writes to the ROM and RAM bank registers of the mapper.", &InstanceMetrics::bank_switches },
+        { "gameboy_vram_writes_total", "CPU and DMA writes to VRAM.", &InstanceMetrics::vram_writes },
+        { "gameboy_save_flushes_total", "Battery RAM handed to the save writer.", &InstanceMetrics::save_flushes },
+        { "gameboy_rendered_lines_total", "Scanlines rendered while render time was measured.", &InstanceMetrics::rendered_lines },
+    } };
+
+    std::string text;
+    {
+        const std::lock_guard lock(mutex);
+        for (const Metric& metric : METRICS) {
+            append_header(text, metric.name, metric.help);
+            for (const Source& source : sources) {
+                append_sample(text, metric.name, source, {}, (source.metrics->*metric.counter).get());
+            }
+        }
+        append_header(text, "gameboy_render_scanline_seconds_total", "Time spent rendering scanlines.");
+        for (const Source& source : sources) {
+            append_sample(text, "gameboy_render_scanline_seconds_total", source, {}, static_cast<double>(source.metrics->render_nanoseconds.get()) * 1e-9);
+        }
+        append_header(text, "gameboy_interrupts_total", "Interrupts serviced, by type.");
+        for (const Source& source : sources) {
+            for (size_t i = 0; i < INTERRUPT_NAMES.size(); ++i) {
+                append_sample(text, "gameboy_interrupts_total", source, INTERRUPT_NAMES[i], source.metrics->interrupts[i].get());
+            }
+        }
+    }
+
+    if (!write_file_atomically(path, reinterpret_cast<const u8*>(text.data()), text.size())) {
+        std::cerr << "Failed to write metrics file: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void MetricsExporter::run_writer()
+{
+    std::unique_lock lock(mutex);
+    while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+        lock.unlock();
+        dump();
+        lock.lock();
+    }
+}
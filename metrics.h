@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+constexpr std::chrono::seconds METRICS_DEFAULT_INTERVAL { 10 };
+
+// one counter only the thread running the instance writes. a relaxed load and store is a plain
+// add on that thread, without the locked read-modify-write of fetch_add, and the exporter thread
+// still reads a value the counter really had
+struct MetricCounter {
+    std::atomic<u64> value { 0 };
+
+    void add(u64 amount) { value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); }
+    u64 get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// what one instance spends its time on, since it was constructed. counters that change every
+// instruction are summed locally and added once per run_until
+struct InstanceMetrics {
+    MetricCounter instructions; // instructions retired, a halted CPU retires none
+    MetricCounter cycles; // at normal speed, like cycle_count
+    MetricCounter halted_cycles;
+    MetricCounter frames;
+    std::array<MetricCounter, 5> interrupts; // serviced, by IF bit: VBlank, STAT, timer, serial, joypad
+    MetricCounter bank_switches; // writes to the mapper's ROM and RAM bank registers
+    MetricCounter vram_writes; // CPU and DMA, both banks
+    MetricCounter save_flushes; // battery RAM handed to the save writer
+    MetricCounter rendered_lines; // timed render_scanline calls
+    MetricCounter render_nanoseconds;
+    std::atomic<bool> time_rendering { false }; // two clock reads per line, only while an exporter watches
+};
+
+// writes the metrics of every added instance to one file in the Prometheus text format, replacing
+// it atomically every interval and once more on stop, so a node exporter textfile collector or
+// anything else polling the file never sees half of it
+struct MetricsExporter {
+    struct Source {
+        const InstanceMetrics* metrics;
+        std::string rom; // label values, escaped when written
+        std::string instance;
+    };
+
+    std::filesystem::path path;
+    std::chrono::milliseconds interval { METRICS_DEFAULT_INTERVAL };
+    std::mutex mutex; // guards sources, and wakes the writer for stop
+    std::condition_variable wake;
+    std::vector<Source> sources;
+    bool stopping = false;
+    std::thread writer;
+
+    MetricsExporter() = default;
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+    ~MetricsExporter();
+
+    bool start(const std::filesystem::path& output_path, std::chrono::milliseconds dump_interval = METRICS_DEFAULT_INTERVAL);
+    void stop();
+
+    // the metrics have to outlive their membership, remove them before the instance goes away
+    void add(InstanceMetrics& metrics, std::string_view rom, std::string_view instance);
+    void remove(InstanceMetrics& metrics);
+    bool dump();
+
+private:
+    void run_writer();
+};
@@ -5428,6 +5428,11 @@ u8 op_0xCB_0xEF_SET_5_A(Gameboy& gb)
 u8 op_0x10_STOP(Gameboy& gb)
 {
     // not a real implementation, but apparently no licensed games use this
+    // apart from CGB speed switching, which is armed through KEY1 beforehand
+    if (gb.cgb_mode && (gb.memory[0xFF4D] & 0x01)) {
+        gb.double_speed = !gb.double_speed;
+        gb.memory[0xFF4D] = gb.double_speed ? 0x80 : 0x00;
+    }
     gb.write8(0xFF04, 0); // reset DIV register
     gb.PC += 1;
     return 4;
@@ -0,0 +1,354 @@
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "gameboy.h"
+#include "pool.h"
+
+static_assert(std::atomic<u32>::is_always_lock_free && sizeof(std::atomic<u32>) == sizeof(u32));
+
+static size_t align64(size_t size)
+{
+    return (size + 63) & ~size_t(63);
+}
+
+static size_t pixel_bytes_for(PixelFormat format)
+{
+    switch (format) {
+    case PixelFormat::index2:
+        return INDEX2_FRAME_BYTES;
+    case PixelFormat::gray8:
+        return GRAY8_FRAME_BYTES;
+    case PixelFormat::none:
+        return 0;
+    default:
+        return SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32);
+    }
+}
+
+// std::atomic wait and notify use process private futexes, these two work across the shared mapping
+static void shared_wake(std::atomic<u32>& word)
+{
+    syscall(SYS_futex, reinterpret_cast<u32*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// spins briefly since steps of a few instances are short, then sleeps until word moves away from seen
+// or timeout_ms passed (-1 = no timeout), returns the current value either way. on a single core
+// spinning only delays the process it waits for
+static u32 shared_wait(std::atomic<u32>& word, u32 seen, int timeout_ms)
+{
+    static const int spin_iterations = std::thread::hardware_concurrency() > 1 ? POOL_SPIN_ITERATIONS : 0;
+    for (int i = 0; i < spin_iterations; ++i) {
+        const u32 value = word.load(std::memory_order_acquire);
+        if (value != seen) {
+            return value;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    timespec timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, reinterpret_cast<u32*>(&word), FUTEX_WAIT, seen, timeout_ms >= 0 ? &timeout : nullptr, nullptr, 0);
+    return word.load(std::memory_order_acquire);
+}
+
+InstancePool::~InstancePool()
+{
+    stop();
+}
+
+bool InstancePool::start(const std::string& rom_path, u32 workers, u32 instances, PixelFormat format, const std::string& boot_rom_path, const std::string& metrics_path)
+{
+    if (workers == 0 || instances == 0) {
+        std::cerr << "Instance pool needs at least one worker and one instance per worker" << std::endl;
+        return false;
+    }
+
+    const size_t pixel_bytes = pixel_bytes_for(format);
+    const size_t slot_size = align64(sizeof(PoolSlotHeader) + pixel_bytes + POOL_RAM_SIZE);
+    const size_t slots_offset = align64(sizeof(PoolHeader)) + workers * sizeof(PoolWorker);
+    const size_t size = slots_offset + static_cast<size_t>(workers) * instances * slot_size;
+
+    // the workers inherit the mapping, the name is only needed until it is mapped,
+    // so nothing is left behind in /dev/shm if the controller crashes
+    const std::string name = "/gameboy-pool-" + std::to_string(getpid());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "Failed to create shared memory " << name << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    shm_unlink(name.c_str());
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        std::cerr << "Failed to size shared memory to " << size << " bytes (" << std::strerror(errno) << ")" << std::endl;
+        close(fd);
+        return false;
+    }
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Failed to map shared memory (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    mapping = static_cast<u8*>(memory);
+    mapping_size = size;
+    worker_count = workers;
+    instances_per_worker = instances;
+    failed = false;
+
+    PoolHeader& pool_header = *new (mapping) PoolHeader {};
+    pool_header.magic = POOL_MAGIC;
+    pool_header.worker_count = workers;
+    pool_header.instances_per_worker = instances;
+    pool_header.pixel_bytes = static_cast<u32>(pixel_bytes);
+    pool_header.slot_size = slot_size;
+    for (u32 i = 0; i < workers; ++i) {
+        new (&worker(i)) PoolWorker {};
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+    controller_pid = getpid();
+    for (u32 i = 0; i < workers; ++i) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Failed to fork pool worker " << i << " (" << std::strerror(errno) << ")" << std::endl;
+            stop();
+            return false;
+        }
+        if (pid == 0) {
+            run_worker(i, rom_path, format, boot_rom_path, metrics_path);
+        }
+        worker_pids.push_back(pid);
+    }
+    return true;
+}
+
+void InstancePool::stop()
+{
+    if (!mapping) {
+        return;
+    }
+
+    for (u32 i = 0; i < worker_pids.size(); ++i) {
+        if (failed || !push(i, { PoolCommandType::stop, 0 })) {
+            kill(worker_pids[i], SIGKILL);
+        }
+    }
+    for (const pid_t pid : worker_pids) {
+        waitpid(pid, nullptr, 0);
+    }
+    worker_pids.clear();
+
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+void InstancePool::set_joypad(u32 instance, u8 pressed)
+{
+    reinterpret_cast<PoolSlotHeader*>(slot(instance))->joypad = pressed;
+}
+
+const u8* InstancePool::pixels(u32 instance) const
+{
+    return slot(instance) + sizeof(PoolSlotHeader);
+}
+
+const u8* InstancePool::ram(u32 instance) const
+{
+    return slot(instance) + sizeof(PoolSlotHeader) + header().pixel_bytes;
+}
+
+const PoolSlotHeader& InstancePool::slot_header(u32 instance) const
+{
+    return *reinterpret_cast<const PoolSlotHeader*>(slot(instance));
+}
+
+bool InstancePool::submit(u32 frames)
+{
+    for (u32 i = 0; i < worker_count; ++i) {
+        if (!push(i, { PoolCommandType::step, frames })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool InstancePool::wait()
+{
+    for (u32 i = 0; i < worker_count; ++i) {
+        PoolWorker& ring = worker(i);
+        const u32 head = ring.head.load(std::memory_order_relaxed);
+        u32 tail = ring.tail.load(std::memory_order_acquire);
+        while (tail != head) {
+            tail = shared_wait(ring.tail, tail, POOL_WAIT_TIMEOUT_MS);
+            if (tail != head && !check_workers()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+PoolHeader& InstancePool::header() const
+{
+    return *reinterpret_cast<PoolHeader*>(mapping);
+}
+
+PoolWorker& InstancePool::worker(u32 index) const
+{
+    return reinterpret_cast<PoolWorker*>(mapping + align64(sizeof(PoolHeader)))[index];
+}
+
+u8* InstancePool::slot(u32 instance) const
+{
+    const size_t slots_offset = align64(sizeof(PoolHeader)) + worker_count * sizeof(PoolWorker);
+    return mapping + slots_offset + instance * header().slot_size;
+}
+
+bool InstancePool::push(u32 index, PoolCommand command)
+{
+    if (failed) {
+        return false;
+    }
+
+    PoolWorker& ring = worker(index);
+    const u32 head = ring.head.load(std::memory_order_relaxed);
+    u32 tail = ring.tail.load(std::memory_order_acquire);
+    while (head - tail == POOL_RING_SIZE) {
+        tail = shared_wait(ring.tail, tail, POOL_WAIT_TIMEOUT_MS);
+        if (head - tail == POOL_RING_SIZE && !check_workers()) {
+            return false;
+        }
+    }
+
+    ring.commands[head % POOL_RING_SIZE] = command;
+    ring.head.store(head + 1, std::memory_order_release);
+    shared_wake(ring.head);
+    return true;
+}
+
+// a worker that crashed would leave the controller waiting forever
+bool InstancePool::check_workers()
+{
+    for (u32 i = 0; i < worker_pids.size(); ++i) {
+        int status = 0;
+        if (waitpid(worker_pids[i], &status, WNOHANG) == worker_pids[i]) {
+            std::cerr << "Pool worker " << i << " exited unexpectedly (status " << status << ")" << std::endl;
+            failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+void InstancePool::run_worker(u32 index, const std::string& rom_path, PixelFormat format, const std::string& boot_rom_path, const std::string& metrics_path)
+{
+    // never outlive the controller. it may have died before the signal was armed, and the worker then
+    // belongs to init or a subreaper, either of which can have any pid, the controller included
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != controller_pid) {
+        _exit(1);
+    }
+
+    // thousands of instances would repeat the cartridge banner, errors still reach stderr
+    const int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    // battery RAM stays in memory, all instances share one ROM path and so one save file.
+    // the instances of a worker live next to each other in its arena, on the worker's NUMA node
+    const u32 first = index * instances_per_worker;
+    InstanceArena arena;
+    if (!arena.open(instances_per_worker * ARENA_INSTANCE_RESERVE)) {
+        _exit(1);
+    }
+    std::vector<Gameboy*> instances;
+    for (u32 i = 0; i < instances_per_worker; ++i) {
+        Gameboy* instance = arena.create(rom_path);
+        if (!instance) {
+            _exit(1);
+        }
+        Gameboy& gb = *instances.emplace_back(instance);
+        // every instance starts where the boot ROM hands over, only the first one runs it
+        if (!boot_rom_path.empty() && (!gb.use_boot_rom(boot_rom_path) || !gb.run_boot_rom())) {
+            _exit(1);
+        }
+        if (format != PixelFormat::rgba) {
+            gb.set_pixel_output(format, slot(first + i) + sizeof(PoolSlotHeader)); // the PPU writes straight into shared memory
+        }
+    }
+
+    MetricsExporter metrics;
+    if (!metrics_path.empty()) {
+        std::filesystem::path worker_metrics_path = metrics_path;
+        worker_metrics_path.replace_filename(worker_metrics_path.stem().string() + "." + std::to_string(index) + worker_metrics_path.extension().string());
+        if (!metrics.start(worker_metrics_path)) {
+            _exit(1);
+        }
+        for (u32 i = 0; i < instances_per_worker; ++i) {
+            metrics.add(instances[i]->metrics, instances[i]->header_title, std::to_string(first + i));
+        }
+    }
+
+    PoolWorker& ring = worker(index);
+    u32 tail = ring.tail.load(std::memory_order_relaxed);
+    while (true) {
+        u32 head = ring.head.load(std::memory_order_acquire);
+        while (head == tail) {
+            head = shared_wait(ring.head, head, -1);
+        }
+
+        const PoolCommand command = ring.commands[tail % POOL_RING_SIZE];
+        if (command.type == PoolCommandType::stop) {
+            metrics.stop();
+            ring.tail.store(tail + 1, std::memory_order_release);
+            shared_wake(ring.tail);
+            _exit(0); // the controller owns the mapping, nothing here needs destructing
+        }
+
+        for (u32 i = 0; i < instances_per_worker; ++i) {
+            Gameboy& gb = *instances[i];
+            u8* instance_slot = slot(first + i);
+            auto& slot_header = *reinterpret_cast<PoolSlotHeader*>(instance_slot);
+
+            gb.input_buttons.store(static_cast<u8>(~slot_header.joypad), std::memory_order_relaxed);
+            for (u32 frame = 0; frame < command.frames; ++frame) {
+                gb.run_one_frame();
+            }
+
+            if (format == PixelFormat::rgba && gb.acquire_frame()) {
+                std::memcpy(instance_slot + sizeof(PoolSlotHeader), gb.framebuffer_front_pixels, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32));
+            }
+            u8* ram_observation = instance_slot + sizeof(PoolSlotHeader) + header().pixel_bytes;
+            std::memcpy(ram_observation, gb.memory.at(POOL_RAM_START), 0x1000);
+            std::memcpy(ram_observation + 0x1000, gb.wram_bank_ptr, POOL_RAM_SIZE - 0x1000); // switchable bank on a CGB
+            slot_header.frames += command.frames;
+            slot_header.cycle_count = gb.cycle_count;
+        }
+
+        ++tail;
+        ring.tail.store(tail, std::memory_order_release);
+        shared_wake(ring.tail);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "types.h"
+
+enum class PixelFormat : u8;
+
+constexpr u32 POOL_MAGIC = 0x4C4F4F50; // "POOL"
+constexpr u32 POOL_RING_SIZE = 16; // commands a worker can have outstanding, power of two
+constexpr u16 POOL_RAM_START = 0xC000; // work RAM as seen by the CPU is the RAM observation
+constexpr size_t POOL_RAM_SIZE = 0x2000;
+constexpr int POOL_SPIN_ITERATIONS = 4096; // polls before sleeping on the futex
+constexpr int POOL_WAIT_TIMEOUT_MS = 100; // how often the controller checks that a worker is still alive
+
+enum class PoolCommandType : u32 {
+    step, // run frames on every instance of the worker, then update the observations
+    stop,
+};
+
+struct PoolCommand {
+    PoolCommandType type;
+    u32 frames;
+};
+
+// per worker command ring. the controller is the only writer of head and the commands,
+// the worker the only writer of tail, both sleep on the other's counter with a shared futex
+struct alignas(64) PoolWorker {
+    std::atomic<u32> head { 0 }; // commands submitted
+    alignas(64) std::atomic<u32> tail { 0 }; // commands completed
+    std::array<PoolCommand, POOL_RING_SIZE> commands {};
+};
+
+// start of every instance slot, followed by the pixels and POOL_RAM_SIZE bytes of RAM
+struct alignas(64) PoolSlotHeader {
+    u8 joypad; // pressed buttons for the next step, bit order of input_buttons, written by the controller
+    u64 frames; // frames run so far, written by the worker
+    u64 cycle_count;
+};
+
+// start of the shared memory, followed by the PoolWorker array and the instance slots
+struct alignas(64) PoolHeader {
+    u32 magic;
+    u32 worker_count;
+    u32 instances_per_worker;
+    u32 pixel_bytes; // per instance, depends on the pixel format
+    u64 slot_size; // bytes between consecutive instance slots
+};
+
+// runs instances of one ROM in forked worker processes for isolation. commands, inputs, pixels
+// and RAM observations live in one POSIX shared memory mapping, so stepping thousands of instances
+// costs one ring entry and one wake up per worker and no copies or serialization on the controller side
+struct InstancePool {
+    u8* mapping = nullptr;
+    size_t mapping_size = 0;
+    std::vector<pid_t> worker_pids;
+    pid_t controller_pid = 0; // process that started the pool, a worker whose parent is no longer it exits
+    u32 worker_count = 0;
+    u32 instances_per_worker = 0;
+    bool failed = false; // a worker died, the pool no longer steps
+
+    InstancePool() = default;
+    InstancePool(const InstancePool&) = delete;
+    InstancePool& operator=(const InstancePool&) = delete;
+    ~InstancePool();
+
+    // call before the process starts threads of its own, the workers are forked from it.
+    // with a metrics path every worker exports its instances to that path plus its index, pool.prom becomes pool.0.prom
+    bool start(const std::string& rom_path, u32 workers, u32 instances, PixelFormat format, const std::string& boot_rom_path = {}, const std::string& metrics_path = {});
+    void stop();
+
+    u32 instance_count() const { return worker_count * instances_per_worker; }
+    void set_joypad(u32 instance, u8 pressed);
+    const u8* pixels(u32 instance) const; // INDEX2/GRAY8_FRAME_BYTES or RGBA, as of the last completed step
+    const u8* ram(u32 instance) const; // POOL_RAM_SIZE bytes from POOL_RAM_START
+    const PoolSlotHeader& slot_header(u32 instance) const;
+
+    bool submit(u32 frames); // queues a step on every worker without waiting
+    bool wait(); // until every worker finished its queue, false if one died
+    bool step(u32 frames) { return submit(frames) && wait(); }
+
+private:
+    PoolHeader& header() const;
+    PoolWorker& worker(u32 index) const;
+    u8* slot(u32 instance) const;
+    bool push(u32 index, PoolCommand command);
+    bool check_workers();
+    [[noreturn]] void run_worker(u32 index, const std::string& rom_path, PixelFormat format, const std::string& boot_rom_path, const std::string& metrics_path);
+};
@@ -0,0 +1,173 @@
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include "gameboy.h"
+
+namespace py = pybind11;
+
+namespace {
+
+// one emulator and the buffers Python looks at, stepping releases the GIL
+// so instances in different Python threads run in parallel
+struct Environment {
+    std::unique_ptr<Gameboy> gb;
+    std::vector<u8> pixel_buffer = std::vector<u8>(GRAY8_FRAME_BYTES); // index formats write here, never reallocated under a view
+    SaveState state; // reused by save_state
+
+    explicit Environment(const std::string& path, const std::optional<std::string>& boot_rom, bool save_file)
+    {
+        // the core exits on a missing ROM, which would take the interpreter with it
+        if (!std::filesystem::is_regular_file(path)) {
+            throw py::value_error("ROM not found: " + path);
+        }
+        // instances with a save file map the same .sav and share its battery RAM
+        gb = std::make_unique<Gameboy>(path, save_file);
+        if (boot_rom && (!gb->use_boot_rom(*boot_rom) || !gb->run_boot_rom())) {
+            throw py::value_error("Boot ROM cannot start this ROM: " + *boot_rom);
+        }
+    }
+
+    explicit Environment(std::unique_ptr<Gameboy> forked)
+        : gb(std::move(forked))
+    {
+    }
+
+    Environment fork() const
+    {
+        return Environment(gb->fork());
+    }
+
+    void fork_from(const Environment& parent)
+    {
+        gb->fork_from(*parent.gb);
+    }
+
+    // joypad holds the pressed buttons, the core stores them active low like JOYP
+    void step(u32 frames, u8 joypad)
+    {
+        gb->input_buttons.store(static_cast<u8>(~joypad), std::memory_order_relaxed);
+        for (u32 i = 0; i < frames; ++i) {
+            gb->run_one_frame();
+        }
+    }
+
+    void set_pixel_format(const std::string& name)
+    {
+        PixelFormat format = PixelFormat::rgba;
+        if (name == "index2") {
+            format = PixelFormat::index2;
+        } else if (name == "gray8") {
+            format = PixelFormat::gray8;
+        } else if (name == "none") {
+            format = PixelFormat::none;
+        } else if (name != "rgba") {
+            throw py::value_error("Unknown pixel format: " + name + " (rgba, index2, gray8, none)");
+        }
+        gb->set_pixel_output(format, pixel_buffer.data());
+    }
+
+    py::bytes save_state()
+    {
+        gb->save_state(state);
+        return py::bytes(reinterpret_cast<const char*>(state.data.data()), state.data.size());
+    }
+
+    void load_state(const py::bytes& data)
+    {
+        const std::string_view bytes = data;
+        state.data.assign(bytes.begin(), bytes.end());
+        if (!gb->load_state(state)) {
+            throw py::value_error("Save state does not belong to this ROM or is corrupt");
+        }
+    }
+
+    // power cycle, or straight to a state from save_state, reusing every buffer
+    void reset(const std::optional<py::bytes>& data)
+    {
+        if (!data) {
+            gb->reset();
+            return;
+        }
+        const std::string_view bytes = *data;
+        state.data.assign(bytes.begin(), bytes.end());
+        if (!gb->reset_to_state(state)) {
+            throw py::value_error("Save state does not belong to this ROM or is corrupt");
+        }
+    }
+};
+
+// array over memory the environment owns, holding a reference to it so the memory outlives the array
+py::array_t<u8> view(const py::object& owner, u8* data, std::vector<py::ssize_t> shape)
+{
+    return py::array_t<u8>(std::move(shape), data, owner);
+}
+
+}
+
+PYBIND11_MODULE(gameboy, m)
+{
+    m.doc() = "Game Boy emulator core with zero-copy NumPy views";
+
+    m.attr("RIGHT") = 0x01;
+    m.attr("LEFT") = 0x02;
+    m.attr("UP") = 0x04;
+    m.attr("DOWN") = 0x08;
+    m.attr("A") = 0x10;
+    m.attr("B") = 0x20;
+    m.attr("SELECT") = 0x40;
+    m.attr("START") = 0x80;
+
+    py::class_<Environment>(m, "Gameboy")
+        .def(py::init<const std::string&, const std::optional<std::string>&, bool>(), py::arg("rom_path"), py::arg("boot_rom") = py::none(),
+            py::arg("save_file") = false,
+            "with boot_rom the DMG boot ROM runs once per ROM and process, instances start where it hands over. "
+            "with save_file battery RAM is loaded from and kept in the .sav next to the ROM, shared by every instance that has it")
+        .def("step", &Environment::step, py::arg("frames") = 1, py::arg("joypad") = 0,
+            py::call_guard<py::gil_scoped_release>(), "runs frames with the given buttons held (RIGHT | A ...)")
+        .def("save_state", &Environment::save_state)
+        .def("load_state", &Environment::load_state, py::arg("state"))
+        .def("reset", &Environment::reset, py::arg("state") = py::none(),
+            "power cycle without constructing again, or with state back to a save_state, no buttons held")
+        .def("fork", &Environment::fork, "new instance in the same state, battery RAM is never saved by it")
+        .def("fork_from", &Environment::fork_from, py::arg("parent"),
+            "becomes a copy of parent, copying only the pages either changed since the last fork_from the same parent")
+        .def("set_pixel_format", &Environment::set_pixel_format, py::arg("format"),
+            "rgba fills frame, index2 (4 pixels per byte) and gray8 fill pixels instead, none draws nothing")
+        .def_property_readonly("cgb_mode", [](const Environment& env) { return env.gb->cgb_mode; })
+        .def_property_readonly("cycle_count", [](const Environment& env) { return env.gb->cycle_count; })
+        .def_property_readonly("footprint", [](const Environment& env) {
+            const Footprint footprint = env.gb->footprint();
+            return py::make_tuple(footprint.instance, footprint.shared);
+        }, "(bytes owned by this instance, bytes of ROM shared with other instances of it)")
+        .def_property_readonly("memory", [](const py::object& self) {
+            Environment& env = self.cast<Environment&>();
+            return view(self, env.gb->memory.at(0x8000), { static_cast<py::ssize_t>(env.gb->memory.bytes.size()) });
+        }, "0x8000-0xFFFF as the CPU last left it (index with address - 0x8000), writable (such writes are not seen by fork_from)")
+        .def_property_readonly("ram", [](const py::object& self) {
+            Environment& env = self.cast<Environment&>();
+            return view(self, env.gb->ram_banks.data(), { static_cast<py::ssize_t>(env.gb->ram_banks.size()) });
+        }, "cartridge RAM, all banks")
+        .def_property_readonly("frame", [](const py::object& self) {
+            Environment& env = self.cast<Environment&>();
+            env.gb->allocate_framebuffers();
+            env.gb->acquire_frame();
+            return view(self, reinterpret_cast<u8*>(env.gb->framebuffer_front_pixels), { SCREEN_HEIGHT, SCREEN_WIDTH, 4 });
+        }, "latest RGBA frame (144, 160, 4), the view stays valid until frame is read again")
+        .def_property_readonly("pixels", [](const py::object& self) {
+            Environment& env = self.cast<Environment&>();
+            if (env.gb->pixel_format != PixelFormat::index2 && env.gb->pixel_format != PixelFormat::gray8) {
+                throw py::value_error("set_pixel_format('index2') or ('gray8') first");
+            }
+            const py::ssize_t row_bytes = env.gb->pixel_format == PixelFormat::index2 ? SCREEN_WIDTH / 4 : SCREEN_WIDTH;
+            return view(self, env.pixel_buffer.data(), { SCREEN_HEIGHT, row_bytes });
+        }, "index2 (144, 40) or gray8 (144, 160) pixels, updated in place by step");
+}
@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <type_traits>
+
+#include "gameboy.h"
+#include "save_state.h"
+
+namespace {
+
+struct StateSaver {
+    static constexpr bool battery = true;
+    SaveState& state;
+
+    template <typename T>
+    void operator()(const T& value) { state.put(value); }
+    void bytes(const void* source, size_t size) { state.put_bytes(source, size); }
+    void pages(const void* source, size_t size) { state.put_bytes(source, size); }
+    void apu(const Apu& apu) { apu.save_state(state); }
+};
+
+struct StateLoader {
+    static constexpr bool battery = true;
+    SaveStateReader& reader;
+
+    template <typename T>
+    void operator()(T& value) { reader.get(value); }
+    void bytes(void* destination, size_t size) { reader.get_bytes(destination, size); }
+    void pages(void* destination, size_t size) { reader.get_bytes(destination, size); }
+    void apu(Apu& apu) { apu.load_state(reader); }
+};
+
+// fork_from copies the page tracked memory itself, only what changed since the last fork
+struct ForkSaver : StateSaver {
+    void pages(const void*, size_t) { }
+};
+
+struct ForkLoader : StateLoader {
+    void pages(void*, size_t) { }
+};
+
+// a new instance starting from the post-boot snapshot keeps the RAM and clock of its own cartridge
+struct BootSaver : StateSaver {
+    static constexpr bool battery = false;
+};
+
+struct BootLoader : StateLoader {
+    static constexpr bool battery = false;
+};
+
+}
+
+// the single list of fields that make up a save state, shared by save_state and load_state.
+// pointers are stored as offsets or rebuilt from the bank numbers after loading. run-ahead
+// saves and loads a state every frame, so nothing is stored that cannot change: the ROM area
+// of memory, CGB banks on a DMG and back buffer lines the PPU has not drawn yet. pages() marks
+// the memory fork_from tracks per STATE_PAGE_SIZE page, the tile cache is derived from VRAM
+template <typename Self, typename Visitor>
+void Gameboy::visit_state(Self& gb, Visitor& visit)
+{
+    visit(gb.AF);
+    visit(gb.BC);
+    visit(gb.DE);
+    visit(gb.HL);
+    visit(gb.SP);
+    visit(gb.PC);
+    visit(gb.ime);
+    visit(gb.ime_scheduled);
+    visit(gb.halted);
+    visit(gb.halt_bug);
+    visit(gb.boot_rom_mapped);
+    visit(gb.cycle_count);
+    visit(gb.frame_cycle);
+    visit(gb.timer_counter);
+    visit(gb.divider_counter);
+    visit(gb.dma_stall_cycles);
+    visit(gb.joypad_state);
+
+    visit(gb.scanline_counter);
+    visit(gb.ppu_cycle);
+    visit(gb.ppu_mode);
+    visit(gb.window_line_counter);
+    visit(gb.scanline_rendered);
+    visit(gb.scanline_sprite_count);
+    visit(gb.scanline_sprites);
+    visit(gb.palette_cache);
+    visit.pages(gb.tile_cache.data(), gb.tile_cache.size() * sizeof(gb.tile_cache[0]));
+    visit(gb.sprite_line_stamp);
+    visit(gb.sprite_line_data);
+    visit(gb.sprite_line_stamp_value);
+
+    visit.pages(gb.memory.at(0x8000), 0x7000); // writes below 0x8000 go to the mapper
+    visit.bytes(gb.memory.at(0xF000), 0x1000); // IO, OAM and HRAM are written all over the core, never tracked
+
+    // an instance without RGBA output has no back buffer, the line count says what follows
+    u8 back_buffer_lines = gb.framebuffers ? static_cast<u8>(gb.drawn_lines()) : 0;
+    visit(back_buffer_lines);
+    if constexpr (!std::is_const_v<Self>) {
+        if (back_buffer_lines > SCREEN_HEIGHT) {
+            return; // corrupt, the loader reports the bytes left over
+        }
+        if (back_buffer_lines) {
+            gb.allocate_framebuffers();
+        }
+    }
+    visit.bytes(gb.framebuffer_back_pixels, back_buffer_lines * SCREEN_WIDTH * sizeof(u32));
+    visit(gb.current_rom_bank);
+    visit(gb.current_ram_bank);
+    visit(gb.bank_register_low);
+    visit(gb.bank_register_high);
+    visit(gb.ram_enabled);
+    visit(gb.rom_banking);
+    visit(gb.rumble_active);
+    visit(gb.rtc_selected_register);
+    visit(gb.rtc_latch_previous_value);
+    visit(gb.rtc_latch_active);
+    if constexpr (Visitor::battery) {
+        visit.pages(gb.ram_banks.data(), gb.ram_banks.size());
+        visit(gb.ram_dirty);
+        visit(gb.save_flush_timer);
+        visit(gb.rtc_registers);
+        visit(gb.rtc_latched_registers);
+        visit(gb.rtc_last_sync_cycle);
+        visit(gb.rtc_subsecond_cycles);
+    }
+
+    visit(gb.vram_bank);
+    visit(gb.wram_bank);
+    if (gb.cgb_mode) {
+        visit(gb.double_speed);
+        visit.pages(gb.vram_bank1.data(), gb.vram_bank1.size());
+        visit.pages(gb.wram_banks.data(), gb.wram_banks.size());
+        visit(gb.bg_palette_ram);
+        visit(gb.obj_palette_ram);
+        visit(gb.cgb_bg_palette_cache);
+        visit(gb.cgb_obj_palette_cache);
+        visit(gb.hdma_source);
+        visit(gb.hdma_destination);
+        visit(gb.hdma_blocks_left);
+        visit(gb.hdma_active);
+    }
+
+    visit.apu(gb.apu);
+
+    visit(gb.serial_transfer_deadline);
+    visit(gb.serial_poll_cycle);
+    visit(gb.serial_next_event);
+}
+
+void Gameboy::save_state(SaveState& state) const
+{
+    write_state(state, StateScope::full);
+}
+
+bool Gameboy::load_state(const SaveState& state)
+{
+    if (!read_state(state, StateScope::full)) {
+        return false;
+    }
+    for (size_t page = 0; page < page_stamps.size(); ++page) {
+        mark_page(page); // the next fork from this instance has to copy everything
+    }
+    return true;
+}
+
+// load_state for the start of an episode: what lives outside the state is also put back the way
+// a new instance has it, no run-ahead pictures still hidden and no buttons held
+bool Gameboy::reset_to_state(const SaveState& state)
+{
+    if (!load_state(state)) {
+        return false;
+    }
+    hidden_pictures = 0;
+    input_buttons.store(0xFF, std::memory_order_relaxed);
+    return true;
+}
+
+void Gameboy::write_state(SaveState& state, StateScope scope) const
+{
+    state.data.clear();
+    state.put(SAVE_STATE_MAGIC);
+    state.put(SAVE_STATE_VERSION);
+    state.put(static_cast<u64>(cartridge.size()));
+    state.put(cgb_mode);
+
+    // mapped ROM banks are stored relative to the memory they point into, the boot ROM overlay
+    // always covers bank 0
+    const u8* rom_base = cartridge.data();
+    state.put(static_cast<u64>(boot_rom_mapped ? 0 : rom_bank0_ptr - rom_base));
+    state.put(static_cast<u64>(current_rom_bank_ptr - rom_base));
+
+    if (scope == StateScope::full) {
+        StateSaver saver { state };
+        visit_state(*this, saver);
+    } else if (scope == StateScope::fork) {
+        ForkSaver saver { { state } };
+        visit_state(*this, saver);
+    } else {
+        BootSaver saver { { state } };
+        visit_state(*this, saver);
+    }
+}
+
+bool Gameboy::read_state(const SaveState& state, StateScope scope)
+{
+    SaveStateReader reader { state };
+    u32 magic = 0;
+    u32 version = 0;
+    u64 cartridge_size = 0;
+    bool state_cgb_mode = false;
+    reader.get(magic);
+    reader.get(version);
+    reader.get(cartridge_size);
+    reader.get(state_cgb_mode);
+    if (!reader.ok || magic != SAVE_STATE_MAGIC || version != SAVE_STATE_VERSION || cartridge_size != cartridge.size() || state_cgb_mode != cgb_mode) {
+        std::cerr << "Save state does not belong to this ROM or emulator version" << std::endl;
+        return false;
+    }
+
+    u64 rom_bank0_offset = 0;
+    u64 rom_bank_offset = 0;
+    reader.get(rom_bank0_offset);
+    reader.get(rom_bank_offset);
+
+    // everything is overwritten in place, a state cut short leaves the instance inconsistent
+    if (scope == StateScope::full) {
+        StateLoader loader { reader };
+        visit_state(*this, loader);
+    } else if (scope == StateScope::fork) {
+        ForkLoader loader { { reader } };
+        visit_state(*this, loader);
+    } else {
+        BootLoader loader { { reader } };
+        visit_state(*this, loader);
+    }
+    if (!reader.ok || reader.offset != state.data.size()) {
+        std::cerr << "Save state is truncated or corrupt" << std::endl;
+        return false;
+    }
+    if (boot_rom_mapped && !boot_image) {
+        std::cerr << "Save state was taken while the boot ROM ran, load a boot ROM first" << std::endl;
+        boot_rom_mapped = false;
+        return false;
+    }
+
+    const u8* rom_base = cartridge.data();
+    rom_bank0_ptr = boot_rom_mapped ? boot_image->bank0.data() : rom_base + rom_bank0_offset;
+    current_rom_bank_ptr = rom_base + rom_bank_offset;
+    update_ram_mapping();
+    set_vram_bank(vram_bank);
+    set_wram_bank(wram_bank);
+    return true;
+}
+
+// a new instance of the same ROM in the state of this one, for tree search and the like.
+// battery RAM of the child stays in memory, a fork never writes the save file
+std::unique_ptr<Gameboy> Gameboy::fork() const
+{
+    auto child = std::make_unique<Gameboy>(std::string(rom_path), false);
+    child->fork_from(*this);
+    return child;
+}
+
+// turns this instance into a copy of parent. the registers and everything else small go through
+// a save state without the pages, of the pages only those written by either side since this
+// instance was last forked from parent are copied, so re-forking a search node from the same
+// root after a few frames copies a handful of 4KB pages instead of the whole machine
+bool Gameboy::fork_from(const Gameboy& parent)
+{
+    if (&parent == this) {
+        return true;
+    }
+    boot_image = parent.boot_image; // resets and states taken while booting need the same boot ROM
+    parent.write_state(fork_state, StateScope::fork);
+    if (!read_state(fork_state, StateScope::fork)) {
+        return false;
+    }
+
+    const bool full_copy = fork_parent_id != parent.instance_id;
+    const auto copy = [&](const u8* source, u8* destination, size_t page, size_t offset, size_t size) {
+        if (full_copy || page_stamps[page] > fork_clock || parent.page_stamps[page] > fork_parent_clock) {
+            std::memcpy(destination + offset, source + offset, size);
+            mark_page(page); // a later fork from this instance has to see the page changed
+            return true;
+        }
+        return false;
+    };
+    const auto copy_tile_rows = [&](size_t first_row, size_t rows) {
+        std::memcpy(&tile_cache[first_row], &parent.tile_cache[first_row], rows * sizeof(tile_cache[0]));
+    };
+
+    for (size_t page = 0; page < MEMORY_PAGES; ++page) {
+        if (copy(parent.memory.at(0x8000), memory.at(0x8000), page, page * STATE_PAGE_SIZE, STATE_PAGE_SIZE) && page < 2) {
+            copy_tile_rows(page * 2048, page == 0 ? 2048 : VRAM_TILE_ROWS - 2048); // rows of 0x8000-0x97FF, two bytes each
+        }
+    }
+    if (cgb_mode) {
+        for (size_t page = 0; page < 2; ++page) {
+            if (copy(parent.vram_bank1.data(), vram_bank1.data(), VRAM1_FIRST_PAGE + page, page * STATE_PAGE_SIZE, STATE_PAGE_SIZE)) {
+                copy_tile_rows(VRAM_TILE_ROWS + page * 2048, page == 0 ? 2048 : VRAM_TILE_ROWS - 2048);
+            }
+        }
+        for (size_t page = 0; page < wram_banks.size() / STATE_PAGE_SIZE; ++page) {
+            copy(parent.wram_banks.data(), wram_banks.data(), WRAM_FIRST_PAGE + page, page * STATE_PAGE_SIZE, STATE_PAGE_SIZE);
+        }
+    }
+    for (size_t offset = 0; offset < ram_banks.size(); offset += STATE_PAGE_SIZE) {
+        copy(parent.ram_banks.data(), ram_banks.data(), CART_RAM_FIRST_PAGE + offset / STATE_PAGE_SIZE, offset, std::min(STATE_PAGE_SIZE, ram_banks.size() - offset));
+    }
+
+    // from here on writes of either side are newer than the clocks recorded. several threads may
+    // fork from the same parent at once, each of them gets its own tick of the parent's clock
+    fork_parent_id = parent.instance_id;
+    fork_parent_clock = parent.write_clock.fetch_add(1, std::memory_order_relaxed);
+    fork_clock = write_clock.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// runs the real frame, then `frames` more with the same input and only presents the last one,
+// which hides that many frames of the game's own input lag. the extra frames are rolled back
+// afterwards, so they run with the APU muted and without save flushes, and pictures that are never
+// shown are not drawn
+void Gameboy::run_one_frame_ahead(u32 frames)
+{
+    if (frames == 0 || serial_link) {
+        run_one_frame(); // a peer on the link cable cannot be rolled back
+        return;
+    }
+
+    hidden_pictures = frames;
+    run_one_frame();
+    save_state(run_ahead_state);
+
+    apu.set_muted(true, cycle_count); // the rollback drops this audio anyway
+    speculating = true;
+    for (u32 i = 0; i < frames; ++i) {
+        run_one_frame();
+    }
+
+    speculating = false;
+    hidden_pictures = 0;
+    load_state(run_ahead_state);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <type_traits>
+#include <vector>
+
+#include "types.h"
+
+constexpr u32 SAVE_STATE_MAGIC = 0x53534247; // "GBSS"
+constexpr u32 SAVE_STATE_VERSION = 3;
+
+// in-memory snapshot of everything that changes while a ROM runs (CPU, memory, PPU, APU, mapper).
+// saving into the same SaveState again reuses its buffer, so repeated snapshots do not allocate
+struct SaveState {
+    std::pmr::vector<u8> data;
+
+    void put_bytes(const void* source, size_t size)
+    {
+        const size_t offset = data.size();
+        data.resize(offset + size);
+        std::memcpy(data.data() + offset, source, size);
+    }
+
+    template <typename T>
+    void put(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        put_bytes(&value, sizeof(T));
+    }
+};
+
+// reads a SaveState back in the order it was written, fails instead of reading past the end
+struct SaveStateReader {
+    const SaveState& state;
+    size_t offset = 0;
+    bool ok = true;
+
+    void get_bytes(void* destination, size_t size)
+    {
+        if (!ok || state.data.size() - offset < size) {
+            ok = false;
+            return;
+        }
+        std::memcpy(destination, state.data.data() + offset, size);
+        offset += size;
+    }
+
+    template <typename T>
+    void get(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        get_bytes(&value, sizeof(T));
+    }
+};
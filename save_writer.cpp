@@ -0,0 +1,177 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "save_writer.h"
+
+namespace fs = std::filesystem;
+
+SaveWriter& SaveWriter::instance()
+{
+    static SaveWriter writer;
+    return writer;
+}
+
+SaveWriter::SaveWriter()
+    : worker(&SaveWriter::run, this)
+{
+}
+
+SaveWriter::~SaveWriter()
+{
+    stopping.store(true, std::memory_order_release);
+    wake_counter.fetch_add(1, std::memory_order_release);
+    wake_counter.notify_one();
+    worker.join();
+}
+
+void SaveWriter::submit(SaveSlot& slot, std::unique_ptr<SaveJob> job)
+{
+    // coalesce: a job the writer has not picked up yet is simply superseded
+    delete slot.pending.exchange(job.release(), std::memory_order_acq_rel);
+
+    if (slot.queued.exchange(true, std::memory_order_acq_rel)) {
+        return; // already queued, the writer will see the new job
+    }
+
+    slot.in_flight.fetch_add(1, std::memory_order_relaxed);
+    SaveSlot* head = queue_head.load(std::memory_order_relaxed);
+    do {
+        slot.next = head;
+    } while (!queue_head.compare_exchange_weak(head, &slot, std::memory_order_release, std::memory_order_relaxed));
+
+    wake_counter.fetch_add(1, std::memory_order_release);
+    wake_counter.notify_one();
+}
+
+void SaveWriter::drain(SaveSlot& slot)
+{
+    while (true) {
+        const u64 seen = progress_counter.load(std::memory_order_acquire);
+        if (slot.in_flight.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+        progress_counter.wait(seen, std::memory_order_acquire);
+    }
+}
+
+void SaveWriter::run()
+{
+    while (true) {
+        const u32 seen = wake_counter.load(std::memory_order_acquire);
+        SaveSlot* slot = queue_head.exchange(nullptr, std::memory_order_acquire);
+
+        if (!slot) {
+            if (stopping.load(std::memory_order_acquire)) {
+                return;
+            }
+            wake_counter.wait(seen, std::memory_order_acquire);
+            continue;
+        }
+
+        if (!stopping.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(SAVE_COALESCE_DELAY);
+        }
+
+        while (slot) {
+            // read the link first, the slot may be pushed again as soon as queued is cleared
+            SaveSlot* next = slot->next;
+            slot->queued.store(false, std::memory_order_release);
+
+            std::unique_ptr<SaveJob> job(slot->pending.exchange(nullptr, std::memory_order_acq_rel));
+            if (job) {
+                run_job(*job);
+            }
+
+            // last access to the slot, its owner may destroy it right after this
+            slot->in_flight.fetch_sub(1, std::memory_order_release);
+            slot = next;
+        }
+
+        progress_counter.fetch_add(1, std::memory_order_release);
+        progress_counter.notify_all();
+    }
+}
+
+void SaveWriter::run_job(const SaveJob& job)
+{
+    if (job.mapping) {
+        if (msync(job.mapping, job.mapping_size, MS_SYNC) != 0) {
+            std::cerr << "Failed to flush save file: " << job.path << " (" << std::strerror(errno) << ")" << std::endl;
+        }
+        return;
+    }
+
+    if (write_file_atomically(job.path, job.snapshot.data(), job.snapshot.size())) {
+        std::cout << "Saved save file: " << job.path << std::endl;
+    }
+}
+
+// writes data to a temporary file next to path and renames it into place,
+// so readers (and crashes) only ever see the old or the new complete file
+bool write_file_atomically(const fs::path& path, const u8* data, size_t size)
+{
+    std::error_code ec;
+    fs::path parent = path.parent_path();
+    if (!parent.empty()) {
+        if (!fs::exists(parent, ec)) {
+            if (ec) {
+                std::cerr << "Failed to access save directory: " << parent << " (" << ec.message() << ")" << std::endl;
+                return false;
+            }
+            ec.clear();
+            if (!fs::create_directories(parent, ec)) {
+                if (ec) {
+                    std::cerr << "Failed to create save directory: " << parent << " (" << ec.message() << ")" << std::endl;
+                    return false;
+                }
+            }
+        } else if (ec) {
+            std::cerr << "Failed to access save directory: " << parent << " (" << ec.message() << ")" << std::endl;
+            return false;
+        }
+    }
+
+    fs::path temp_path = path;
+    temp_path += ".tmp";
+
+    const int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open save file for writing: " << temp_path << " (" << std::strerror(errno) << ")" << std::endl;
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t result = write(fd, data + written, size - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to write save file: " << temp_path << " (" << std::strerror(errno) << ")" << std::endl;
+            close(fd);
+            return false;
+        }
+        written += static_cast<size_t>(result);
+    }
+
+    if (fsync(fd) != 0) {
+        std::cerr << "Failed to flush save file: " << temp_path << " (" << std::strerror(errno) << ")" << std::endl;
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    fs::rename(temp_path, path, ec);
+    if (ec) {
+        std::cerr << "Failed to replace save file: " << path << " (" << ec.message() << ")" << std::endl;
+        return false;
+    }
+
+    return true;
+}
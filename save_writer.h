@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+// how long the writer waits after being woken so bursts of RAM disable writes collapse into one save
+constexpr std::chrono::milliseconds SAVE_COALESCE_DELAY { 50 };
+
+struct SaveJob {
+    std::filesystem::path path; // destination save file
+    std::vector<u8> snapshot; // copy of heap-backed cartridge RAM to write out
+    u8* mapping = nullptr; // mapped save file to msync instead (snapshot unused)
+    size_t mapping_size = 0;
+};
+
+// per-instance mailbox; holds at most one pending job, newer submissions replace older ones
+struct SaveSlot {
+    std::atomic<SaveJob*> pending { nullptr };
+    std::atomic<bool> queued { false }; // whether the slot sits in the writer's queue
+    std::atomic<u32> in_flight { 0 }; // queue entries the writer has not finished with yet
+    SaveSlot* next = nullptr; // intrusive link for the writer's queue
+};
+
+// process-wide save writer, one I/O thread shared by all Gameboy instances
+struct SaveWriter {
+    static SaveWriter& instance();
+
+    SaveWriter();
+    ~SaveWriter();
+    SaveWriter(const SaveWriter&) = delete;
+    SaveWriter& operator=(const SaveWriter&) = delete;
+
+    void submit(SaveSlot& slot, std::unique_ptr<SaveJob> job);
+    void drain(SaveSlot& slot); // blocks until every job submitted to slot has been handled
+
+private:
+    void run();
+    static void run_job(const SaveJob& job);
+
+    std::atomic<SaveSlot*> queue_head { nullptr }; // lock-free stack of slots with pending work
+    std::atomic<u32> wake_counter { 0 };
+    std::atomic<u64> progress_counter { 0 };
+    std::atomic<bool> stopping { false };
+    std::thread worker;
+};
+
+bool write_file_atomically(const std::filesystem::path& path, const u8* data, size_t size);
@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "gameboy.h"
+#include "scaler.h"
+
+constexpr int PADDED_WIDTH = SCREEN_WIDTH + 2 * SCALER_PADDING;
+constexpr int PADDED_HEIGHT = SCREEN_HEIGHT + 2 * SCALER_PADDING;
+constexpr u32 ALPHA_MASK = 0xFF000000;
+
+namespace {
+
+// the filters are written once against these few operations on a group of pixels,
+// masks are pixels with all bits set or clear
+#if defined(__AVX2__)
+struct Pixels {
+    static constexpr int lanes = 8;
+    __m256i v;
+
+    static Pixels load(const u32* source) { return { _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source)) }; }
+    static Pixels splat(u32 value) { return { _mm256_set1_epi32(static_cast<int>(value)) }; }
+    void store(u32* destination) const { _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination), v); }
+
+    friend Pixels operator&(Pixels a, Pixels b) { return { _mm256_and_si256(a.v, b.v) }; }
+    friend Pixels operator|(Pixels a, Pixels b) { return { _mm256_or_si256(a.v, b.v) }; }
+    friend Pixels operator+(Pixels a, Pixels b) { return { _mm256_add_epi32(a.v, b.v) }; }
+    friend Pixels andnot(Pixels a, Pixels b) { return { _mm256_andnot_si256(b.v, a.v) }; } // a & ~b
+    friend Pixels equal(Pixels a, Pixels b) { return { _mm256_cmpeq_epi32(a.v, b.v) }; }
+    friend Pixels less(Pixels a, Pixels b) { return { _mm256_cmpgt_epi32(b.v, a.v) }; }
+    friend Pixels select(Pixels mask, Pixels a, Pixels b) { return { _mm256_blendv_epi8(b.v, a.v, mask.v) }; }
+    friend Pixels average(Pixels a, Pixels b) { return { _mm256_avg_epu8(a.v, b.v) }; }
+    friend Pixels shift_right(Pixels a, int bits) { return { _mm256_srli_epi32(a.v, bits) }; }
+    friend Pixels shift_left(Pixels a, int bits) { return { _mm256_slli_epi32(a.v, bits) }; }
+
+    // weighted sum of the absolute channel differences (2 R + 3 G + 1 B)
+    friend Pixels distance(Pixels a, Pixels b)
+    {
+        const __m256i diff = _mm256_or_si256(_mm256_subs_epu8(a.v, b.v), _mm256_subs_epu8(b.v, a.v));
+        const __m256i pairs = _mm256_maddubs_epi16(diff, _mm256_set1_epi32(0x00010302));
+        return { _mm256_madd_epi16(pairs, _mm256_set1_epi16(1)) };
+    }
+
+    // a0 b0 a1 b1 ... into two groups
+    static void store_interleaved(u32* destination, Pixels a, Pixels b)
+    {
+        const __m256i low = _mm256_unpacklo_epi32(a.v, b.v);
+        const __m256i high = _mm256_unpackhi_epi32(a.v, b.v);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination), _mm256_permute2x128_si256(low, high, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 8), _mm256_permute2x128_si256(low, high, 0x31));
+    }
+
+    // a0 b0 c0 a1 b1 c1 ... into three groups, output lane k takes element k / 3 of input k % 3
+    static void store_interleaved(u32* destination, Pixels a, Pixels b, Pixels c)
+    {
+        const __m256i index0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+        const __m256i index1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+        const __m256i index2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+        const auto group = [&](__m256i index, int from_b, int from_c) {
+            __m256i out = _mm256_permutevar8x32_epi32(a.v, index);
+            out = _mm256_blendv_epi8(out, _mm256_permutevar8x32_epi32(b.v, index), lane_mask(from_b));
+            return _mm256_blendv_epi8(out, _mm256_permutevar8x32_epi32(c.v, index), lane_mask(from_c));
+        };
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination), group(index0, 0b10010010, 0b00100100));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 8), group(index1, 0b00100100, 0b01001001));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 16), group(index2, 0b01001001, 0b10010010));
+    }
+
+    static __m256i lane_mask(int lanes_set)
+    {
+        const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(lanes_set), bits), bits);
+    }
+};
+#else
+struct Pixels {
+    static constexpr int lanes = 1;
+    u32 v;
+
+    static Pixels load(const u32* source) { return { *source }; }
+    static Pixels splat(u32 value) { return { value }; }
+    void store(u32* destination) const { *destination = v; }
+
+    friend Pixels operator&(Pixels a, Pixels b) { return { a.v & b.v }; }
+    friend Pixels operator|(Pixels a, Pixels b) { return { a.v | b.v }; }
+    friend Pixels operator+(Pixels a, Pixels b) { return { a.v + b.v }; }
+    friend Pixels andnot(Pixels a, Pixels b) { return { a.v & ~b.v }; }
+    friend Pixels equal(Pixels a, Pixels b) { return { a.v == b.v ? ~0u : 0u }; }
+    friend Pixels less(Pixels a, Pixels b) { return { a.v < b.v ? ~0u : 0u }; }
+    friend Pixels select(Pixels mask, Pixels a, Pixels b) { return { mask.v ? a.v : b.v }; }
+    friend Pixels shift_right(Pixels a, int bits) { return { a.v >> bits }; }
+    friend Pixels shift_left(Pixels a, int bits) { return { a.v << bits }; }
+
+    friend Pixels average(Pixels a, Pixels b)
+    {
+        // per byte (a + b + 1) / 2 like the SIMD version
+        return { (a.v | b.v) - (((a.v ^ b.v) >> 1) & 0x7F7F7F7F) };
+    }
+
+    friend Pixels distance(Pixels a, Pixels b)
+    {
+        u32 sum = 0;
+        constexpr int weights[3] = { 2, 3, 1 };
+        for (int channel = 0; channel < 3; ++channel) {
+            const int shift = channel * 8;
+            const int delta = static_cast<int>((a.v >> shift) & 0xFF) - static_cast<int>((b.v >> shift) & 0xFF);
+            sum += static_cast<u32>(weights[channel] * std::abs(delta));
+        }
+        return { sum };
+    }
+
+    static void store_interleaved(u32* destination, Pixels a, Pixels b)
+    {
+        destination[0] = a.v;
+        destination[1] = b.v;
+    }
+
+    static void store_interleaved(u32* destination, Pixels a, Pixels b, Pixels c)
+    {
+        destination[0] = a.v;
+        destination[1] = b.v;
+        destination[2] = c.v;
+    }
+};
+#endif
+
+Pixels not_equal(Pixels a, Pixels b)
+{
+    return andnot(Pixels::splat(~0u), equal(a, b));
+}
+
+// each channel at 3/4 brightness, alpha kept
+Pixels darken(Pixels p)
+{
+    const Pixels half = shift_right(p, 1) & Pixels::splat(0x7F7F7F7F);
+    const Pixels quarter = shift_right(p, 2) & Pixels::splat(0x3F3F3F3F);
+    return (half + quarter) | (p & Pixels::splat(ALPHA_MASK));
+}
+
+// one xbr output corner; sx and sy mirror the neighbourhood so the rule is written for the bottom right
+Pixels xbr_corner(const u32* e, int sx, int sy)
+{
+    const auto at = [&](int x, int y) { return Pixels::load(e + y * sy * PADDED_WIDTH + x * sx); };
+    const Pixels E = at(0, 0), B = at(0, -1), C = at(1, -1), D = at(-1, 0), F = at(1, 0), F4 = at(2, 0);
+    const Pixels G = at(-1, 1), H = at(0, 1), I = at(1, 1), I4 = at(2, 1), H5 = at(0, 2), I5 = at(1, 2);
+
+    // edge along H-F when the pixels across it differ less than the pixels along the diagonal E-I
+    const Pixels across = distance(E, C) + distance(E, G) + distance(I, F4) + distance(I, H5) + shift_left(distance(H, F), 2);
+    const Pixels along = distance(H, D) + distance(H, I5) + distance(F, I4) + distance(F, B) + shift_left(distance(E, I), 2);
+    const Pixels edge = less(across, along) & not_equal(E, F) & not_equal(E, H);
+
+    const Pixels closer = select(less(distance(E, H), distance(E, F)), H, F);
+    return select(edge, average(E, closer), E);
+}
+
+}
+
+bool Scaler::parse(std::string_view spec, ScaleFilter& parsed_filter, int& parsed_scale)
+{
+    const size_t colon = spec.find(':');
+    const std::string_view name = spec.substr(0, colon);
+    parsed_scale = 0;
+    if (colon != std::string_view::npos) {
+        const std::string_view digits = spec.substr(colon + 1);
+        const auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), parsed_scale);
+        if (error != std::errc() || end != digits.data() + digits.size()) {
+            std::cerr << "Invalid scale factor: " << spec << std::endl;
+            return false;
+        }
+    }
+
+    if (name == "nearest") {
+        parsed_filter = ScaleFilter::nearest;
+    } else if (name == "scale2x") {
+        parsed_filter = ScaleFilter::scale2x;
+    } else if (name == "scale3x") {
+        parsed_filter = ScaleFilter::scale3x;
+    } else if (name == "xbr") {
+        parsed_filter = ScaleFilter::xbr;
+    } else if (name == "lcd") {
+        parsed_filter = ScaleFilter::lcd;
+    } else {
+        std::cerr << "Unknown scale filter: " << name << " (nearest, scale2x, scale3x, xbr, lcd)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// scale 0 picks the filter's own factor, or SCREEN_SCALE for the ones that take any
+bool Scaler::configure(ScaleFilter new_filter, int new_scale)
+{
+    int native = 0;
+    switch (new_filter) {
+    case ScaleFilter::scale2x:
+    case ScaleFilter::xbr:
+        native = 2;
+        break;
+    case ScaleFilter::scale3x:
+        native = 3;
+        break;
+    default:
+        break;
+    }
+
+    if (new_scale == 0) {
+        new_scale = native ? native : SCREEN_SCALE;
+    }
+    if ((native && new_scale != native) || new_scale < 1 || new_scale > SCALER_MAX_SCALE
+        || (new_filter == ScaleFilter::lcd && new_scale < 2)) {
+        std::cerr << "Unsupported scale factor " << new_scale << " for this filter" << std::endl;
+        return false;
+    }
+
+    filter = new_filter;
+    scale = new_scale;
+    output_width = SCREEN_WIDTH * scale;
+    output_height = SCREEN_HEIGHT * scale;
+    output.assign(static_cast<size_t>(output_width) * output_height, 0);
+    padded.assign(static_cast<size_t>(PADDED_WIDTH) * PADDED_HEIGHT, 0);
+    ghost.clear();
+
+    expand_index.resize(output_width);
+    grid_mask.resize(output_width);
+    for (int x = 0; x < output_width; ++x) {
+        expand_index[x] = static_cast<u32>(x / scale);
+        grid_mask[x] = x % scale == scale - 1 ? ~0u : 0u;
+    }
+    return true;
+}
+
+const u32* Scaler::run(const u32* frame)
+{
+    switch (filter) {
+    case ScaleFilter::nearest:
+        run_nearest(frame, false);
+        break;
+    case ScaleFilter::scale2x:
+        pad_source(frame);
+        run_scale2x();
+        break;
+    case ScaleFilter::scale3x:
+        pad_source(frame);
+        run_scale3x();
+        break;
+    case ScaleFilter::xbr:
+        pad_source(frame);
+        run_xbr();
+        break;
+    case ScaleFilter::lcd:
+        run_nearest(frame, true);
+        break;
+    }
+    return output.data();
+}
+
+// the edge rules read neighbours, a border of repeated edge pixels saves bounds checks
+void Scaler::pad_source(const u32* frame)
+{
+    for (int y = 0; y < PADDED_HEIGHT; ++y) {
+        const int source_y = std::clamp(y - SCALER_PADDING, 0, SCREEN_HEIGHT - 1);
+        const u32* source = frame + static_cast<size_t>(source_y) * SCREEN_WIDTH;
+        u32* row = padded.data() + static_cast<size_t>(y) * PADDED_WIDTH;
+        std::fill(row, row + SCALER_PADDING, source[0]);
+        std::memcpy(row + SCALER_PADDING, source, SCREEN_WIDTH * sizeof(u32));
+        std::fill(row + SCALER_PADDING + SCREEN_WIDTH, row + PADDED_WIDTH, source[SCREEN_WIDTH - 1]);
+    }
+}
+
+// widens each source row once and copies it down, the lcd grid darkens the last column and row of every block.
+// ghosting keeps a quarter of the previous frame, like the slow response of the original screen
+void Scaler::run_nearest(const u32* frame, bool lcd_grid)
+{
+    if (lcd_grid) {
+        if (ghost.empty()) {
+            ghost.assign(frame, frame + SCREEN_WIDTH * SCREEN_HEIGHT);
+        }
+        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i += Pixels::lanes) {
+            const Pixels current = Pixels::load(frame + i);
+            average(current, average(current, Pixels::load(ghost.data() + i))).store(ghost.data() + i);
+        }
+        frame = ghost.data();
+    }
+
+    const size_t row_pixels = static_cast<size_t>(output_width);
+    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+        const u32* source = frame + static_cast<size_t>(y) * SCREEN_WIDTH;
+        u32* row = output.data() + static_cast<size_t>(y) * scale * row_pixels;
+
+        for (int x = 0; x < output_width; x += Pixels::lanes) {
+#if defined(__AVX2__)
+            // the 8 output pixels come from at most 8 consecutive source pixels. the load starts no
+            // later than 8 pixels before the row end, reading past the last row would leave the frame
+            const u32 base = std::min<u32>(expand_index[x], SCREEN_WIDTH - Pixels::lanes);
+            const __m256i index = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(expand_index.data() + x)), _mm256_set1_epi32(static_cast<int>(base)));
+            Pixels wide { _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + base)), index) };
+#else
+            Pixels wide = Pixels::load(source + expand_index[x]);
+#endif
+            if (lcd_grid) {
+                wide = select(Pixels::load(grid_mask.data() + x), darken(wide), wide);
+            }
+            wide.store(row + x);
+        }
+
+        const int copies = lcd_grid ? scale - 2 : scale - 1;
+        for (int i = 1; i <= copies; ++i) {
+            std::memcpy(row + i * row_pixels, row, row_pixels * sizeof(u32));
+        }
+        if (lcd_grid) {
+            u32* grid_row = row + (scale - 1) * row_pixels;
+            for (size_t x = 0; x < row_pixels; x += Pixels::lanes) {
+                darken(Pixels::load(row + x)).store(grid_row + x);
+            }
+        }
+    }
+}
+
+// AdvMAME2x: a corner takes the neighbour colour when the two neighbours
+// next to it match and the two on the opposite sides do not
+void Scaler::run_scale2x()
+{
+    const size_t row_pixels = static_cast<size_t>(output_width);
+    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+        const u32* center = padded.data() + static_cast<size_t>(y + SCALER_PADDING) * PADDED_WIDTH + SCALER_PADDING;
+        u32* top = output.data() + static_cast<size_t>(y) * 2 * row_pixels;
+        u32* bottom = top + row_pixels;
+
+        for (int x = 0; x < SCREEN_WIDTH; x += Pixels::lanes) {
+            const u32* e = center + x;
+            const Pixels B = Pixels::load(e - PADDED_WIDTH), D = Pixels::load(e - 1), E = Pixels::load(e);
+            const Pixels F = Pixels::load(e + 1), H = Pixels::load(e + PADDED_WIDTH);
+            const Pixels bd = equal(B, D), bf = equal(B, F), dh = equal(D, H), fh = equal(F, H);
+
+            const Pixels e0 = select(andnot(bd, bf | dh), D, E);
+            const Pixels e1 = select(andnot(bf, bd | fh), F, E);
+            const Pixels e2 = select(andnot(dh, bd | fh), D, E);
+            const Pixels e3 = select(andnot(fh, dh | bf), F, E);
+            Pixels::store_interleaved(top + 2 * x, e0, e1);
+            Pixels::store_interleaved(bottom + 2 * x, e2, e3);
+        }
+    }
+}
+
+// AdvMAME3x, the edge centres additionally check the corner pixels so lines stay one pixel wide
+void Scaler::run_scale3x()
+{
+    const size_t row_pixels = static_cast<size_t>(output_width);
+    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+        const u32* center = padded.data() + static_cast<size_t>(y + SCALER_PADDING) * PADDED_WIDTH + SCALER_PADDING;
+        u32* row0 = output.data() + static_cast<size_t>(y) * 3 * row_pixels;
+        u32* row1 = row0 + row_pixels;
+        u32* row2 = row1 + row_pixels;
+
+        for (int x = 0; x < SCREEN_WIDTH; x += Pixels::lanes) {
+            const u32* e = center + x;
+            const Pixels A = Pixels::load(e - PADDED_WIDTH - 1), B = Pixels::load(e - PADDED_WIDTH), C = Pixels::load(e - PADDED_WIDTH + 1);
+            const Pixels D = Pixels::load(e - 1), E = Pixels::load(e), F = Pixels::load(e + 1);
+            const Pixels G = Pixels::load(e + PADDED_WIDTH - 1), H = Pixels::load(e + PADDED_WIDTH), I = Pixels::load(e + PADDED_WIDTH + 1);
+            const Pixels bd = equal(B, D), bf = equal(B, F), dh = equal(D, H), fh = equal(F, H);
+
+            // the four corner conditions of scale2x
+            const Pixels top_left = andnot(bd, bf | dh);
+            const Pixels top_right = andnot(bf, bd | fh);
+            const Pixels bottom_left = andnot(dh, bd | fh);
+            const Pixels bottom_right = andnot(fh, dh | bf);
+
+            const Pixels e0 = select(top_left, D, E);
+            const Pixels e1 = select((top_left & not_equal(E, C)) | (top_right & not_equal(E, A)), B, E);
+            const Pixels e2 = select(top_right, F, E);
+            const Pixels e3 = select((top_left & not_equal(E, G)) | (bottom_left & not_equal(E, A)), D, E);
+            const Pixels e5 = select((top_right & not_equal(E, I)) | (bottom_right & not_equal(E, C)), F, E);
+            const Pixels e6 = select(bottom_left, D, E);
+            const Pixels e7 = select((bottom_left & not_equal(E, I)) | (bottom_right & not_equal(E, G)), H, E);
+            const Pixels e8 = select(bottom_right, F, E);
+            Pixels::store_interleaved(row0 + 3 * x, e0, e1, e2);
+            Pixels::store_interleaved(row1 + 3 * x, e3, E, e5);
+            Pixels::store_interleaved(row2 + 3 * x, e6, e7, e8);
+        }
+    }
+}
+
+void Scaler::run_xbr()
+{
+    const size_t row_pixels = static_cast<size_t>(output_width);
+    for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+        const u32* center = padded.data() + static_cast<size_t>(y + SCALER_PADDING) * PADDED_WIDTH + SCALER_PADDING;
+        u32* top = output.data() + static_cast<size_t>(y) * 2 * row_pixels;
+        u32* bottom = top + row_pixels;
+
+        for (int x = 0; x < SCREEN_WIDTH; x += Pixels::lanes) {
+            const u32* e = center + x;
+            Pixels::store_interleaved(top + 2 * x, xbr_corner(e, -1, -1), xbr_corner(e, 1, -1));
+            Pixels::store_interleaved(bottom + 2 * x, xbr_corner(e, -1, 1), xbr_corner(e, 1, 1));
+        }
+    }
+}
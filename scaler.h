@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+
+constexpr int SCALER_MAX_SCALE = 8;
+constexpr int SCALER_PADDING = 2; // repeated edge pixels around the source, xbr looks two pixels out
+
+enum class ScaleFilter {
+    nearest, // integer nearest neighbour, any factor
+    scale2x, // AdvMAME2x edge rules
+    scale3x, // AdvMAME3x edge rules
+    xbr, // 2x, xBR-style edge weights, corners blended towards the dominant edge
+    lcd, // nearest with a darkened pixel grid and ghosting of the previous frame, factor 2 and up
+};
+
+// upscales SCREEN_WIDTH x SCREEN_HEIGHT RGBA frames (the layout of Gameboy::framebuffers) on the CPU,
+// 8 pixels at a time with AVX2 and one at a time otherwise, e.g. for capturing without a GPU
+struct Scaler {
+    ScaleFilter filter = ScaleFilter::nearest;
+    int scale = 1;
+    int output_width = 0;
+    int output_height = 0;
+    std::vector<u32> output;
+    std::vector<u32> padded; // source with SCALER_PADDING repeated edge pixels on every side
+    std::vector<u32> ghost; // lcd: last displayed frame at source resolution
+    std::vector<u32> expand_index; // nearest/lcd: source column for every output column
+    std::vector<u32> grid_mask; // lcd: all ones on output columns that fall on the pixel grid
+
+    static bool parse(std::string_view spec, ScaleFilter& filter, int& scale); // "nearest:5", "xbr", "lcd:4"
+
+    bool configure(ScaleFilter new_filter, int new_scale);
+    const u32* run(const u32* frame); // returns output_width x output_height pixels in output
+
+private:
+    void pad_source(const u32* frame);
+    void run_nearest(const u32* frame, bool lcd_grid);
+    void run_scale2x();
+    void run_scale3x();
+    void run_xbr();
+};
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gameboy.h"
+#include "serial.h"
+
+namespace fs = std::filesystem;
+
+// socket messages are two bytes, a type and the shifted byte
+constexpr u8 LINK_MSG_TRANSFER = 'T'; // the peer clocked a transfer, answer with our byte
+constexpr u8 LINK_MSG_REPLY = 'R'; // answer to our own transfer
+
+u8 SerialCapture::transfer(Gameboy& gb, u8 outgoing)
+{
+    (void)gb;
+    output.push_back(static_cast<char>(outgoing));
+    return 0xFF; // nothing on the other end, the line stays high
+}
+
+u8 LinkCable::End::transfer(Gameboy& gb, u8 outgoing)
+{
+    (void)gb;
+    return peer->serial_receive(outgoing);
+}
+
+LinkCable::LinkCable(Gameboy& a, Gameboy& b)
+    : first(a)
+    , second(b)
+{
+    first_end.peer = &second;
+    second_end.peer = &first;
+    first.set_serial_link(&first_end);
+    second.set_serial_link(&second_end);
+}
+
+LinkCable::~LinkCable()
+{
+    first.set_serial_link(nullptr);
+    second.set_serial_link(nullptr);
+}
+
+u32 LinkCable::quantum() const
+{
+    return std::min(first.serial_min_transfer_cycles(), second.serial_min_transfer_cycles());
+}
+
+// runs both sides in slices no longer than the shortest possible transfer, so a transfer started
+// in one slice always completes at a slice boundary where both sides have reached its deadline.
+// instructions overshoot the slice end, so a slice starts where the side behind is and the side
+// ahead sits it out until the other one caught up
+void LinkCable::run_until(u64 target_cycle)
+{
+    while (std::min(first.cycle_count, second.cycle_count) < target_cycle) {
+        complete_transfers();
+        const u64 now = std::min(first.cycle_count, second.cycle_count);
+        const u64 next = std::min({ target_cycle, now + quantum(), first.serial_transfer_deadline, second.serial_transfer_deadline });
+        first.run_until(next);
+        second.run_until(next);
+    }
+    complete_transfers();
+}
+
+void LinkCable::run_frames(size_t frames)
+{
+    for (size_t i = 0; i < frames; ++i) {
+        first.update_inputs();
+        second.update_inputs();
+        run_until(first.cycle_count + (CYCLES_PER_FRAME - first.frame_cycle));
+    }
+}
+
+// exchanges bytes for transfers that are due while both sides are stopped
+void LinkCable::complete_transfers()
+{
+    if (first.cycle_count >= first.serial_transfer_deadline) {
+        first.serial_complete();
+    }
+    if (second.cycle_count >= second.serial_transfer_deadline) {
+        second.serial_complete();
+    }
+}
+
+// spins briefly since slices are short, then sleeps until counter moves away from seen
+static u32 wait_for_change(const std::atomic<u32>& counter, u32 seen)
+{
+    for (int i = 0; i < LINK_SPIN_ITERATIONS; ++i) {
+        const u32 value = counter.load(std::memory_order_acquire);
+        if (value != seen) {
+            return value;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    counter.wait(seen, std::memory_order_acquire);
+    return counter.load(std::memory_order_acquire);
+}
+
+LinkScheduler::LinkScheduler(LinkCable& link_cable, bool threaded)
+    : cable(link_cable)
+    , parallel(threaded)
+{
+    if (parallel) {
+        worker = std::thread(&LinkScheduler::run_worker, this);
+    }
+}
+
+LinkScheduler::~LinkScheduler()
+{
+    if (!parallel) {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    slice_started.fetch_add(1, std::memory_order_release);
+    slice_started.notify_one();
+    worker.join();
+}
+
+// same slicing as LinkCable::run_until, with the second side running concurrently
+void LinkScheduler::run_until(u64 target_cycle)
+{
+    // the quantum only shrinks when a CGB side switches to double speed, it is small already then
+    if (!parallel || cable.quantum() < LINK_PARALLEL_MIN_QUANTUM) {
+        cable.run_until(target_cycle);
+        return;
+    }
+
+    Gameboy& first = cable.first;
+    Gameboy& second = cable.second;
+
+    while (std::min(first.cycle_count, second.cycle_count) < target_cycle) {
+        // the worker is parked here, both sides can be touched
+        cable.complete_transfers();
+        const u64 now = std::min(first.cycle_count, second.cycle_count); // see LinkCable::run_until
+        const u64 slice = std::min(target_cycle, now + cable.quantum());
+        const u64 next = std::min({ slice, first.serial_transfer_deadline, second.serial_transfer_deadline });
+        if (next < slice) {
+            transfer_stalls++;
+        }
+        slices++;
+
+        slice_end.store(next, std::memory_order_relaxed);
+        const u32 started = slice_started.fetch_add(1, std::memory_order_release) + 1;
+        slice_started.notify_one();
+
+        first.run_until(next);
+
+        u32 finished = slice_finished.load(std::memory_order_acquire);
+        while (finished != started) {
+            finished = wait_for_change(slice_finished, finished);
+        }
+    }
+    cable.complete_transfers();
+}
+
+void LinkScheduler::run_frames(size_t frames)
+{
+    for (size_t i = 0; i < frames; ++i) {
+        cable.first.update_inputs();
+        cable.second.update_inputs();
+        run_until(cable.first.cycle_count + (CYCLES_PER_FRAME - cable.first.frame_cycle));
+    }
+}
+
+void LinkScheduler::run_worker()
+{
+    u32 seen = 0;
+    while (true) {
+        seen = wait_for_change(slice_started, seen);
+        if (stopping.load(std::memory_order_acquire)) {
+            return;
+        }
+
+        cable.second.run_until(slice_end.load(std::memory_order_relaxed));
+
+        slice_finished.store(seen, std::memory_order_release);
+        slice_finished.notify_one();
+    }
+}
+
+std::unique_ptr<UnixSocketLink> UnixSocketLink::listen(const fs::path& path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(address.sun_path)) {
+        std::cerr << "Link socket path too long: " << path << std::endl;
+        return nullptr;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    const int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        std::cerr << "Failed to create link socket (" << std::strerror(errno) << ")" << std::endl;
+        return nullptr;
+    }
+
+    unlink(path.c_str());
+    if (bind(server, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(server, 1) != 0) {
+        std::cerr << "Failed to listen on link socket: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        close(server);
+        return nullptr;
+    }
+
+    std::cout << "Waiting for link peer on " << path << std::endl;
+    const int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+    close(server);
+    unlink(path.c_str());
+    if (client < 0) {
+        std::cerr << "Failed to accept link peer (" << std::strerror(errno) << ")" << std::endl;
+        return nullptr;
+    }
+
+    auto link = std::make_unique<UnixSocketLink>();
+    link->fd = client;
+    return link;
+}
+
+std::unique_ptr<UnixSocketLink> UnixSocketLink::connect(const fs::path& path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.native().size() >= sizeof(address.sun_path)) {
+        std::cerr << "Link socket path too long: " << path << std::endl;
+        return nullptr;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+    const int client = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client < 0) {
+        std::cerr << "Failed to create link socket (" << std::strerror(errno) << ")" << std::endl;
+        return nullptr;
+    }
+    if (::connect(client, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Failed to connect to link peer: " << path << " (" << std::strerror(errno) << ")" << std::endl;
+        close(client);
+        return nullptr;
+    }
+
+    auto link = std::make_unique<UnixSocketLink>();
+    link->fd = client;
+    return link;
+}
+
+UnixSocketLink::~UnixSocketLink()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// the peer only answers while it polls, so this blocks until it reaches its next poll
+u8 UnixSocketLink::transfer(Gameboy& gb, u8 outgoing)
+{
+    if (fd < 0 || !send_message(LINK_MSG_TRANSFER, outgoing)) {
+        return 0xFF;
+    }
+
+    while (true) {
+        pollfd request { .fd = fd, .events = POLLIN, .revents = 0 };
+        const int ready = ::poll(&request, 1, SERIAL_REPLY_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return 0xFF; // peer is gone or stuck, behave like an unplugged cable
+        }
+
+        u8 message[2];
+        const ssize_t received = recv(fd, message, sizeof(message), 0);
+        if (received != sizeof(message)) {
+            std::cerr << "Link peer disconnected" << std::endl;
+            close(fd);
+            fd = -1;
+            return 0xFF;
+        }
+
+        if (message[0] == LINK_MSG_REPLY) {
+            return message[1];
+        }
+        if (message[0] == LINK_MSG_TRANSFER) {
+            answer(gb, message[1]); // both sides clocked at once, the peer gets 0xFF from us
+        }
+    }
+}
+
+// handles at most one transfer per call, the ROM needs some cycles to prepare its next byte
+void UnixSocketLink::poll(Gameboy& gb)
+{
+    while (fd >= 0) {
+        u8 message[2];
+        const ssize_t received = recv(fd, message, sizeof(message), MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (received != sizeof(message)) {
+            std::cerr << "Link peer disconnected" << std::endl;
+            close(fd);
+            fd = -1;
+            return;
+        }
+        if (message[0] == LINK_MSG_TRANSFER) {
+            answer(gb, message[1]);
+            return;
+        }
+    }
+}
+
+bool UnixSocketLink::send_message(u8 type, u8 value)
+{
+    const u8 message[2] = { type, value };
+    if (send(fd, message, sizeof(message), MSG_NOSIGNAL) != sizeof(message)) {
+        std::cerr << "Link peer disconnected" << std::endl;
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void UnixSocketLink::answer(Gameboy& gb, u8 incoming)
+{
+    send_message(LINK_MSG_REPLY, gb.serial_receive(incoming));
+}
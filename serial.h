@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "types.h"
+
+constexpr u32 SERIAL_TRANSFER_CYCLES = 4096; // 8 bits at 8192 Hz
+constexpr u32 SERIAL_FAST_TRANSFER_CYCLES = 128; // 8 bits at 262144 Hz (CGB, SC bit 1)
+constexpr u32 SERIAL_POLL_INTERVAL = 512; // cycles between checks for bytes clocked by a remote peer
+constexpr int SERIAL_REPLY_TIMEOUT_MS = 500; // how long a remote master waits for the peer's byte
+constexpr int LINK_SPIN_ITERATIONS = 2048; // polls of a slice counter before sleeping on it
+constexpr u32 LINK_PARALLEL_MIN_QUANTUM = 1024; // shorter slices cost more to hand over than to run
+constexpr u64 SERIAL_NEVER = std::numeric_limits<u64>::max(); // no serial event scheduled
+
+struct Gameboy;
+
+// the other end of the link cable
+struct SerialLink {
+    virtual ~SerialLink() = default;
+
+    // this side drives the clock and its transfer just completed, returns the byte shifted in
+    virtual u8 transfer(Gameboy& gb, u8 outgoing) = 0;
+
+    // links to another process deliver the peer's transfers from here
+    virtual void poll(Gameboy& gb) { (void)gb; }
+    virtual bool needs_poll() const { return false; }
+};
+
+// collects everything the ROM sends, e.g. test ROMs printing their results
+struct SerialCapture : SerialLink {
+    std::string output;
+
+    u8 transfer(Gameboy& gb, u8 outgoing) override;
+};
+
+// connects two instances in the same process; run them with run_frames
+// so that transfers happen with both sides at the same cycle
+struct LinkCable {
+    struct End : SerialLink {
+        Gameboy* peer = nullptr;
+
+        u8 transfer(Gameboy& gb, u8 outgoing) override;
+    };
+
+    Gameboy& first;
+    Gameboy& second;
+    End first_end;
+    End second_end;
+
+    LinkCable(Gameboy& a, Gameboy& b);
+    ~LinkCable();
+    LinkCable(const LinkCable&) = delete;
+    LinkCable& operator=(const LinkCable&) = delete;
+
+    u32 quantum() const; // longest slice both sides can run without a transfer starting and ending inside it
+    void run_until(u64 target_cycle);
+    void run_frames(size_t frames);
+    void complete_transfers();
+};
+
+// runs the two sides of a LinkCable on separate threads: both run a slice of at most
+// LinkCable::quantum() cycles in parallel and only meet at slice boundaries, where due
+// transfers are exchanged; slices are cut short only when a transfer deadline falls inside.
+// with a single hardware thread it falls back to LinkCable::run_until, and so does a CGB pair,
+// whose fast serial clock keeps every slice at 128 cycles or less whether it is used or not
+struct LinkScheduler {
+    LinkCable& cable;
+    bool parallel;
+    alignas(64) std::atomic<u32> slice_started { 0 }; // bumped to hand the worker its next slice
+    alignas(64) std::atomic<u32> slice_finished { 0 }; // set to slice_started once the worker is done
+    std::atomic<u64> slice_end { 0 };
+    std::atomic<bool> stopping { false };
+    u64 slices = 0; // slices run so far
+    u64 transfer_stalls = 0; // slices cut short by a transfer deadline
+    std::thread worker; // runs cable.second, cable.first runs on the calling thread
+
+    explicit LinkScheduler(LinkCable& link_cable, bool threaded = std::thread::hardware_concurrency() > 1);
+    ~LinkScheduler();
+    LinkScheduler(const LinkScheduler&) = delete;
+    LinkScheduler& operator=(const LinkScheduler&) = delete;
+
+    void run_until(u64 target_cycle);
+    void run_frames(size_t frames);
+
+private:
+    void run_worker();
+};
+
+// link to another emulator process over a Unix domain socket
+struct UnixSocketLink : SerialLink {
+    int fd = -1;
+
+    static std::unique_ptr<UnixSocketLink> listen(const std::filesystem::path& path); // waits for one peer
+    static std::unique_ptr<UnixSocketLink> connect(const std::filesystem::path& path);
+
+    UnixSocketLink() = default;
+    UnixSocketLink(const UnixSocketLink&) = delete;
+    UnixSocketLink& operator=(const UnixSocketLink&) = delete;
+    ~UnixSocketLink() override;
+
+    u8 transfer(Gameboy& gb, u8 outgoing) override;
+    void poll(Gameboy& gb) override;
+    bool needs_poll() const override { return fd >= 0; }
+
+private:
+    bool send_message(u8 type, u8 value);
+    void answer(Gameboy& gb, u8 incoming);
+};
@@ -0,0 +1,243 @@
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include "gameboy.h"
+#include "trace.h"
+
+namespace {
+
+u8* put_varint(u8* out, u64 value)
+{
+    while (value >= 0x80) {
+        *out++ = static_cast<u8>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<u8>(value);
+    return out;
+}
+
+const u8* get_varint(const u8* in, const u8* end, u64& value)
+{
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        const u8 byte = *in++;
+        value |= static_cast<u64>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+// PC moves a few bytes forward most of the time and jumps back by small amounts in loops
+u16 zigzag(u16 delta)
+{
+    const i16 value = static_cast<i16>(delta);
+    return static_cast<u16>((static_cast<u16>(value) << 1) ^ static_cast<u16>(value >> 15));
+}
+
+u16 unzigzag(u16 value)
+{
+    return static_cast<u16>((value >> 1) ^ static_cast<u16>(-(value & 1)));
+}
+
+void put_u16(u8*& out, u16 value)
+{
+    *out++ = static_cast<u8>(value);
+    *out++ = static_cast<u8>(value >> 8);
+}
+
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    close();
+}
+
+bool TraceRecorder::open(const std::filesystem::path& output_path)
+{
+    close();
+    path = output_path;
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Failed to open trace file for writing: " << path << std::endl;
+        return false;
+    }
+    const u32 header[2] = { TRACE_MAGIC, TRACE_VERSION };
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+    last = {};
+    records = 0;
+    bytes_written = sizeof(header);
+    queue.start(*this, TRACE_QUEUE_CHUNKS, TRACE_CHUNK_SIZE);
+    chunk = cursor = queue.acquire();
+    chunk_end = chunk + TRACE_CHUNK_SIZE;
+    return true;
+}
+
+// writes what is still queued, detach the recorder from its instance first
+void TraceRecorder::close()
+{
+    if (!queue.running()) {
+        return;
+    }
+    queue.submit(static_cast<size_t>(cursor - chunk));
+    queue.stop();
+    file.close();
+
+    std::cout << "Traced " << records << " records to " << path << " (" << bytes_written << " bytes";
+    if (queue.stalls) {
+        std::cout << ", emulation waited for the writer " << queue.stalls << " times";
+    }
+    std::cout << ")" << std::endl;
+    if (queue.failed.load(std::memory_order_relaxed)) {
+        std::cerr << "Failed to write trace file: " << path << std::endl;
+    }
+}
+
+void TraceRecorder::record_instruction(const Gameboy& gb, u8 opcode)
+{
+    record({ gb.cycle_count, gb.PC, opcode, false, gb.AF, gb.BC, gb.DE, gb.HL, gb.SP });
+}
+
+void TraceRecorder::record_interrupt(const Gameboy& gb, u8 bit)
+{
+    record({ gb.cycle_count, gb.PC, bit, true, gb.AF, gb.BC, gb.DE, gb.HL, gb.SP });
+}
+
+void TraceRecorder::record(const TraceEntry& entry)
+{
+    if (static_cast<size_t>(chunk_end - cursor) < TRACE_MAX_RECORD) {
+        submit_chunk();
+    }
+
+    u8* out = cursor;
+    u8& flags = *out++;
+    flags = (entry.AF != last.AF ? TRACE_AF : 0) | (entry.BC != last.BC ? TRACE_BC : 0) | (entry.DE != last.DE ? TRACE_DE : 0)
+        | (entry.HL != last.HL ? TRACE_HL : 0) | (entry.SP != last.SP ? TRACE_SP : 0) | (entry.interrupt ? TRACE_INTERRUPT : 0);
+    out = put_varint(out, zigzag(static_cast<u16>(entry.PC - last.PC)));
+    *out++ = entry.opcode;
+    if (flags & TRACE_AF) {
+        put_u16(out, entry.AF);
+    }
+    if (flags & TRACE_BC) {
+        put_u16(out, entry.BC);
+    }
+    if (flags & TRACE_DE) {
+        put_u16(out, entry.DE);
+    }
+    if (flags & TRACE_HL) {
+        put_u16(out, entry.HL);
+    }
+    if (flags & TRACE_SP) {
+        put_u16(out, entry.SP);
+    }
+    out = put_varint(out, entry.cycle - last.cycle);
+
+    cursor = out;
+    last = entry;
+    records++;
+}
+
+// hands the chunk being filled to the writer and starts the next one, waiting if the ring is full
+void TraceRecorder::submit_chunk()
+{
+    queue.submit(static_cast<size_t>(cursor - chunk));
+    chunk = cursor = queue.acquire();
+    chunk_end = chunk + TRACE_CHUNK_SIZE;
+}
+
+bool TraceRecorder::write_slot(const u8* data, size_t size, u32 number)
+{
+    (void)number;
+    file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    if (!file) {
+        return false;
+    }
+    bytes_written += size;
+    return true;
+}
+
+bool TraceReader::open(const std::filesystem::path& input_path)
+{
+    path = input_path;
+    file.open(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open trace file: " << path << std::endl;
+        return false;
+    }
+    u32 header[2] = {};
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || header[0] != TRACE_MAGIC) {
+        std::cerr << "Not a trace file: " << path << std::endl;
+        return false;
+    }
+    if (header[1] != TRACE_VERSION) {
+        std::cerr << "Unsupported trace version " << header[1] << " (expected " << TRACE_VERSION << "): " << path << std::endl;
+        return false;
+    }
+    buffer.resize(TRACE_CHUNK_SIZE);
+    position = 0;
+    size = 0;
+    last = {};
+    index = 0;
+    truncated = false;
+    return true;
+}
+
+// keeps at least TRACE_MAX_RECORD bytes ahead of position unless the file ends first
+bool TraceReader::fill()
+{
+    std::memmove(buffer.data(), buffer.data() + position, size - position);
+    size -= position;
+    position = 0;
+    file.read(reinterpret_cast<char*>(buffer.data() + size), static_cast<std::streamsize>(buffer.size() - size));
+    size += static_cast<size_t>(file.gcount());
+    return size > 0;
+}
+
+bool TraceReader::next(TraceEntry& entry)
+{
+    if (size - position < TRACE_MAX_RECORD && !fill()) {
+        return false;
+    }
+
+    const u8* in = buffer.data() + position;
+    const u8* end = buffer.data() + size;
+    const auto truncate = [this] {
+        truncated = true;
+        position = size;
+        return false;
+    };
+
+    entry = last;
+    const u8 flags = *in++;
+    u64 pc_delta = 0;
+    if (!(in = get_varint(in, end, pc_delta)) || in == end) {
+        return truncate();
+    }
+    entry.PC = static_cast<u16>(last.PC + unzigzag(static_cast<u16>(pc_delta)));
+    entry.opcode = *in++;
+    entry.interrupt = flags & TRACE_INTERRUPT;
+    for (const auto& [flag, pair] : { std::pair { TRACE_AF, &entry.AF }, std::pair { TRACE_BC, &entry.BC }, std::pair { TRACE_DE, &entry.DE },
+             std::pair { TRACE_HL, &entry.HL }, std::pair { TRACE_SP, &entry.SP } }) {
+        if (flags & flag) {
+            if (end - in < 2) {
+                return truncate();
+            }
+            *pair = static_cast<u16>(in[0] | (in[1] << 8));
+            in += 2;
+        }
+    }
+    u64 cycle_delta = 0;
+    if (!(in = get_varint(in, end, cycle_delta))) {
+        return truncate();
+    }
+    entry.cycle = last.cycle + cycle_delta;
+
+    position = static_cast<size_t>(in - buffer.data());
+    last = entry;
+    index++;
+    return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "types.h"
+#include "writer_queue.h"
+
+struct Gameboy;
+
+constexpr u32 TRACE_MAGIC = 0x52544247; // "GBTR"
+constexpr u32 TRACE_VERSION = 1;
+constexpr size_t TRACE_CHUNK_SIZE = 1 << 20; // bytes the writer thread gets at a time
+constexpr u32 TRACE_QUEUE_CHUNKS = 8; // chunks that can wait for the writer before emulation blocks
+constexpr size_t TRACE_MAX_RECORD = 32; // encoded size of a record is at most 25 bytes
+
+// flags byte at the start of every record: which register pairs follow, and what the record is
+enum TraceFlag : u8 {
+    TRACE_AF = 1 << 0,
+    TRACE_BC = 1 << 1,
+    TRACE_DE = 1 << 2,
+    TRACE_HL = 1 << 3,
+    TRACE_SP = 1 << 4,
+    TRACE_INTERRUPT = 1 << 5, // interrupt dispatch, opcode holds the IF bit and the registers are the ones after it
+};
+
+// machine state as an instruction starts, or as an interrupt handler is entered
+struct TraceEntry {
+    u64 cycle = 0; // cycle_count
+    u16 PC = 0;
+    u8 opcode = 0; // first byte of the instruction (0xCB for the prefixed ones), IF bit for an interrupt
+    bool interrupt = false;
+    u16 AF = 0;
+    u16 BC = 0;
+    u16 DE = 0;
+    u16 HL = 0;
+    u16 SP = 0;
+
+    bool operator==(const TraceEntry&) const = default;
+};
+
+// streams every executed instruction and interrupt dispatch of one instance to a file. each record
+// is stored as the difference to the one before: a flags byte, the PC change and the cycle change as
+// varints, the opcode and only the register pairs that changed, about 4 bytes instead of 19 for a
+// typical instruction. the emulation thread encodes into the chunks of a WriterQueue, whose writer
+// thread streams them to disk
+struct TraceRecorder : SlotWriter {
+    std::filesystem::path path;
+    std::ofstream file;
+    u8* chunk = nullptr; // emulation thread: the chunk being filled
+    u8* cursor = nullptr; // next byte of it
+    u8* chunk_end = nullptr;
+    TraceEntry last; // emulation thread: the record the next one is encoded against
+    u64 records = 0;
+    u64 bytes_written = 0; // writer thread
+    WriterQueue queue; // TRACE_QUEUE_CHUNKS chunks of TRACE_CHUNK_SIZE bytes
+
+    TraceRecorder() = default;
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+    ~TraceRecorder() override;
+
+    bool open(const std::filesystem::path& output_path);
+    void close();
+
+    // emulation thread, called from run_opcode and check_interrupts while Gameboy::trace points here
+    void record_instruction(const Gameboy& gb, u8 opcode);
+    void record_interrupt(const Gameboy& gb, u8 bit);
+
+private:
+    void record(const TraceEntry& entry);
+    void submit_chunk();
+    bool write_slot(const u8* data, size_t size, u32 number) override;
+};
+
+// decodes a trace file front to back, in blocks, so traces larger than memory are fine
+struct TraceReader {
+    std::filesystem::path path;
+    std::ifstream file;
+    std::vector<u8> buffer;
+    size_t position = 0; // next byte in buffer
+    size_t size = 0; // valid bytes in buffer
+    TraceEntry last;
+    u64 index = 0; // records decoded so far
+    bool truncated = false; // the file ended inside a record, e.g. after a crash
+
+    bool open(const std::filesystem::path& input_path);
+    bool next(TraceEntry& entry); // false at the end of the trace
+
+private:
+    bool fill();
+};
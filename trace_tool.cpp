@@ -0,0 +1,127 @@
+#include <array>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "trace.h"
+
+// prints and compares traces written by gameboy_headless --trace, e.g. of two builds running the same
+// ROM for the same number of frames. both are streamed, so traces larger than memory are fine
+
+constexpr size_t DIFF_CONTEXT = 8; // records shown before the first difference
+constexpr std::array<std::string_view, 5> INTERRUPT_NAMES = { "vblank", "stat", "timer", "serial", "joypad" };
+
+static std::string format_entry(u64 index, const TraceEntry& entry)
+{
+    const std::string what = entry.interrupt
+        ? std::format("int {:<6}", entry.opcode < INTERRUPT_NAMES.size() ? INTERRUPT_NAMES[entry.opcode] : "?")
+        : std::format("op {:02X}     ", entry.opcode);
+    return std::format("{:>12} cycle {:>14} PC {:04X} {} AF {:04X} BC {:04X} DE {:04X} HL {:04X} SP {:04X}", index, entry.cycle, entry.PC, what,
+        entry.AF, entry.BC, entry.DE, entry.HL, entry.SP);
+}
+
+static std::string differences(const TraceEntry& a, const TraceEntry& b)
+{
+    std::string fields;
+    const auto add = [&fields](bool differs, std::string_view name) {
+        if (differs) {
+            fields += fields.empty() ? "" : ", ";
+            fields += name;
+        }
+    };
+    add(a.interrupt != b.interrupt, "kind");
+    add(a.cycle != b.cycle, "cycle");
+    add(a.PC != b.PC, "PC");
+    add(a.opcode != b.opcode, a.interrupt ? "interrupt" : "opcode");
+    add(a.AF != b.AF, "AF");
+    add(a.BC != b.BC, "BC");
+    add(a.DE != b.DE, "DE");
+    add(a.HL != b.HL, "HL");
+    add(a.SP != b.SP, "SP");
+    return fields;
+}
+
+static void warn_truncated(const TraceReader& reader)
+{
+    if (reader.truncated) {
+        std::cerr << reader.path << " ends inside a record, the trace was cut short" << std::endl;
+    }
+}
+
+static int print_trace(const std::string& path, u64 first, u64 count)
+{
+    TraceReader reader;
+    if (!reader.open(path)) {
+        return 2;
+    }
+    TraceEntry entry;
+    while (count && reader.next(entry)) {
+        if (reader.index > first) {
+            std::cout << format_entry(reader.index - 1, entry) << '\n';
+            count--;
+        }
+    }
+    warn_truncated(reader);
+    return 0;
+}
+
+// the records before the difference are the same in both traces, so the context comes from one of them
+static int diff_traces(const std::string& path_a, const std::string& path_b)
+{
+    TraceReader a;
+    TraceReader b;
+    if (!a.open(path_a) || !b.open(path_b)) {
+        return 2;
+    }
+
+    std::array<TraceEntry, DIFF_CONTEXT> context;
+    TraceEntry entry_a;
+    TraceEntry entry_b;
+    while (true) {
+        const bool more_a = a.next(entry_a);
+        const bool more_b = b.next(entry_b);
+        if (!more_a || !more_b) {
+            warn_truncated(a);
+            warn_truncated(b);
+            if (more_a == more_b) {
+                std::cout << "Traces are identical, " << a.index << " records" << std::endl;
+                return 0;
+            }
+            const TraceReader& shorter = more_a ? b : a;
+            std::cout << shorter.path << " ends after " << shorter.index << " records, the other trace goes on with" << std::endl;
+            std::cout << "  " << format_entry(shorter.index, more_a ? entry_a : entry_b) << std::endl;
+            return 1;
+        }
+        if (entry_a != entry_b) {
+            break;
+        }
+        context[(a.index - 1) % DIFF_CONTEXT] = entry_a;
+    }
+
+    const u64 index = a.index - 1;
+    std::cout << "Traces diverge at record " << index << " (" << differences(entry_a, entry_b) << ")" << std::endl;
+    for (u64 i = index - std::min<u64>(index, DIFF_CONTEXT); i < index; ++i) {
+        std::cout << "  " << format_entry(i, context[i % DIFF_CONTEXT]) << std::endl;
+    }
+    std::cout << "a " << format_entry(index, entry_a) << std::endl;
+    std::cout << "b " << format_entry(index, entry_b) << std::endl;
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    const std::string command = argc > 1 ? argv[1] : "";
+    if (command == "print" && argc >= 3) {
+        const u64 first = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 0;
+        const u64 count = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : ~u64 { 0 };
+        return print_trace(argv[2], first, count);
+    }
+    if (command == "diff" && argc == 4) {
+        return diff_traces(argv[2], argv[3]);
+    }
+    std::cerr << "Usage: " << argv[0] << " print <trace> [first_record] [count]" << std::endl;
+    std::cerr << "       " << argv[0] << " diff <trace_a> <trace_b>" << std::endl;
+    return 2;
+}
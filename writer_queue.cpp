@@ -0,0 +1,82 @@
+#include "writer_queue.h"
+
+WriterQueue::~WriterQueue()
+{
+    stop();
+}
+
+void WriterQueue::start(SlotWriter& slot_writer, u32 count, size_t size)
+{
+    stop();
+    sink = &slot_writer;
+    slot_count = count;
+    slot_size = size;
+    slots.assign(static_cast<size_t>(count) * size, 0);
+    used.assign(count, 0);
+    queued.store(0, std::memory_order_relaxed);
+    written.store(0, std::memory_order_relaxed);
+    wake_counter.store(0, std::memory_order_relaxed);
+    stopping.store(false, std::memory_order_relaxed);
+    failed.store(false, std::memory_order_relaxed);
+    stalls = 0;
+    writer = std::thread(&WriterQueue::run_writer, this);
+}
+
+void WriterQueue::stop()
+{
+    if (!writer.joinable()) {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    wake_counter.fetch_add(1, std::memory_order_release);
+    wake_counter.notify_one();
+    writer.join();
+}
+
+u8* WriterQueue::acquire()
+{
+    const u32 next = queued.load(std::memory_order_relaxed);
+    u32 done = written.load(std::memory_order_acquire);
+    if (next - done == slot_count) {
+        stalls++;
+        while (next - done == slot_count) {
+            written.wait(done, std::memory_order_acquire);
+            done = written.load(std::memory_order_acquire);
+        }
+    }
+    return slots.data() + (next % slot_count) * slot_size;
+}
+
+// the slot returned by the last acquire, with size bytes of it filled
+void WriterQueue::submit(size_t size)
+{
+    const u32 next = queued.load(std::memory_order_relaxed);
+    used[next % slot_count] = size;
+    queued.store(next + 1, std::memory_order_release);
+    wake_counter.fetch_add(1, std::memory_order_release);
+    wake_counter.notify_one();
+}
+
+void WriterQueue::run_writer()
+{
+    while (true) {
+        const u32 seen = wake_counter.load(std::memory_order_acquire);
+        const u32 ready = queued.load(std::memory_order_acquire);
+        const u32 done = written.load(std::memory_order_relaxed);
+        if (ready == done) {
+            if (stopping.load(std::memory_order_acquire)) {
+                return;
+            }
+            wake_counter.wait(seen, std::memory_order_acquire);
+            continue;
+        }
+
+        // after a write error the queue is still drained so the producer never blocks on it
+        const u32 slot = done % slot_count;
+        if (!failed.load(std::memory_order_relaxed) && !sink->write_slot(slots.data() + slot * slot_size, used[slot], done)) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+        written.store(done + 1, std::memory_order_release);
+        written.notify_one();
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+// the consumer of a WriterQueue, called on its writer thread for every slot in order
+struct SlotWriter {
+    virtual ~SlotWriter() = default;
+
+    // number counts the slots from 0, false after a write error stops further calls
+    virtual bool write_slot(const u8* data, size_t size, u32 number) = 0;
+};
+
+// a bounded ring of fixed size slots between one producer thread and a writer thread. the producer
+// fills a slot and submits it, and only blocks when every slot still waits for the writer, so a
+// disk that keeps up never slows the producer down and nothing is ever dropped
+struct WriterQueue {
+    std::vector<u8> slots; // slot_count x slot_size
+    std::vector<size_t> used; // bytes submitted in every slot
+    size_t slot_size = 0;
+    u32 slot_count = 0;
+    SlotWriter* sink = nullptr;
+    alignas(64) std::atomic<u32> queued { 0 }; // bumped by the producer
+    alignas(64) std::atomic<u32> written { 0 }; // bumped by the writer, a full queue waits on it
+    std::atomic<u32> wake_counter { 0 }; // bumped after every submit and on stop, the idle writer waits on it
+    std::atomic<bool> stopping { false };
+    std::atomic<bool> failed { false };
+    u32 stalls = 0; // times the producer had to wait for the writer
+    std::thread writer;
+
+    WriterQueue() = default;
+    WriterQueue(const WriterQueue&) = delete;
+    WriterQueue& operator=(const WriterQueue&) = delete;
+    ~WriterQueue();
+
+    void start(SlotWriter& slot_writer, u32 count, size_t size);
+    void stop(); // writes what is still queued
+    bool running() const { return writer.joinable(); }
+
+    // producer thread: the slot to fill next, waiting while the ring is full
+    u8* acquire();
+    void submit(size_t size);
+
+private:
+    void run_writer();
+};